@@ -0,0 +1,581 @@
+#include "aot.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+
+int aotNesting = 0;
+
+typedef struct {
+  FILE *out;
+  // Every function of the script, the script first, then each function
+  // before the ones nested in it. A function's index names its C function
+  // and its tables in the output.
+  Array functions;
+} Emitter;
+
+static void collectFunctions(Emitter *emitter, ObjFunction *function) {
+  writeArray(&emitter->functions, &function);
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(emitter, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+static int functionIndex(Emitter *emitter, ObjFunction *function) {
+  for (int i = 0; i < emitter->functions.count; i++) {
+    if (READ_AS(ObjFunction *, &emitter->functions, i) == function) return i;
+  }
+  return -1;
+}
+
+// A double as a C expression that reads back as exactly the same value.
+static void emitDouble(FILE *out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NAN");
+  } else if (isinf(number)) {
+    fprintf(out, number < 0 ? "-INFINITY" : "INFINITY");
+  } else {
+    fprintf(out, "%a", number);
+  }
+}
+
+static void emitStringLiteral(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char) chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      // Always three digits so a digit after it isn't read as part of it.
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static int readShort(Chunk *chunk, int offset) {
+  return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+// The constant pool index an instruction with a constant operand uses.
+static int constantOperand(Chunk *chunk, int offset) {
+  if (opInfo[chunk->code[offset]].format == OPERAND_CONSTANT_LONG) {
+    return (chunk->code[offset + 1] << 16) | readShort(chunk, offset + 2);
+  }
+  return chunk->code[offset + 1];
+}
+
+static bool isCallLike(uint8_t instruction) {
+  return instruction == OP_CALL || instruction == OP_TAIL_CALL ||
+         instruction == OP_INTRINSIC || instruction == OP_INVOKE || instruction == OP_TAIL_INVOKE ||
+         instruction == OP_SUPER_INVOKE;
+}
+
+// The C statements of the instruction at [offset], with the stack [depth]
+// deep before it. [slot] and [next] are where it and the instruction after
+// it start in the threaded code.
+static void emitInstruction(Emitter *emitter, Chunk *chunk, int offset, int depth,
+                            int slot, int next) {
+  FILE *out = emitter->out;
+  uint8_t instruction = untypedOpcode(chunk->code[offset]);
+  int d = depth;
+
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      int index = constantOperand(chunk, offset);
+      Value value = chunk->constants.values[index];
+      if (IS_NUMBER(value)) {
+        fprintf(out, "  AOT_SLOT(%d) = NUMBER_VAL(", d);
+        emitDouble(out, AS_NUMBER(value));
+        fprintf(out, ");\n");
+      } else {
+        fprintf(out, "  AOT_SLOT(%d) = AOT_CONSTANT(%d);\n", d, index);
+      }
+      break;
+    }
+    case OP_SMALL_INT:
+      fprintf(out, "  AOT_SLOT(%d) = NUMBER_VAL(%d);\n", d,
+              (int16_t) readShort(chunk, offset + 1));
+      break;
+    case OP_NIL:
+      fprintf(out, "  AOT_SLOT(%d) = NIL_VAL;\n", d);
+      break;
+    case OP_TRUE:
+      fprintf(out, "  AOT_SLOT(%d) = BOOL_VAL(true);\n", d);
+      break;
+    case OP_FALSE:
+      fprintf(out, "  AOT_SLOT(%d) = BOOL_VAL(false);\n", d);
+      break;
+    case OP_POP:
+    case OP_POPN:
+      // The stack depth is all there is to it.
+      fprintf(out, "  ;\n");
+      break;
+    case OP_GET_LOCAL:
+      fprintf(out, "  AOT_SLOT(%d) = AOT_SLOT(%d);\n", d, chunk->code[offset + 1]);
+      break;
+    case OP_SET_LOCAL:
+      fprintf(out, "  AOT_SLOT(%d) = AOT_SLOT(%d);\n", chunk->code[offset + 1], d - 1);
+      break;
+    case OP_GET_GLOBAL: {
+      int global = readShort(chunk, offset + 1);
+      fprintf(out, "  AOT_CHECK_DEFINED(%d, %d, %d);\n", d, slot, global);
+      fprintf(out, "  AOT_SLOT(%d) = AOT_GLOBAL(%d);\n", d, global);
+      break;
+    }
+    case OP_DEFINE_GLOBAL:
+      fprintf(out, "  AOT_GLOBAL(%d) = AOT_SLOT(%d);\n",
+              readShort(chunk, offset + 1), d - 1);
+      break;
+    case OP_SET_GLOBAL: {
+      int global = readShort(chunk, offset + 1);
+      fprintf(out, "  AOT_CHECK_DEFINED(%d, %d, %d);\n", d, slot, global);
+      fprintf(out, "  AOT_GLOBAL(%d) = AOT_SLOT(%d);\n", global, d - 1);
+      break;
+    }
+    case OP_GET_UPVALUE:
+      fprintf(out, "  AOT_SLOT(%d) = AOT_UPVALUE(%d);\n", d, chunk->code[offset + 1]);
+      break;
+    case OP_SET_UPVALUE:
+      fprintf(out, "  AOT_UPVALUE(%d) = AOT_SLOT(%d);\n", chunk->code[offset + 1], d - 1);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      fprintf(out, "  %s(%d, %d, AS_STRING(AOT_CONSTANT(%d)), AOT_CACHE(%d));\n",
+              instruction == OP_GET_PROPERTY ? "AOT_GET_PROPERTY" : "AOT_SET_PROPERTY", d, slot,
+              chunk->code[offset + 1], slot + threadedLength(chunk, offset) - 1);
+      break;
+    case OP_GET_SUPER:
+      fprintf(out, "  AOT_CHECK(%d, %d, aotGetSuper(AS_STRING(AOT_CONSTANT(%d))));\n",
+              d, slot, chunk->code[offset + 1]);
+      break;
+    case OP_EQUAL:
+      fprintf(out, "  AOT_SLOT(%d) = BOOL_VAL(valuesEqual(AOT_SLOT(%d), AOT_SLOT(%d)));\n",
+              d - 2, d - 2, d - 1);
+      break;
+    case OP_EQUAL_PRESERVE:
+      fprintf(out, "  AOT_SLOT(%d) = BOOL_VAL(valuesEqual(AOT_SLOT(%d), AOT_SLOT(%d)));\n",
+              d - 1, d - 2, d - 1);
+      break;
+    case OP_GREATER:
+      fprintf(out, "  AOT_BINARY(%d, %d, BOOL_VAL, >);\n", d, slot);
+      break;
+    case OP_LESS:
+      fprintf(out, "  AOT_BINARY(%d, %d, BOOL_VAL, <);\n", d, slot);
+      break;
+    case OP_ADD:
+      fprintf(out, "  if (IS_NUMBER(AOT_SLOT(%d)) && IS_NUMBER(AOT_SLOT(%d))) {\n", d - 2, d - 1);
+      fprintf(out, "    AOT_SLOT(%d) = NUMBER_VAL(AS_NUMBER(AOT_SLOT(%d)) + AS_NUMBER(AOT_SLOT(%d)));\n",
+              d - 2, d - 2, d - 1);
+      fprintf(out, "  } else {\n");
+      fprintf(out, "    AOT_CHECK(%d, %d, aotAdd());\n", d, slot);
+      fprintf(out, "  }\n");
+      break;
+    case OP_SUBTRACT:
+      fprintf(out, "  AOT_BINARY(%d, %d, NUMBER_VAL, -);\n", d, slot);
+      break;
+    case OP_MULTIPLY:
+      fprintf(out, "  AOT_BINARY(%d, %d, NUMBER_VAL, *);\n", d, slot);
+      break;
+    case OP_DIVIDE:
+      fprintf(out, "  AOT_BINARY(%d, %d, NUMBER_VAL, /);\n", d, slot);
+      break;
+    case OP_NOT:
+      fprintf(out, "  AOT_SLOT(%d) = BOOL_VAL(AOT_FALSEY(AOT_SLOT(%d)));\n", d - 1, d - 1);
+      break;
+    case OP_NEGATE:
+      fprintf(out, "  if (!IS_NUMBER(AOT_SLOT(%d))) {\n", d - 1);
+      fprintf(out, "    AOT_RUNTIME_ERROR(%d, %d, \"Operand must be a number.\");\n", d, slot);
+      fprintf(out, "  }\n");
+      fprintf(out, "  AOT_SLOT(%d) = NUMBER_VAL(-AS_NUMBER(AOT_SLOT(%d)));\n", d - 1, d - 1);
+      break;
+    case OP_PRINT:
+      fprintf(out, "  printValue(AOT_SLOT(%d));\n", d - 1);
+      fprintf(out, "  printf(\"\\n\");\n");
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      fprintf(out, "  if (AOT_FALSEY(AOT_SLOT(%d))) goto L%d;\n", d - 1, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+      fprintf(out, "  if (%svaluesEqual(AOT_SLOT(%d), AOT_SLOT(%d))) goto L%d;\n",
+              instruction == OP_JUMP_IF_NOT_EQUAL ? "!" : "", d - 2, d - 1,
+              jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_IMM:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+    case OP_JUMP_IF_NOT_GREATER_IMM:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM: {
+      // '<=' and '>=' negate '>' and '<' like the interpreter does, NaN
+      // included.
+      const char *condition;
+      switch (instruction) {
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_IMM:
+          condition = "!(a < b)";
+          break;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+          condition = "a > b";
+          break;
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_IMM:
+          condition = "!(a > b)";
+          break;
+        default:
+          condition = "a < b";
+          break;
+      }
+      if (opInfo[instruction].format == OPERAND_IMMEDIATE_JUMP) {
+        fprintf(out, "  {\n    AOT_NUMBER_IMMEDIATE(%d, %d, %d);\n", d, slot,
+                (int16_t) readShort(chunk, offset + 1));
+      } else {
+        fprintf(out, "  {\n    AOT_NUMBERS(%d, %d);\n", d, slot);
+      }
+      fprintf(out, "    if (%s) goto L%d;\n  }\n", condition, jumpTarget(chunk, offset));
+      break;
+    }
+    case OP_ADD_IMM:
+    case OP_SUBTRACT_IMM:
+    case OP_GREATER_IMM:
+    case OP_LESS_IMM: {
+      const char *valueType = "NUMBER_VAL";
+      const char *op = "+";
+      const char *message = "Operands must be numbers.";
+      switch (instruction) {
+        case OP_ADD_IMM:
+          message = "Operands must be two numbers or two strings";
+          break;
+        case OP_SUBTRACT_IMM:
+          op = "-";
+          break;
+        case OP_GREATER_IMM:
+          valueType = "BOOL_VAL";
+          op = ">";
+          break;
+        default:
+          valueType = "BOOL_VAL";
+          op = "<";
+          break;
+      }
+      fprintf(out, "  AOT_IMMEDIATE(%d, %d, %s, %s, %d, \"%s\");\n", d, slot, valueType,
+              op, (int16_t) readShort(chunk, offset + 1), message);
+      break;
+    }
+    case OP_CALL:
+      fprintf(out, "  AOT_CALL(%d, %d, aotCallClosure(%d));\n", d, next, chunk->code[offset + 1]);
+      break;
+    case OP_INTRINSIC:
+      fprintf(out, "  AOT_CALL(%d, %d, aotIntrinsic(%d));\n", d, next, chunk->code[offset + 1]);
+      break;
+    case OP_TAIL_CALL:
+      fprintf(out, "  AOT_TAIL_CALL(%d, %d, aotTailCall(%d));\n", d, next,
+              chunk->code[offset + 1]);
+      break;
+    case OP_TAIL_INVOKE:
+      fprintf(out, "  AOT_TAIL_CALL(%d, %d, aotTailInvoke(AS_STRING(AOT_CONSTANT(%d)), %d, AOT_CACHE(%d)));\n",
+              d, next, chunk->code[offset + 1], chunk->code[offset + 2],
+              slot + threadedLength(chunk, offset) - 1);
+      break;
+    case OP_INVOKE:
+      fprintf(out, "  AOT_CALL(%d, %d, aotInvokeCached(AS_STRING(AOT_CONSTANT(%d)), %d, AOT_CACHE(%d)));\n",
+              d, next, chunk->code[offset + 1], chunk->code[offset + 2],
+              slot + threadedLength(chunk, offset) - 1);
+      break;
+    case OP_SUPER_INVOKE:
+      fprintf(out, "  AOT_CALL(%d, %d, aotSuperInvoke(AS_STRING(AOT_CONSTANT(%d)), %d));\n",
+              d, next, chunk->code[offset + 1], chunk->code[offset + 2]);
+      break;
+    case OP_CLOSURE:
+      fprintf(out, "  AOT_SYNC(%d, %d);\n", d, slot);
+      fprintf(out, "  aotClosure(AS_FUNCTION(AOT_CONSTANT(%d)), code + %d);\n",
+              chunk->code[offset + 1], slot + 2);
+      break;
+    case OP_CLOSE_UPVALUE:
+      fprintf(out, "  AOT_SYNC(%d, %d);\n", d, slot);
+      fprintf(out, "  aotCloseUpvalue();\n");
+      break;
+    case OP_RETURN:
+      fprintf(out, "  AOT_RETURN(%d, %d);\n", d, slot);
+      break;
+    case OP_CLASS:
+      fprintf(out, "  AOT_SYNC(%d, %d);\n", d, slot);
+      fprintf(out, "  aotClass(AS_STRING(AOT_CONSTANT(%d)));\n", chunk->code[offset + 1]);
+      break;
+    case OP_INHERIT:
+      fprintf(out, "  AOT_CHECK(%d, %d, aotInherit());\n", d, slot);
+      break;
+    case OP_METHOD:
+      fprintf(out, "  AOT_SYNC(%d, %d);\n", d, slot);
+      fprintf(out, "  aotMethod(AS_STRING(AOT_CONSTANT(%d)));\n", chunk->code[offset + 1]);
+      break;
+    default:
+      // The quickened forms and superinstructions only exist in threaded
+      // code.
+      fprintf(out, "  #error \"%s can't be compiled\"\n", opInfo[instruction].name);
+      break;
+  }
+}
+
+static void emitFunction(Emitter *emitter, int index) {
+  FILE *out = emitter->out;
+  ObjFunction *function = READ_AS(ObjFunction *, &emitter->functions, index);
+  Chunk *chunk = &function->chunk;
+
+  // Where each instruction starts in the threaded code, laid out the same
+  // way as threadChunk() will lay it out at runtime.
+  int *slotAt = ALLOCATE(int, chunk->count + 1);
+  int slotCount = 0;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    slotAt[offset] = slotCount;
+    slotCount += threadedLength(chunk, offset);
+  }
+  slotAt[chunk->count] = slotCount;
+
+  int *depthAt = ALLOCATE(int, chunk->count);
+  stackDepths(chunk, function->arity + 1, depthAt);
+
+  // Labels go on the targets of jumps and on the instructions after calls,
+  // where a frame can be picked up again.
+  bool *labelled = ALLOCATE(bool, chunk->count + 1);
+  bool *resumes = ALLOCATE(bool, chunk->count + 1);
+  for (int offset = 0; offset <= chunk->count; offset++) {
+    labelled[offset] = false;
+    resumes[offset] = false;
+  }
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (depthAt[offset] == -1) continue;
+    uint8_t instruction = chunk->code[offset];
+    if (isJump(instruction)) {
+      labelled[jumpTarget(chunk, offset)] = true;
+    }
+    if (isCallLike(instruction)) resumes[offset + instructionLength(chunk, offset)] = true;
+  }
+
+  fprintf(out, "// %s\n", function->name != NULL ? function->name->chars : "<script>");
+  fprintf(out, "static int function%d() {\n", index);
+  fprintf(out, "  CallFrame *frame = &vm.frames[vm.frameCount - 1];\n");
+  fprintf(out, "  Value *slots = frame->slots;\n");
+  fprintf(out, "  Code *code = frame->closure->function->chunk.threaded;\n");
+  fprintf(out, "  Value *constants = frame->closure->function->chunk.constants.values;\n");
+  fprintf(out, "  (void) constants;\n\n");
+  // Calls start at the top, which the code falls into. The trampoline may
+  // also pick a frame up after one of its calls.
+  fprintf(out, "  if (frame->ip != code) {\n");
+  fprintf(out, "    switch (frame->ip - code) {\n");
+  for (int offset = 1; offset < chunk->count; offset++) {
+    if (resumes[offset]) {
+      fprintf(out, "      case %d: goto L%d;\n", slotAt[offset], offset);
+      labelled[offset] = true;
+    }
+  }
+  fprintf(out, "    }\n");
+  fprintf(out, "    return AOT_ERROR;\n");
+  fprintf(out, "  }\n");
+
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    // Code nothing jumps to doesn't get a depth, and doesn't need C.
+    if (depthAt[offset] == -1) continue;
+    uint8_t instruction = chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    fprintf(out, "\n");
+    if (labelled[offset]) fprintf(out, "L%d:\n", offset);
+    fprintf(out, "  // %s\n", opInfo[instruction].name);
+    emitInstruction(emitter, chunk, offset, depthAt[offset], slotAt[offset], slotAt[next]);
+  }
+  fprintf(out, "}\n\n");
+
+  FREE_ARRAY(int, slotAt, chunk->count + 1);
+  FREE_ARRAY(int, depthAt, chunk->count);
+  FREE_ARRAY(bool, labelled, chunk->count + 1);
+  FREE_ARRAY(bool, resumes, chunk->count + 1);
+}
+
+// The bytecode and constants the runtime rebuilds the function from.
+static void emitTables(Emitter *emitter, int index) {
+  FILE *out = emitter->out;
+  ObjFunction *function = READ_AS(ObjFunction *, &emitter->functions, index);
+  Chunk *chunk = &function->chunk;
+
+  fprintf(out, "static const uint8_t code%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++) {
+    fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+    if (i < chunk->count - 1) fputc(',', out);
+  }
+  fprintf(out, "\n};\n");
+
+  fprintf(out, "static const int lines%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++) {
+    fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+    if (i < chunk->count - 1) fputc(',', out);
+  }
+  fprintf(out, "\n};\n");
+
+  // C has no empty arrays, a function without constants gets NULL instead.
+  ValueArray *constants = &chunk->constants;
+  if (constants->count == 0) return;
+  fprintf(out, "static const AotConstant constants%d[] = {\n", index);
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    if (IS_NUMBER(value)) {
+      fprintf(out, "    {AOT_NUMBER, ");
+      emitDouble(out, AS_NUMBER(value));
+      fprintf(out, ", NULL, 0, 0},\n");
+    } else if (IS_STRING(value)) {
+      fprintf(out, "    {AOT_STRING, 0, ");
+      emitStringLiteral(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+      fprintf(out, ", %d, 0},\n", AS_STRING(value)->length);
+    } else {
+      fprintf(out, "    {AOT_FUNCTION, 0, NULL, 0, %d},\n",
+              functionIndex(emitter, AS_FUNCTION(value)));
+    }
+  }
+  fprintf(out, "};\n");
+}
+
+InterpretResult emitC(const char *source, FILE *out) {
+  ObjFunction *script = compile(source);
+  if (script == NULL) return INTERPRET_COMPILE_ERROR;
+  // Collecting the functions allocates.
+  push(OBJ_VAL(script));
+
+  Emitter emitter;
+  emitter.out = out;
+  initArray(&emitter.functions, sizeof(ObjFunction *));
+  collectFunctions(&emitter, script);
+  int count = emitter.functions.count;
+
+  fprintf(out, "// Generated by clox --emit-c. Build it against the runtime library:\n");
+  fprintf(out, "//   cc -O2 -I<clox sources> <this file> <clox build>/libcloxrt.a\n\n");
+#ifdef JIT
+  // The VM's layout depends on it, so the program has to agree with the
+  // library.
+  fprintf(out, "#ifndef JIT\n#define JIT 1\n#endif\n\n");
+#endif
+  fprintf(out, "#include <math.h>\n\n#include \"aot.h\"\n\n");
+
+  for (int i = 0; i < count; i++) {
+    fprintf(out, "static int function%d();\n", i);
+  }
+  fprintf(out, "\n");
+  for (int i = 0; i < count; i++) {
+    emitFunction(&emitter, i);
+  }
+  for (int i = 0; i < count; i++) {
+    emitTables(&emitter, i);
+  }
+
+  fprintf(out, "\nstatic const AotFunction functions[] = {\n");
+  for (int i = 0; i < count; i++) {
+    ObjFunction *function = READ_AS(ObjFunction *, &emitter.functions, i);
+    fprintf(out, "    {");
+    if (function->name != NULL) {
+      emitStringLiteral(out, function->name->chars, function->name->length);
+    } else {
+      fprintf(out, "NULL");
+    }
+    fprintf(out, ", %d, %d, %d, code%d, lines%d, %d, ", function->arity,
+            function->upvalueCount, function->maxStack, i, i, function->chunk.count);
+    if (function->chunk.constants.count > 0) {
+      fprintf(out, "constants%d, %d, ", i, function->chunk.constants.count);
+    } else {
+      fprintf(out, "NULL, 0, ");
+    }
+    fprintf(out, "function%d},\n", i);
+  }
+  fprintf(out, "};\n\n");
+
+  // The compiler resolved global names to slots, which the program has to
+  // hand out the same way.
+  fprintf(out, "static const char *const globals[] = {\n");
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    ObjString *name = AS_STRING(vm.globalNames.values[i]);
+    fprintf(out, "    ");
+    emitStringLiteral(out, name->chars, name->length);
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static const AotProgram program = {globals, %d, functions, %d};\n\n",
+          vm.globalNames.count, count);
+  fprintf(out, "int main() {\n  return aotMain(&program);\n}\n");
+
+  freeArray(&emitter.functions);
+  pop();
+  return INTERPRET_OK;
+}
+
+// Rebuild the function at [index] and the ones nested in it.
+static ObjFunction *loadFunction(const AotProgram *program, int index) {
+  const AotFunction *emitted = &program->functions[index];
+  ObjFunction *function = newFunction();
+  // Everything below allocates.
+  push(OBJ_VAL(function));
+
+  function->arity = emitted->arity;
+  function->upvalueCount = emitted->upvalueCount;
+  function->maxStack = emitted->maxStack;
+  function->aot = emitted->entry;
+  if (emitted->name != NULL) {
+    function->name = copyString(emitted->name, (int) strlen(emitted->name));
+  }
+  for (int i = 0; i < emitted->count; i++) {
+    writeChunk(&function->chunk, emitted->code[i], emitted->lines[i]);
+  }
+  for (int i = 0; i < emitted->constantCount; i++) {
+    const AotConstant *constant = &emitted->constants[i];
+    switch (constant->type) {
+      case AOT_NUMBER:
+        addConstant(&function->chunk, NUMBER_VAL(constant->number));
+        break;
+      case AOT_STRING:
+        addConstant(&function->chunk, OBJ_VAL(copyString(constant->chars, constant->length)));
+        break;
+      case AOT_FUNCTION:
+        addConstant(&function->chunk, OBJ_VAL(loadFunction(program, constant->function)));
+        break;
+    }
+  }
+  classifyInline(function);
+
+  pop();
+  return function;
+}
+
+int aotMain(const AotProgram *program) {
+  initVM();
+#ifdef JIT
+  // Everything is compiled already.
+  vm.jit = false;
+#endif
+
+  for (int i = 0; i < program->globalCount; i++) {
+    const char *name = program->globals[i];
+    if (globalSlot(copyString(name, (int) strlen(name))) != i) {
+      fprintf(stderr, "The program's globals don't match the runtime's.\n");
+      freeVM();
+      return 70;
+    }
+  }
+
+  InterpretResult result = interpretCompiled(loadFunction(program, 0));
+  freeVM();
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,331 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Ahead of time compilation to C. `clox --emit-c` turns every function of a
+// script into a C function with one block of statements per instruction,
+// and writes those along with the bytecode itself into a C file. Built and
+// linked against the cloxrt library, that file is a program that runs the
+// script without dispatching a single instruction.
+//
+// The C works on the VM's stack and call frames the way the JIT's machine
+// code does, so objects, the GC and runtime errors are all the interpreter's.
+// The stack depth at each instruction is known when emitting, so values are
+// addressed as slots of the frame and the stack top is only stored for the
+// helpers below. A call runs the callee's C function straight from the call
+// site, up to AOT_NESTING_MAX deep. Past that, and after tail calls, frames
+// go back to a trampoline in vm.c so deep Lox recursion can't overflow the C
+// stack.
+
+// What a compiled function returns to the trampoline, or a helper to it.
+typedef enum {
+  // Go on with the next instruction in the same frame
+  AOT_CONTINUE,
+  // A call or return changed the top frame, run it from its ip
+  AOT_SWITCH,
+  // The script returned
+  AOT_DONE,
+  AOT_ERROR
+} AotStatus;
+
+// A constant of an emitted function
+typedef enum {
+  AOT_NUMBER,
+  AOT_STRING,
+  AOT_FUNCTION
+} AotConstantType;
+
+typedef struct {
+  AotConstantType type;
+  double number;
+  const char *chars;
+  int length;
+  // An index into AotProgram.functions
+  int function;
+} AotConstant;
+
+// An emitted function. The bytecode comes along because the runtime still
+// threads it, for the inline caches and the line numbers of runtime errors.
+typedef struct {
+  // NULL for the script
+  const char *name;
+  int arity;
+  int upvalueCount;
+  int maxStack;
+  const uint8_t *code;
+  const int *lines;
+  int count;
+  const AotConstant *constants;
+  int constantCount;
+  AotEntry entry;
+} AotFunction;
+
+typedef struct {
+  // The names of the global variables, in slot order
+  const char *const *globals;
+  int globalCount;
+  // The script first
+  const AotFunction *functions;
+  int functionCount;
+} AotProgram;
+
+// Compile [source] and write it out as a C program to [out]. Returns
+// INTERPRET_COMPILE_ERROR if the script doesn't compile.
+InterpretResult emitC(const char *source, FILE *out);
+
+// The main() of an emitted program. Returns its exit code.
+int aotMain(const AotProgram *program);
+
+// Run [script], whose functions all have an entry, to completion.
+InterpretResult interpretCompiled(ObjFunction *script);
+
+// Helpers in vm.c the emitted code calls. Each works on vm.stackTop, which
+// the code stores before the call. Those that can fail report the runtime
+// error themselves and return false, or AOT_ERROR.
+void aotRuntimeError(const char *message);
+void aotUndefinedVariable(int slot);
+bool aotAdd();
+bool aotGetProperty(ObjString *name, InlineCache *cache);
+bool aotSetProperty(ObjString *name, InlineCache *cache);
+bool aotGetSuper(ObjString *name);
+void aotClosure(ObjFunction *function, Code *operands);
+void aotCloseUpvalue();
+void aotClass(ObjString *name);
+bool aotInherit();
+void aotMethod(ObjString *name);
+AotStatus aotCall(int argCount);
+AotStatus aotTailCall(int argCount);
+AotStatus aotIntrinsic(int id);
+AotStatus aotInvoke(ObjString *name, int argCount, InlineCache *cache);
+AotStatus aotTailInvoke(ObjString *name, int argCount, InlineCache *cache);
+AotStatus aotSuperInvoke(ObjString *name, int argCount);
+AotStatus aotReturn();
+
+// The vocabulary of the emitted code. Each compiled function has these
+// locals: the CallFrame it runs in, the frame's slots, the threaded code of
+// its chunk and the chunk's constants.
+#define AOT_SLOT(index) (slots[index])
+#define AOT_CONSTANT(index) (constants[index])
+#define AOT_GLOBAL(slot) (vm.globalValues.values[slot])
+#define AOT_UPVALUE(index) (*frame->closure->upvalues[index]->location)
+#define AOT_CACHE(slot) (code[slot].cache)
+#define AOT_FALSEY(value)                                                      \
+  (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+// Make the VM state match the instruction at threaded code slot [slot] with
+// the stack [depth] deep, before calling into the runtime. ip is left past
+// the handler slot, as the interpreter leaves it while running it.
+#define AOT_SYNC(depth, slot)                                                  \
+  (vm.stackTop = slots + (depth), frame->ip = code + (slot) + 1)
+#define AOT_RUNTIME_ERROR(depth, slot, message)                                \
+  do {                                                                         \
+    AOT_SYNC(depth, slot);                                                     \
+    aotRuntimeError(message);                                                  \
+    return AOT_ERROR;                                                          \
+  } while (false)
+#define AOT_CHECK(depth, slot, call)                                           \
+  do {                                                                         \
+    AOT_SYNC(depth, slot);                                                     \
+    if (!(call)) return AOT_ERROR;                                             \
+  } while (false)
+#define AOT_CHECK_DEFINED(depth, slot, global)                                 \
+  do {                                                                         \
+    if (IS_UNDEFINED(AOT_GLOBAL(global))) {                                    \
+      AOT_SYNC(depth, slot);                                                   \
+      aotUndefinedVariable(global);                                            \
+      return AOT_ERROR;                                                        \
+    }                                                                          \
+  } while (false)
+// [a] op [b] on the two values at the top of a stack [depth] deep, leaving
+// the result in place of [a].
+#define AOT_BINARY(depth, slot, valueType, op)                                 \
+  do {                                                                         \
+    Value a = AOT_SLOT((depth) - 2);                                           \
+    Value b = AOT_SLOT((depth) - 1);                                           \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      AOT_RUNTIME_ERROR(depth, slot, "Operands must be numbers.");             \
+    }                                                                          \
+    AOT_SLOT((depth) - 2) = valueType(AS_NUMBER(a) op AS_NUMBER(b));           \
+  } while (false)
+#define AOT_IMMEDIATE(depth, slot, valueType, op, immediate, message)          \
+  do {                                                                         \
+    Value a = AOT_SLOT((depth) - 1);                                           \
+    if (!IS_NUMBER(a)) AOT_RUNTIME_ERROR(depth, slot, message);                \
+    AOT_SLOT((depth) - 1) = valueType(AS_NUMBER(a) op (immediate));            \
+  } while (false)
+// Sets [a] and [b] from the numbers on top of the stack for a fused
+// compare-jump.
+#define AOT_NUMBERS(depth, slot)                                               \
+  Value aValue = AOT_SLOT((depth) - 2);                                        \
+  Value bValue = AOT_SLOT((depth) - 1);                                        \
+  if (!IS_NUMBER(aValue) || !IS_NUMBER(bValue)) {                              \
+    AOT_RUNTIME_ERROR(depth, slot, "Operands must be numbers.");               \
+  }                                                                            \
+  double a = AS_NUMBER(aValue);                                                \
+  double b = AS_NUMBER(bValue)
+#define AOT_NUMBER_IMMEDIATE(depth, slot, immediate)                           \
+  Value aValue = AOT_SLOT((depth) - 1);                                        \
+  if (!IS_NUMBER(aValue)) {                                                    \
+    AOT_RUNTIME_ERROR(depth, slot, "Operands must be numbers.");               \
+  }                                                                            \
+  double a = AS_NUMBER(aValue);                                                \
+  double b = (immediate)
+// How deep compiled calls nest on the C stack. A call past this returns to
+// the trampoline, which runs the callee and then picks the caller back up.
+#define AOT_NESTING_MAX 512
+
+extern int aotNesting;
+
+// Run the frame a call just pushed, and any it calls in turn, until one
+// returns into the caller's frame, the [frameCount]th. Calling the callee
+// from the call site and carrying on right after it when it returns keeps
+// both as predictable for the CPU as a C call.
+static inline AotStatus aotRunCallee(int frameCount) {
+  if (aotNesting == AOT_NESTING_MAX) return AOT_SWITCH;
+  aotNesting++;
+  AotStatus status;
+  do {
+    status = vm.frames[vm.frameCount - 1].closure->function->aot();
+  } while (status == AOT_SWITCH && vm.frameCount > frameCount);
+  aotNesting--;
+  return status == AOT_SWITCH ? AOT_CONTINUE : status;
+}
+
+// The slot of the field [cache] resolved its name to on [instance] without
+// changing its shape, or -1.
+static inline int aotCachedField(ObjInstance *instance, InlineCache *cache) {
+  for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+    CacheEntry *entry = &cache->entries[i];
+    if (entry->shape != instance->shape) continue;
+    if (entry->transition != NULL) return -1;
+#ifdef DEBUG_INLINE_CACHE_STATS
+    if (entry->slot >= 0) vm.cacheHits++;
+#endif
+    return entry->slot;
+  }
+  return -1;
+}
+
+// Field accesses the inline cache knows happen in the emitted code, the rest
+// in aotGetProperty() and aotSetProperty().
+#define AOT_GET_PROPERTY(depth, slot, name, cache)                             \
+  do {                                                                         \
+    Value receiver = AOT_SLOT((depth) - 1);                                    \
+    int field = IS_INSTANCE(receiver)                                          \
+                    ? aotCachedField(AS_INSTANCE(receiver), cache)             \
+                    : -1;                                                      \
+    if (field >= 0) {                                                          \
+      AOT_SLOT((depth) - 1) = AS_INSTANCE(receiver)->fields[field];            \
+    } else {                                                                   \
+      AOT_CHECK(depth, slot, aotGetProperty(name, cache));                     \
+    }                                                                          \
+  } while (false)
+#define AOT_SET_PROPERTY(depth, slot, name, cache)                             \
+  do {                                                                         \
+    Value receiver = AOT_SLOT((depth) - 2);                                    \
+    int field = IS_INSTANCE(receiver)                                          \
+                    ? aotCachedField(AS_INSTANCE(receiver), cache)             \
+                    : -1;                                                      \
+    if (field >= 0) {                                                          \
+      AS_INSTANCE(receiver)->fields[field] = AOT_SLOT((depth) - 1);            \
+      AOT_SLOT((depth) - 2) = AOT_SLOT((depth) - 1);                           \
+    } else {                                                                   \
+      AOT_CHECK(depth, slot, aotSetProperty(name, cache));                     \
+    }                                                                          \
+  } while (false)
+
+// Push a frame for calling [closure] with the [argCount] arguments on top of
+// the stack, if nothing about it needs the checks and growing call() does.
+static inline bool aotPushFrame(ObjClosure *closure, int argCount) {
+  ObjFunction *function = closure->function;
+  Value *base = vm.stackTop - argCount - 1;
+  if (function->arity != argCount || vm.frameCount == vm.frameCapacity ||
+      function->chunk.threaded == NULL ||
+      (base - vm.stack) + function->maxStack + STACK_RESERVE > vm.stackCapacity) {
+    return false;
+  }
+  CallFrame *frame = &vm.frames[vm.frameCount++];
+  frame->closure = closure;
+  frame->ip = function->chunk.threaded;
+  frame->slots = base;
+  return true;
+}
+
+// aotCall() and aotInvoke() without leaving the emitted code for the usual
+// cases: a closure, and a method the inline cache knows.
+static inline AotStatus aotCallClosure(int argCount) {
+  Value callee = vm.stackTop[-1 - argCount];
+  if (IS_CLOSURE(callee) && aotPushFrame(AS_CLOSURE(callee), argCount)) {
+    return AOT_SWITCH;
+  }
+  return aotCall(argCount);
+}
+
+static inline AotStatus aotInvokeCached(ObjString *name, int argCount, InlineCache *cache) {
+  Value receiver = vm.stackTop[-1 - argCount];
+  if (IS_INSTANCE(receiver)) {
+    ObjShape *shape = AS_INSTANCE(receiver)->shape;
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+      CacheEntry *entry = &cache->entries[i];
+      if (entry->shape != shape) continue;
+      // An entry with a slot is a field, which may hold anything. invoke()
+      // runs the methods simple enough to need no frame in place.
+      if (entry->slot < 0 && entry->method != NULL &&
+          entry->method->function->inlineKind == INLINE_NONE &&
+          aotPushFrame(entry->method, argCount)) {
+#ifdef DEBUG_INLINE_CACHE_STATS
+        vm.cacheHits++;
+#endif
+        return AOT_SWITCH;
+      }
+      break;
+    }
+  }
+  return aotInvoke(name, argCount, cache);
+}
+
+// A call or invoke. [next] is the slot of the instruction after it, where
+// the trampoline picks the frame up if the callee doesn't return here. The
+// callee may have moved the frames and the stack.
+#define AOT_CALL(depth, next, call)                                            \
+  do {                                                                         \
+    int frameCount = vm.frameCount;                                            \
+    vm.stackTop = slots + (depth);                                             \
+    frame->ip = code + (next);                                                 \
+    AotStatus status = (call);                                                 \
+    if (status == AOT_SWITCH) status = aotRunCallee(frameCount);               \
+    if (status != AOT_CONTINUE) return status;                                 \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    slots = frame->slots;                                                      \
+  } while (false)
+// Return the value on top of a stack [depth] deep. Unless the frame has
+// upvalues to close or is the script's, that's just a matter of moving it
+// to slot zero and dropping the frame.
+#define AOT_RETURN(depth, slot)                                                \
+  do {                                                                         \
+    if (vm.frameCount > 1 &&                                                   \
+        (vm.openUpvalues == NULL || vm.openUpvalues->location < slots)) {      \
+      slots[0] = AOT_SLOT((depth) - 1);                                        \
+      vm.stackTop = slots + 1;                                                 \
+      vm.frameCount--;                                                         \
+      return AOT_SWITCH;                                                       \
+    }                                                                          \
+    AOT_SYNC(depth, slot);                                                     \
+    return aotReturn();                                                        \
+  } while (false)
+// A tail call or tail invoke replaces the frame, so the trampoline runs the
+// callee instead.
+#define AOT_TAIL_CALL(depth, next, call)                                       \
+  do {                                                                         \
+    vm.stackTop = slots + (depth);                                             \
+    frame->ip = code + (next);                                                 \
+    AotStatus status = (call);                                                 \
+    if (status != AOT_CONTINUE) return status;                                 \
+  } while (false)
+
+#endif
@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 
@@ -10,12 +11,20 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->threaded = NULL;
+    chunk->threadedCount = 0;
+    chunk->threadedOffsets = NULL;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
 }
 
 void freeChunk(Chunk *chunk) {
     // Free the memory in the code array
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(Code, chunk->threaded, chunk->threadedCount);
+    FREE_ARRAY(int, chunk->threadedOffsets, chunk->threadedCount);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCount);
     // Free the constants
     freeValueArray(&chunk->constants);
     // Reset the state of the chunk
@@ -65,3 +74,479 @@ void writeConstant(Chunk *chunk, Value value, int line) {
     }
 }
 
+
+const OpInfo opInfo[] = {
+        [OP_CONSTANT] = {"OP_CONSTANT", OPERAND_CONSTANT, 1},
+        [OP_CONSTANT_LONG] = {"OP_CONSTANT_LONG", OPERAND_CONSTANT_LONG, 1},
+        [OP_SMALL_INT] = {"OP_SMALL_INT", OPERAND_IMMEDIATE, 1},
+        [OP_NIL] = {"OP_NIL", OPERAND_NONE, 1},
+        [OP_TRUE] = {"OP_TRUE", OPERAND_NONE, 1},
+        [OP_FALSE] = {"OP_FALSE", OPERAND_NONE, 1},
+        [OP_POP] = {"OP_POP", OPERAND_NONE, -1},
+        [OP_POPN] = {"OP_POPN", OPERAND_BYTE, 0},
+        [OP_GET_LOCAL] = {"OP_GET_LOCAL", OPERAND_BYTE, 1},
+        [OP_SET_LOCAL] = {"OP_SET_LOCAL", OPERAND_BYTE, 0},
+        [OP_GET_GLOBAL] = {"OP_GET_GLOBAL", OPERAND_GLOBAL, 1},
+        [OP_DEFINE_GLOBAL] = {"OP_DEFINE_GLOBAL", OPERAND_GLOBAL, -1},
+        [OP_SET_GLOBAL] = {"OP_SET_GLOBAL", OPERAND_GLOBAL, 0},
+        [OP_GET_UPVALUE] = {"OP_GET_UPVALUE", OPERAND_BYTE, 1},
+        [OP_SET_UPVALUE] = {"OP_SET_UPVALUE", OPERAND_BYTE, 0},
+        [OP_GET_PROPERTY] = {"OP_GET_PROPERTY", OPERAND_CONSTANT, 0},
+        [OP_SET_PROPERTY] = {"OP_SET_PROPERTY", OPERAND_CONSTANT, -1},
+        [OP_GET_SUPER] = {"OP_GET_SUPER", OPERAND_CONSTANT, -1},
+        [OP_EQUAL] = {"OP_EQUAL", OPERAND_NONE, -1},
+        [OP_EQUAL_PRESERVE] = {"OP_EQUAL_PRESERVE", OPERAND_NONE, 0},
+        [OP_GREATER] = {"OP_GREATER", OPERAND_NONE, -1},
+        [OP_LESS] = {"OP_LESS", OPERAND_NONE, -1},
+        [OP_ADD] = {"OP_ADD", OPERAND_NONE, -1},
+        [OP_SUBTRACT] = {"OP_SUBTRACT", OPERAND_NONE, -1},
+        [OP_MULTIPLY] = {"OP_MULTIPLY", OPERAND_NONE, -1},
+        [OP_DIVIDE] = {"OP_DIVIDE", OPERAND_NONE, -1},
+        [OP_NOT] = {"OP_NOT", OPERAND_NONE, 0},
+        [OP_NEGATE] = {"OP_NEGATE", OPERAND_NONE, 0},
+        [OP_PRINT] = {"OP_PRINT", OPERAND_NONE, -1},
+        [OP_JUMP] = {"OP_JUMP", OPERAND_JUMP, 0},
+        [OP_JUMP_IF_FALSE] = {"OP_JUMP_IF_FALSE", OPERAND_JUMP, 0},
+        [OP_LOOP] = {"OP_LOOP", OPERAND_LOOP, 0},
+        [OP_JUMP_IF_NOT_EQUAL] = {"OP_JUMP_IF_NOT_EQUAL", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_EQUAL] = {"OP_JUMP_IF_EQUAL", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_LESS] = {"OP_JUMP_IF_NOT_LESS", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = {"OP_JUMP_IF_NOT_LESS_EQUAL", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_GREATER] = {"OP_JUMP_IF_NOT_GREATER", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = {"OP_JUMP_IF_NOT_GREATER_EQUAL", OPERAND_JUMP, -2},
+        [OP_ADD_IMM] = {"OP_ADD_IMM", OPERAND_IMMEDIATE, 0},
+        [OP_SUBTRACT_IMM] = {"OP_SUBTRACT_IMM", OPERAND_IMMEDIATE, 0},
+        [OP_GREATER_IMM] = {"OP_GREATER_IMM", OPERAND_IMMEDIATE, 0},
+        [OP_LESS_IMM] = {"OP_LESS_IMM", OPERAND_IMMEDIATE, 0},
+        [OP_JUMP_IF_NOT_LESS_IMM] = {"OP_JUMP_IF_NOT_LESS_IMM", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_LESS_EQUAL_IMM] = {"OP_JUMP_IF_NOT_LESS_EQUAL_IMM", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_GREATER_IMM] = {"OP_JUMP_IF_NOT_GREATER_IMM", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_IMM] = {"OP_JUMP_IF_NOT_GREATER_EQUAL_IMM", OPERAND_IMMEDIATE_JUMP, -1},
+        // The callee is replaced by the result
+        [OP_CALL] = {"OP_CALL", OPERAND_BYTE, 0},
+        [OP_TAIL_CALL] = {"OP_TAIL_CALL", OPERAND_BYTE, 0},
+        [OP_INTRINSIC] = {"OP_INTRINSIC", OPERAND_BYTE, 0},
+        [OP_CLOSURE] = {"OP_CLOSURE", OPERAND_CLOSURE, 1},
+        // The receiver is replaced by the result
+        [OP_INVOKE] = {"OP_INVOKE", OPERAND_INVOKE, 0},
+        [OP_TAIL_INVOKE] = {"OP_TAIL_INVOKE", OPERAND_INVOKE, 0},
+        // Also pops the superclass
+        [OP_SUPER_INVOKE] = {"OP_SUPER_INVOKE", OPERAND_INVOKE, -1},
+        [OP_CLOSE_UPVALUE] = {"OP_CLOSE_UPVALUE", OPERAND_NONE, -1},
+        [OP_RETURN] = {"OP_RETURN", OPERAND_NONE, -1},
+        [OP_CLASS] = {"OP_CLASS", OPERAND_CONSTANT, 1},
+        [OP_INHERIT] = {"OP_INHERIT", OPERAND_NONE, -1},
+        [OP_METHOD] = {"OP_METHOD", OPERAND_CONSTANT, -1},
+        [OP_ADD_NUMBERS] = {"OP_ADD_NUMBERS", OPERAND_NONE, -1},
+        [OP_ADD_STRINGS] = {"OP_ADD_STRINGS", OPERAND_NONE, -1},
+        [OP_SUBTRACT_NUMBERS] = {"OP_SUBTRACT_NUMBERS", OPERAND_NONE, -1},
+        [OP_MULTIPLY_NUMBERS] = {"OP_MULTIPLY_NUMBERS", OPERAND_NONE, -1},
+        [OP_DIVIDE_NUMBERS] = {"OP_DIVIDE_NUMBERS", OPERAND_NONE, -1},
+        [OP_GREATER_NUMBERS] = {"OP_GREATER_NUMBERS", OPERAND_NONE, -1},
+        [OP_LESS_NUMBERS] = {"OP_LESS_NUMBERS", OPERAND_NONE, -1},
+        [OP_NEGATE_NUMBER] = {"OP_NEGATE_NUMBER", OPERAND_NONE, 0},
+        [OP_JUMP_IF_NOT_LESS_NUMBERS] = {"OP_JUMP_IF_NOT_LESS_NUMBERS", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS] = {"OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_GREATER_NUMBERS] = {"OP_JUMP_IF_NOT_GREATER_NUMBERS", OPERAND_JUMP, -2},
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS] = {"OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS", OPERAND_JUMP, -2},
+        [OP_ADD_IMM_NUMBER] = {"OP_ADD_IMM_NUMBER", OPERAND_IMMEDIATE, 0},
+        [OP_SUBTRACT_IMM_NUMBER] = {"OP_SUBTRACT_IMM_NUMBER", OPERAND_IMMEDIATE, 0},
+        [OP_JUMP_IF_NOT_LESS_IMM_NUMBER] = {"OP_JUMP_IF_NOT_LESS_IMM_NUMBER", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER] = {"OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_GREATER_IMM_NUMBER] = {"OP_JUMP_IF_NOT_GREATER_IMM_NUMBER", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER] = {"OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER", OPERAND_IMMEDIATE_JUMP, -1},
+        [OP_ADD_NUM] = {"OP_ADD_NUM", OPERAND_NONE, -1},
+        [OP_ADD_STR] = {"OP_ADD_STR", OPERAND_NONE, -1},
+        [OP_SUBTRACT_NUM] = {"OP_SUBTRACT_NUM", OPERAND_NONE, -1},
+        [OP_MULTIPLY_NUM] = {"OP_MULTIPLY_NUM", OPERAND_NONE, -1},
+        [OP_DIVIDE_NUM] = {"OP_DIVIDE_NUM", OPERAND_NONE, -1},
+        [OP_GREATER_NUM] = {"OP_GREATER_NUM", OPERAND_NONE, -1},
+        [OP_LESS_NUM] = {"OP_LESS_NUM", OPERAND_NONE, -1},
+        // Only ever in threaded code, where the parts keep their operands.
+#define SUPERINSTRUCTION(name, length, ...) [name] = {#name, OPERAND_NONE, 0},
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION
+};
+
+// The number of bytes the instruction at [offset] occupies in [code].
+int instructionLength(Chunk *chunk, int offset) {
+    switch (opInfo[chunk->code[offset]].format) {
+        case OPERAND_NONE:
+            return 1;
+        case OPERAND_BYTE:
+        case OPERAND_CONSTANT:
+            return 2;
+        case OPERAND_JUMP:
+        case OPERAND_LOOP:
+        case OPERAND_GLOBAL:
+        case OPERAND_IMMEDIATE:
+        case OPERAND_INVOKE:
+            return 3;
+        case OPERAND_CONSTANT_LONG:
+            return 4;
+        case OPERAND_IMMEDIATE_JUMP:
+            return 5;
+        case OPERAND_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            // Each captured variable is an (isLocal, index) pair of bytes.
+            return 2 + function->upvalueCount * 2;
+        }
+    }
+    return 1; // Unreachable.
+}
+
+// The net change in stack height caused by the instruction at [offset].
+int stackEffect(Chunk *chunk, int offset) {
+    uint8_t instruction = chunk->code[offset];
+    int effect = opInfo[instruction].stackEffect;
+    switch (instruction) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return effect - chunk->code[offset + 1];
+        case OP_INTRINSIC:
+            return effect - intrinsics[chunk->code[offset + 1]].arity;
+        case OP_POPN:
+            return effect - chunk->code[offset + 1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+            return effect - chunk->code[offset + 2];
+        default:
+            return effect;
+    }
+}
+
+// The offset a jump or loop instruction at [offset] transfers control to.
+// Offsets are the instruction's last two bytes and relative to its end.
+int jumpTarget(Chunk *chunk, int offset) {
+    int end = offset + instructionLength(chunk, offset);
+    int jump = (uint16_t) ((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+    if (opInfo[chunk->code[offset]].format == OPERAND_LOOP) {
+        return end - jump;
+    }
+    return end + jump;
+}
+
+// Whether [instruction] is a jump or a loop, which jumpTarget() reads.
+bool isJump(uint8_t instruction) {
+    OperandFormat format = opInfo[instruction].format;
+    return format == OPERAND_JUMP || format == OPERAND_LOOP ||
+           format == OPERAND_IMMEDIATE_JUMP;
+}
+
+// Walk every path through the chunk, using the stack effect of each
+// instruction, to find the stack depth relative to the frame on entry to each
+// instruction. Fills [depthAt], indexed by offset, with -1 for unreachable
+// code and returns the deepest the stack gets.
+int stackDepths(Chunk *chunk, int startDepth, int *depthAt) {
+    for (int i = 0; i < chunk->count; i++) depthAt[i] = -1;
+    if (chunk->count == 0) return startDepth;
+
+    Array worklist;
+    initArray(&worklist, sizeof(int));
+    int start = 0;
+    depthAt[start] = startDepth;
+    writeArray(&worklist, &start);
+    int maxDepth = startDepth;
+
+    while (worklist.count > 0) {
+        int offset = READ_AS(int, &worklist, --worklist.count);
+        int depth = depthAt[offset];
+        // Follow the straight line of code until it ends or joins a visited path.
+        for (;;) {
+            uint8_t instruction = chunk->code[offset];
+            depth += stackEffect(chunk, offset);
+            if (depth > maxDepth) maxDepth = depth;
+
+            if (instruction == OP_RETURN) break;
+
+            if (isJump(instruction)) {
+                int target = jumpTarget(chunk, offset);
+                if (depthAt[target] == -1) {
+                    depthAt[target] = depth;
+                    writeArray(&worklist, &target);
+                }
+                // Only a conditional jump falls through.
+                if (instruction == OP_JUMP || instruction == OP_LOOP) break;
+            }
+
+            offset += instructionLength(chunk, offset);
+            if (offset >= chunk->count || depthAt[offset] != -1) break;
+            depthAt[offset] = depth;
+        }
+    }
+
+    freeArray(&worklist);
+    return maxDepth;
+}
+
+// Split the code stackDepths() reached into basic blocks. One starts at the
+// entry, at each jump target and after each jump and return. Fills
+// [blockAt], indexed by offset, with the index of the block starting there,
+// in code order, and -1 elsewhere. Returns how many blocks there are.
+//
+// Also fills [captured], one flag per frame slot, with the locals closures
+// capture. Their upvalues can change them at any call. Slot zero holds the
+// function or 'this', which nothing assigns to.
+int findBlocks(Chunk *chunk, const int *depthAt, int *blockAt, bool *captured,
+               int slotCount) {
+    for (int slot = 0; slot < slotCount; slot++) captured[slot] = false;
+    for (int offset = 0; offset < chunk->count; offset++) blockAt[offset] = -1;
+    if (chunk->count == 0) return 0;
+
+    blockAt[0] = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (depthAt[offset] == -1) continue;
+        uint8_t instruction = chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        if (isJump(instruction)) {
+            blockAt[jumpTarget(chunk, offset)] = 0;
+        } else if (instruction == OP_CLOSURE) {
+            // (isLocal, index) pairs follow the function's constant.
+            for (int i = offset + 2; i < next; i += 2) {
+                if (chunk->code[i] && chunk->code[i + 1] != 0) captured[chunk->code[i + 1]] = true;
+            }
+        }
+        if ((isJump(instruction) || instruction == OP_RETURN) && next < chunk->count) {
+            blockAt[next] = 0;
+        }
+    }
+
+    // Number the blocks in code order so the next one in the code is the one
+    // after in numbering too.
+    int blockCount = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (blockAt[offset] != -1) blockAt[offset] = blockCount++;
+    }
+    return blockCount;
+}
+
+// The opcode whose handler runs [opcode] once threaded. Forms that only
+// differ in how their operand is encoded share one.
+uint8_t threadedOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT_LONG:
+        case OP_SMALL_INT:
+            return OP_CONSTANT;
+        default:
+            return opcode;
+    }
+}
+
+// The generic instruction a typed one stands in for, or [opcode] itself. The
+// register engine, the JIT and --emit-c keep their own type checks and treat
+// the typed forms like the generic ones.
+uint8_t untypedOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_ADD_NUMBERS:
+        case OP_ADD_STRINGS:
+            return OP_ADD;
+        case OP_SUBTRACT_NUMBERS: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBERS: return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBERS: return OP_DIVIDE;
+        case OP_GREATER_NUMBERS: return OP_GREATER;
+        case OP_LESS_NUMBERS: return OP_LESS;
+        case OP_NEGATE_NUMBER: return OP_NEGATE;
+        case OP_JUMP_IF_NOT_LESS_NUMBERS: return OP_JUMP_IF_NOT_LESS;
+        case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS: return OP_JUMP_IF_NOT_LESS_EQUAL;
+        case OP_JUMP_IF_NOT_GREATER_NUMBERS: return OP_JUMP_IF_NOT_GREATER;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+        case OP_ADD_IMM_NUMBER: return OP_ADD_IMM;
+        case OP_SUBTRACT_IMM_NUMBER: return OP_SUBTRACT_IMM;
+        case OP_JUMP_IF_NOT_LESS_IMM_NUMBER: return OP_JUMP_IF_NOT_LESS_IMM;
+        case OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER: return OP_JUMP_IF_NOT_LESS_EQUAL_IMM;
+        case OP_JUMP_IF_NOT_GREATER_IMM_NUMBER: return OP_JUMP_IF_NOT_GREATER_IMM;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER: return OP_JUMP_IF_NOT_GREATER_EQUAL_IMM;
+        default:
+            return opcode;
+    }
+}
+
+// True if the instruction at [offset] gets an inline cache when threaded.
+bool hasInlineCache(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The number of slots the instruction at [offset] occupies once threaded.
+// Constant indexes and jump offsets shrink to a single slot, everything
+// else keeps one slot per operand byte. Inline caches take one more.
+int threadedLength(Chunk *chunk, int offset) {
+    if (hasInlineCache(chunk, offset)) {
+        return instructionLength(chunk, offset) + 1;
+    }
+
+    switch (opInfo[chunk->code[offset]].format) {
+        case OPERAND_CONSTANT_LONG:
+        case OPERAND_JUMP:
+        case OPERAND_LOOP:
+        case OPERAND_GLOBAL:
+        case OPERAND_IMMEDIATE:
+            return 2;
+        case OPERAND_IMMEDIATE_JUMP:
+            return 3;
+        default:
+            return instructionLength(chunk, offset);
+    }
+}
+
+#ifndef DEBUG_COUNT_NGRAMS
+#define SUPERINSTRUCTION_MAX 4
+
+typedef struct {
+    uint8_t opcode;
+    int length;
+    uint8_t parts[SUPERINSTRUCTION_MAX];
+} Superinstruction;
+
+static const Superinstruction superinstructions[] = {
+#define SUPERINSTRUCTION(name, length, ...) {name, length, {__VA_ARGS__}},
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION
+        {OPCODE_COUNT, 0, {0}},
+};
+
+// The longest superinstruction that covers the instructions starting at
+// [offset], or OPCODE_COUNT if none does.
+static uint8_t findSuperinstruction(Chunk *chunk, int offset) {
+    uint8_t best = OPCODE_COUNT;
+    int bestLength = 0;
+    for (const Superinstruction *super = superinstructions; super->length > 0; super++) {
+        if (super->length <= bestLength) continue;
+
+        int part = 0;
+        for (int at = offset; part < super->length && at < chunk->count; part++) {
+            if (threadedOpcode(chunk->code[at]) != super->parts[part]) break;
+            at += instructionLength(chunk, at);
+        }
+
+        if (part == super->length) {
+            best = super->opcode;
+            bestLength = super->length;
+        }
+    }
+    return best;
+}
+#endif
+
+// [count] inline caches with every entry unused.
+InlineCache *newInlineCaches(int count) {
+    InlineCache *caches = ALLOCATE(InlineCache, count);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+            // An unused entry also matches instances in dictionary mode,
+            // whose shape is NULL, but it misses as a field and as a method.
+            caches[i].entries[j].shape = NULL;
+            caches[i].entries[j].slot = -1;
+            caches[i].entries[j].transition = NULL;
+            caches[i].entries[j].method = NULL;
+            caches[i].entries[j].inlineSlot = -1;
+        }
+    }
+    return caches;
+}
+
+// Translate the bytecode into threaded code. [handlers] maps each opcode to
+// the address of its handler in run(), or is NULL when the VM dispatches
+// with a switch, in which case the opcode is stored instead.
+void threadChunk(Chunk *chunk, void *const *handlers) {
+    // Where each instruction starts in the threaded code, indexed by its
+    // bytecode offset. Jump targets are resolved through this.
+    int *slotAt = ALLOCATE(int, chunk->count + 1);
+    int slotCount = 0;
+    int cacheCount = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        slotAt[offset] = slotCount;
+        slotCount += threadedLength(chunk, offset);
+        if (hasInlineCache(chunk, offset)) cacheCount++;
+    }
+    slotAt[chunk->count] = slotCount;
+
+    Code *threaded = ALLOCATE(Code, slotCount);
+    int *offsets = ALLOCATE(int, slotCount);
+    InlineCache *caches = newInlineCaches(cacheCount);
+    int nextCache = 0;
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t *bytes = &chunk->code[offset];
+        Code *slot = &threaded[slotAt[offset]];
+        for (int i = 0; i < threadedLength(chunk, offset); i++) {
+            offsets[slotAt[offset] + i] = offset;
+        }
+
+        uint8_t opcode = threadedOpcode(bytes[0]);
+#ifndef DEBUG_COUNT_NGRAMS
+        // Only the first part's handler changes. The others keep theirs for
+        // jumps that land in the middle of the sequence. Profiling runs need
+        // every instruction to dispatch, so they leave this out, and so does
+        // tracing.
+        uint8_t super = vm.traceExecution ? OPCODE_COUNT : findSuperinstruction(chunk, offset);
+        if (super != OPCODE_COUNT) opcode = super;
+#endif
+        if (handlers != NULL) {
+            slot[0].handler = handlers[opcode];
+        } else {
+            slot[0].opcode = opcode;
+        }
+
+        switch (opInfo[bytes[0]].format) {
+            case OPERAND_NONE:
+                break;
+            case OPERAND_BYTE:
+                slot[1].operand = bytes[1];
+                break;
+            case OPERAND_CONSTANT:
+                slot[1].value = chunk->constants.values[bytes[1]];
+                break;
+            case OPERAND_CONSTANT_LONG:
+                slot[1].value = chunk->constants.values[(bytes[1] << 16) + (bytes[2] << 8) + bytes[3]];
+                break;
+            case OPERAND_JUMP:
+            case OPERAND_LOOP:
+                slot[1].target = &threaded[slotAt[jumpTarget(chunk, offset)]];
+                break;
+            case OPERAND_GLOBAL:
+                slot[1].operand = (bytes[1] << 8) | bytes[2];
+                break;
+            case OPERAND_IMMEDIATE:
+                // Converted once here so the handlers read it like a constant.
+                slot[1].value = INT_VAL((int16_t) ((bytes[1] << 8) | bytes[2]));
+                break;
+            case OPERAND_IMMEDIATE_JUMP:
+                slot[1].value = INT_VAL((int16_t) ((bytes[1] << 8) | bytes[2]));
+                slot[2].target = &threaded[slotAt[jumpTarget(chunk, offset)]];
+                break;
+            case OPERAND_INVOKE:
+                slot[1].value = chunk->constants.values[bytes[1]];
+                slot[2].operand = bytes[2];
+                break;
+            case OPERAND_CLOSURE: {
+                slot[1].value = chunk->constants.values[bytes[1]];
+                int length = instructionLength(chunk, offset);
+                for (int i = 2; i < length; i++) {
+                    slot[i].operand = bytes[i];
+                }
+                break;
+            }
+        }
+
+        // The cache goes after the instruction's other operands.
+        if (hasInlineCache(chunk, offset)) {
+            slot[threadedLength(chunk, offset) - 1].cache = &caches[nextCache++];
+        }
+    }
+
+    FREE_ARRAY(int, slotAt, chunk->count + 1);
+    chunk->caches = caches;
+    chunk->cacheCount = cacheCount;
+    chunk->threaded = threaded;
+    chunk->threadedCount = slotCount;
+    chunk->threadedOffsets = offsets;
+}
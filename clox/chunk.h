@@ -11,10 +11,14 @@
 typedef enum {
   OP_CONSTANT,
   OP_CONSTANT_LONG,
+  // Pushes its operand, a small integer, without a constant pool entry
+  OP_SMALL_INT,
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
   OP_POP,
+  // Pops as many values as its operand says
+  OP_POPN,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
   OP_GET_GLOBAL,
@@ -40,18 +44,127 @@ typedef enum {
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
+  // Compare the two values on top of the stack, pop them and jump if the
+  // comparison is false. Stand in for a comparison followed by
+  // OP_JUMP_IF_FALSE in conditions.
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  // Forms of the above whose right hand operand is a small integer encoded
+  // in the instruction, like OP_SMALL_INT's, instead of on the stack.
+  OP_ADD_IMM,
+  OP_SUBTRACT_IMM,
+  OP_GREATER_IMM,
+  OP_LESS_IMM,
+  OP_JUMP_IF_NOT_LESS_IMM,
+  OP_JUMP_IF_NOT_LESS_EQUAL_IMM,
+  OP_JUMP_IF_NOT_GREATER_IMM,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_IMM,
   OP_CALL,
+  // A call whose result the function returns straight away
+  OP_TAIL_CALL,
+  // A call to the math builtin its operand names, see intrinsics[] in vm.h.
+  // The callee is still pushed, for when the global no longer holds it.
+  OP_INTRINSIC,
   OP_CLOSURE,
   OP_INVOKE,
+  // A method call whose result the function returns straight away
+  OP_TAIL_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSE_UPVALUE,
   // Return from the current function
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  // Forms of the arithmetic and comparison instructions for operands whose
+  // types inferTypes() proved when the function was compiled. They skip the
+  // type checks and never fail.
+  OP_ADD_NUMBERS,
+  OP_ADD_STRINGS,
+  OP_SUBTRACT_NUMBERS,
+  OP_MULTIPLY_NUMBERS,
+  OP_DIVIDE_NUMBERS,
+  OP_GREATER_NUMBERS,
+  OP_LESS_NUMBERS,
+  OP_NEGATE_NUMBER,
+  OP_JUMP_IF_NOT_LESS_NUMBERS,
+  OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS,
+  OP_JUMP_IF_NOT_GREATER_NUMBERS,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS,
+  OP_ADD_IMM_NUMBER,
+  OP_SUBTRACT_IMM_NUMBER,
+  OP_JUMP_IF_NOT_LESS_IMM_NUMBER,
+  OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER,
+  OP_JUMP_IF_NOT_GREATER_IMM_NUMBER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER,
+  // Type specialised forms that run() quickens the generic instructions into
+  // after seeing their operands. They only ever appear in threaded code and
+  // turn back into the generic form when their operands don't match.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  // Superinstructions that threadChunk() puts in place of the first of a
+  // common sequence of instructions. See superinstructions.h.
+#define SUPERINSTRUCTION(name, length, ...) name,
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION
+  // Not an instruction, the number of opcodes above
+  OPCODE_COUNT
 } OpCode;
 
+// How an instruction's operand bytes are laid out.
+typedef enum {
+  OPERAND_NONE,
+  OPERAND_BYTE,          // A slot, upvalue index or argument count
+  OPERAND_CONSTANT,      // A one byte constant pool index
+  OPERAND_CONSTANT_LONG, // A three byte constant pool index
+  OPERAND_JUMP,          // A two byte forward offset
+  OPERAND_LOOP,          // A two byte backward offset
+  OPERAND_GLOBAL,        // A two byte index into the VM's global slots
+  OPERAND_IMMEDIATE,     // A two byte signed integer
+  OPERAND_IMMEDIATE_JUMP,// An immediate then a two byte forward offset
+  OPERAND_INVOKE,        // A constant (the method name) then an argument count
+  OPERAND_CLOSURE        // A constant, then an (isLocal, index) pair per upvalue
+} OperandFormat;
+
+typedef struct {
+  const char *name;
+  OperandFormat format;
+  // How many values the instruction leaves on the stack minus how many it
+  // consumes. Calls also consume their arguments, see stackEffect().
+  int stackEffect;
+} OpInfo;
+
+// Indexed by OpCode. Shared by the compiler, the disassembler and
+// threadChunk() so they agree on every instruction's shape.
+extern const OpInfo opInfo[];
+
+typedef struct InlineCache InlineCache;
+
+// One slot of a chunk's threaded code. An instruction is a handler slot
+// followed by its operands, already decoded from the bytecode.
+typedef union Code {
+  // Address of the opcode's label in run() (computed goto dispatch)
+  const void *handler;
+  // The opcode itself (switch dispatch)
+  uint8_t opcode;
+  int operand;
+  // A resolved constant
+  Value value;
+  // Absolute jump target
+  union Code *target;
+  // The call site's entry in Chunk.caches
+  InlineCache *cache;
+} Code;
+
 // Data stored alongside an instruction
 typedef struct {
   int count;
@@ -60,6 +173,18 @@ typedef struct {
   int *lines; // Mirrors the code array in size but stores the source line
   // number corresponding to each op-code.
   ValueArray constants; // A pool of constants
+  // The pre-decoded form of [code] that the VM executes. Built by
+  // threadChunk() the first time the chunk is called, or by
+  // translateRegisters() when the VM runs the register engine. [code] stays
+  // the canonical format for the disassembler and line lookups.
+  Code *threaded;
+  int threadedCount;
+  // Mirrors [threaded] in size. The offset in [code] of the instruction that
+  // each slot belongs to.
+  int *threadedOffsets;
+  // One inline cache per property access and invoke in the threaded code.
+  InlineCache *caches;
+  int cacheCount;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -72,4 +197,29 @@ int addConstant(Chunk *chunk, Value value);
 
 void writeConstant(Chunk *chunk, Value value, int line);
 
+int instructionLength(Chunk *chunk, int offset);
+
+int stackEffect(Chunk *chunk, int offset);
+
+int jumpTarget(Chunk *chunk, int offset);
+
+bool isJump(uint8_t instruction);
+
+int stackDepths(Chunk *chunk, int startDepth, int *depthAt);
+
+int findBlocks(Chunk *chunk, const int *depthAt, int *blockAt, bool *captured,
+               int slotCount);
+
+uint8_t threadedOpcode(uint8_t opcode);
+
+uint8_t untypedOpcode(uint8_t opcode);
+
+bool hasInlineCache(Chunk *chunk, int offset);
+
+int threadedLength(Chunk *chunk, int offset);
+
+InlineCache *newInlineCaches(int count);
+
+void threadChunk(Chunk *chunk, void *const *handlers);
+
 #endif
@@ -6,12 +6,32 @@
 #include <stdint.h>
 
 #define NAN_BOXING
-#define DEBUG_PRINT_CODE
-// Disassemble and print each instruction before execution
-#define DEBUG_TRACE_EXECUTION
+
+// COMPUTED_GOTO is set by the CLOX_COMPUTED_GOTO CMake option. Labels as
+// values are a GCC/Clang extension so other compilers keep the switch.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// JIT is set by the CLOX_JIT CMake option. The compiler emits x86-64 code
+// that relies on NaN boxed values and maps it with Linux's mmap().
+#if defined(JIT) && !(defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING))
+#undef JIT
+#endif
+
+// Disassembly, execution tracing and GC logging are runtime options, see
+// --print-code, --trace and --log-gc in main.c.
+
+// Count inline cache hits and misses and print them when the VM exits
+//#define DEBUG_INLINE_CACHE_STATS
+
+// Count how often each sequence of 2 to 4 instructions runs back to back and
+// print the counts when the VM exits. Superinstructions are left out so every
+// instruction is seen. tools/superinstructions.py turns the counts into
+// superinstructions.h.
+//#define DEBUG_COUNT_NGRAMS
 
 //#define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT16_COUNT (UINT16_MAX + 1)
@@ -1,5 +1,6 @@
 #include "compiler.h"
 
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,14 +8,12 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "optimizer.h"
+#include "peephole.h"
 #include "scanner.h"
-
-#ifdef DEBUG_PRINT_CODE
+#include "types.h"
 
 #include "debug.h"
-
-#endif
-
 #include "vm.h"
 #include "memory.h"
 
@@ -54,6 +53,9 @@ typedef struct {
   int depth;
   bool mutable;
   bool isCaptured;
+  // The literal a final local was initialised with, which its uses compile
+  // to, or UNDEFINED_VAL.
+  Value constant;
 } Local;
 
 typedef struct {
@@ -74,14 +76,36 @@ typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
 
-  // Local locals[UINT8_COUNT];
-  Local locals[STACK_MAX];
+  // Slots are addressed by a one byte operand.
+  Local locals[UINT8_COUNT];
   int localCount;
   // A function can reference 256 variables in an enclosing scope.
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
   int unpatchedBreaks;
   Table globalMutability;
+  // Final globals -> their literal initialiser, or UNDEFINED_VAL where it
+  // isn't one or can't be built in. Like globalMutability, only the script's
+  // compiler declares any.
+  Table globalConstants;
+  // Where the comparison that most recently ended a binary expression starts
+  // and ends in the chunk, so a condition ending in it can fuse it with the
+  // following jump.
+  int comparisonStart;
+  int comparisonEnd;
+  // The offset the most recently patched jump lands on.
+  int lastJumpTarget;
+  // Where the most recent OP_SMALL_INT starts, so an operator right after it
+  // can take it as an immediate operand.
+  int lastImmediate;
+  // Where the most recent OP_CALL starts, so a return can make it a tail call.
+  int lastCall;
+  // Where the most recent OP_GET_GLOBAL starts, so a call right after it can
+  // tell it names a math builtin.
+  int lastGlobal;
+  // Where the most recent literal (a constant, small integer, true, false or
+  // nil) starts, so an operator applied to literals can fold them.
+  int lastConstant;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -109,6 +133,8 @@ static int resolveLocal(Compiler *compiler, Token *name);
 
 static int resolveUpvalue(Compiler *compiler, Token *name);
 
+static bool identifiersEqual(Token *a, Token *b);
+
 static uint8_t argumentList();
 
 static Chunk *currentChunk() {
@@ -205,6 +231,13 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+// Global instructions take a two byte slot index.
+static void emitGlobal(uint8_t instruction, int slot) {
+  emitByte(instruction);
+  emitByte((slot >> 8) & 0xFF);
+  emitByte(slot & 0xFF);
+}
+
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
@@ -248,9 +281,103 @@ static int makeConstant(Value value) {
 }
 
 static void emitConstant(Value value) {
+  current->lastConstant = currentChunk()->count;
   writeConstant(currentChunk(), value, parser.previous.line);
 }
 
+static void emitNumber(double value) {
+  // -0 has to stay a double to keep its sign.
+  bool integral = !(value == 0 && signbit(value));
+  // Small integers are encoded in the instruction instead of the constant
+  // pool. Operators can then take them as their immediate operand.
+  if (integral && value >= INT16_MIN && value <= INT16_MAX &&
+      value == (int16_t) value) {
+    current->lastImmediate = currentChunk()->count;
+    current->lastConstant = currentChunk()->count;
+    int16_t immediate = (int16_t) value;
+    emitBytes(OP_SMALL_INT, (immediate >> 8) & 0xFF);
+    emitByte(immediate & 0xFF);
+    return;
+  }
+  // Other integers that fit in 32 bits are small integers, which add,
+  // subtract and compare without going through floating point.
+  if (integral && value >= INT32_MIN && value <= INT32_MAX &&
+      value == (int32_t) value) {
+    emitConstant(INT_VAL((int32_t) value));
+    return;
+  }
+  emitConstant(NUMBER_VAL(value));
+}
+
+// Emit the instruction that pushes [value], which is a literal's value.
+static void emitValue(Value value) {
+  if (IS_BOOL(value) || IS_NIL(value)) {
+    current->lastConstant = currentChunk()->count;
+    emitByte(IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_NUMBER(value)) {
+    emitNumber(AS_NUMBER(value));
+  } else {
+    emitConstant(value);
+  }
+}
+
+// The value the literal instruction at [offset] pushes, if it is one.
+static bool literalValue(Chunk *chunk, int offset, Value *value) {
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+    case OP_CONSTANT:
+      *value = chunk->constants.values[code[1]];
+      return true;
+    case OP_CONSTANT_LONG:
+      *value = chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]];
+      return true;
+    case OP_SMALL_INT:
+      *value = INT_VAL((int16_t) ((code[1] << 8) | code[2]));
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether the code from [start] to the end of the chunk is a single literal,
+// and if so its value.
+static bool constantAt(int start, Value *value) {
+  Chunk *chunk = currentChunk();
+  if (start < 0 || start >= chunk->count) return false;
+  if (start + instructionLength(chunk, start) != chunk->count) return false;
+  // A jump out of an 'and' or 'or' lands here with some other value.
+  if (current->lastJumpTarget == chunk->count) return false;
+
+  return literalValue(chunk, start, value);
+}
+
+// Remove the literal at [start], which runs to the end of the chunk, along
+// with its constant when nothing else can use it.
+static void removeConstant(int start) {
+  Chunk *chunk = currentChunk();
+  uint8_t *code = &chunk->code[start];
+  int constant = -1;
+  if (code[0] == OP_CONSTANT) {
+    constant = code[1];
+  } else if (code[0] == OP_CONSTANT_LONG) {
+    constant = (code[1] << 16) | (code[2] << 8) | code[3];
+  }
+  if (constant >= 0 && constant == chunk->constants.count - 1) {
+    chunk->constants.count--;
+  }
+  chunk->count = start;
+  current->lastImmediate = -1;
+}
+
 // Write the JUMP pointer that follows a OP_JUMP_IF_* instruction.
 static void patchJump(int offset) {
   // -2 to adjust for the bytecode for the jump offset itself.
@@ -261,6 +388,70 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xFF;
   currentChunk()->code[offset + 1] = jump & 0xFF;
+  current->lastJumpTarget = currentChunk()->count;
+}
+
+// The compare-and-branch instruction that jumps when the comparison from
+// [comparisonStart] to the end of the chunk is false, or OP_JUMP_IF_FALSE if
+// the code there isn't one.
+static uint8_t fusedConditionJump() {
+  Chunk *chunk = currentChunk();
+  int length = chunk->count - current->comparisonStart;
+  if (current->comparisonEnd != chunk->count) return OP_JUMP_IF_FALSE;
+  // A jump out of an 'and' or 'or' lands here with some other value.
+  if (current->lastJumpTarget == chunk->count) return OP_JUMP_IF_FALSE;
+
+  uint8_t *code = &chunk->code[current->comparisonStart];
+  bool negated = length > instructionLength(chunk, current->comparisonStart);
+  switch (code[0]) {
+    case OP_EQUAL:
+      return negated ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+    case OP_LESS:
+      // '>=' compiles to OP_LESS OP_NOT.
+      return negated ? OP_JUMP_IF_NOT_GREATER_EQUAL : OP_JUMP_IF_NOT_LESS;
+    case OP_GREATER:
+      // '<=' compiles to OP_GREATER OP_NOT.
+      return negated ? OP_JUMP_IF_NOT_LESS_EQUAL : OP_JUMP_IF_NOT_GREATER;
+    case OP_LESS_IMM:
+      return negated ? OP_JUMP_IF_NOT_GREATER_EQUAL_IMM : OP_JUMP_IF_NOT_LESS_IMM;
+    case OP_GREATER_IMM:
+      return negated ? OP_JUMP_IF_NOT_LESS_EQUAL_IMM : OP_JUMP_IF_NOT_GREATER_IMM;
+    default:
+      return OP_JUMP_IF_FALSE;
+  }
+}
+
+// Emits the jump a statement takes when its just compiled condition is false
+// and returns the offset to patch. A condition that ends in a comparison
+// branches on the operands directly, so no bool is left on the stack for the
+// statement to pop. [popCondition] says whether one is.
+static int emitConditionJump(bool *popCondition) {
+  uint8_t instruction = fusedConditionJump();
+  *popCondition = instruction == OP_JUMP_IF_FALSE;
+  if (*popCondition) return emitJump(OP_JUMP_IF_FALSE);
+
+  // Replace the comparison, keeping its line for runtime errors and its
+  // immediate operand if it has one.
+  Chunk *chunk = currentChunk();
+  int start = current->comparisonStart;
+  int line = chunk->lines[start];
+  int offset;
+  if (opInfo[instruction].format == OPERAND_IMMEDIATE_JUMP) {
+    uint8_t immediateHigh = chunk->code[start + 1];
+    uint8_t immediateLow = chunk->code[start + 2];
+    chunk->count = start;
+    emitBytes(instruction, immediateHigh);
+    emitBytes(immediateLow, 0xff);
+    emitByte(0xff);
+    offset = chunk->count - 2;
+  } else {
+    chunk->count = start;
+    offset = emitJump(instruction);
+  }
+  for (int i = start; i < chunk->count; i++) {
+    chunk->lines[i] = line;
+  }
+  return offset;
 }
 
 static void initCompiler(Compiler *compiler, FunctionType type) {
@@ -271,7 +462,15 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->scopeDepth = 0;
   compiler->function = newFunction();
   compiler->unpatchedBreaks = 0;
+  compiler->comparisonStart = -1;
+  compiler->comparisonEnd = -1;
+  compiler->lastJumpTarget = -1;
+  compiler->lastImmediate = -1;
+  compiler->lastCall = -1;
+  compiler->lastGlobal = -1;
+  compiler->lastConstant = -1;
   initTable(&compiler->globalMutability);
+  initTable(&compiler->globalConstants);
   current = compiler;
   if (type != TYPE_SCRIPT) {
     // This function is invoked straight after parsing the function name so
@@ -288,6 +487,8 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   local->depth = 0;
   // Empty string so that it cannot clash with user defined locals
   local->isCaptured = false;
+  local->mutable = false;
+  local->constant = UNDEFINED_VAL;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -297,20 +498,52 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   }
 }
 
+// The deepest the stack gets relative to the frame, on any path through the
+// finished chunk.
+static int computeMaxStack(Chunk *chunk, int startDepth) {
+  int *depthAt = ALLOCATE(int, chunk->count);
+  int maxDepth = stackDepths(chunk, startDepth, depthAt);
+  FREE_ARRAY(int, depthAt, chunk->count);
+  return maxDepth;
+}
+
+void classifyInline(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  uint8_t *code = chunk->code;
+  Value value;
+  function->inlineKind = INLINE_NONE;
+  if (chunk->count == 0) return;
+
+  if (instructionLength(chunk, 0) + 1 == chunk->count &&
+      code[chunk->count - 1] == OP_RETURN && literalValue(chunk, 0, &value)) {
+    function->inlineKind = INLINE_CONSTANT;
+    function->inlineValue = value;
+  } else if (chunk->count == 5 && code[0] == OP_GET_LOCAL && code[1] == 0 &&
+             code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN) {
+    function->inlineKind = INLINE_FIELD;
+    function->inlineValue = chunk->constants.values[code[3]];
+  }
+}
+
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError) optimizeChunk(currentChunk());
+  // Slot zero plus the parameters are in place before the first instruction.
+  function->maxStack = computeMaxStack(currentChunk(), function->arity + 1);
+  if (!parser.hadError && vm.optimize) optimizeFunction(function);
+  if (!parser.hadError) inferTypes(function);
+  if (!parser.hadError) classifyInline(function);
   freeTable(&current->globalMutability);
+  freeTable(&current->globalConstants);
   if (current->type == TYPE_SCRIPT) {
     freeArray(&unpatchedBreaks);
   }
-#ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (vm.printCode && !parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
                                      ? function->name->chars
                                      : "<script>");
   }
-#endif
 
   current = current->enclosing;
   return function;
@@ -342,20 +575,103 @@ static void declaration();
 
 static uint8_t identifierConstant(Token *name);
 
+static int globalVariable(Token *name);
+
 static ParseRule *getRule(TokenType type);
 
 static void parsePrecedence(Precedence precedence);
 
+// Emits the operator [instruction], or [immediateForm] in place of the
+// OP_SMALL_INT that its right operand just compiled to if it did. Returns
+// whether the immediate form replaced the operand.
+static bool emitOperator(uint8_t instruction, uint8_t immediateForm) {
+  Chunk *chunk = currentChunk();
+  int start = chunk->count - 3;
+  // A jump out of an 'and' or 'or' lands after the operand with another value.
+  if (start < 0 || current->lastImmediate != start ||
+      chunk->code[start] != OP_SMALL_INT ||
+      current->lastJumpTarget == chunk->count) {
+    emitByte(instruction);
+    return false;
+  }
+
+  uint8_t high = chunk->code[start + 1];
+  uint8_t low = chunk->code[start + 2];
+  chunk->count = start;
+  current->lastImmediate = -1;
+  emitBytes(immediateForm, high);
+  emitByte(low);
+  return true;
+}
+
+// Replace the literals [a] at [start] and [b] after it with the result of
+// applying the binary operator to them. Operands the operator would reject at
+// runtime are left alone so the error still happens there.
+static bool foldBinary(TokenType operatorType, int start, Value a, Value b) {
+  Value result;
+  if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+    bool equal = valuesEqual(a, b);
+    result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+      case TOKEN_PLUS: result = NUMBER_VAL(x + y); break;
+      case TOKEN_MINUS: result = NUMBER_VAL(x - y); break;
+      case TOKEN_STAR: result = NUMBER_VAL(x * y); break;
+      case TOKEN_SLASH: result = NUMBER_VAL(x / y); break;
+      case TOKEN_GREATER: result = BOOL_VAL(x > y); break;
+      case TOKEN_LESS: result = BOOL_VAL(x < y); break;
+      // These compile to the negated opposite comparison, which is not the
+      // same thing when either side is NaN.
+      case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+      case TOKEN_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+      default: return false;
+    }
+  } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    // Both strings are still in the constant pool while allocating.
+    ObjString *left = AS_STRING(a);
+    ObjString *right = AS_STRING(b);
+    int length = left->length + right->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+    result = OBJ_VAL(takeString(chars, length));
+  } else {
+    return false;
+  }
+
+  push(result);
+  removeConstant(start + instructionLength(currentChunk(), start));
+  removeConstant(start);
+  emitValue(result);
+  pop();
+  return true;
+}
+
 static void binary(bool canAssign) {
   // The left operand has been consumed
   // The infix operator has also been consumed (held in parser.previous)
 
   TokenType operatorType = parser.previous.type;
+  Value left, right;
+  int leftStart = current->lastConstant;
+  bool leftConstant = constantAt(leftStart, &left);
+  int leftEnd = currentChunk()->count;
   // Each binary operator's right-hand operand precedence is one level higher
   // than its own (left associativity)
   ParseRule *rule = getRule(operatorType);
   parsePrecedence((Precedence) (rule->precedence + 1));
 
+  if (leftConstant && current->lastConstant == leftEnd &&
+      constantAt(leftEnd, &right) &&
+      foldBinary(operatorType, leftStart, left, right)) {
+    return;
+  }
+
+  int start = currentChunk()->count;
+  bool immediate = false;
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
       emitBytes(OP_EQUAL, OP_NOT);
@@ -364,22 +680,24 @@ static void binary(bool canAssign) {
       emitByte(OP_EQUAL);
       break;
     case TOKEN_GREATER:
-      emitByte(OP_GREATER);
+      immediate = emitOperator(OP_GREATER, OP_GREATER_IMM);
       break;
     case TOKEN_GREATER_EQUAL:
-      emitBytes(OP_LESS, OP_NOT);
+      immediate = emitOperator(OP_LESS, OP_LESS_IMM);
+      emitByte(OP_NOT);
       break;
     case TOKEN_LESS:
-      emitByte(OP_LESS);
+      immediate = emitOperator(OP_LESS, OP_LESS_IMM);
       break;
     case TOKEN_LESS_EQUAL:
-      emitBytes(OP_GREATER, OP_NOT);
+      immediate = emitOperator(OP_GREATER, OP_GREATER_IMM);
+      emitByte(OP_NOT);
       break;
     case TOKEN_PLUS:
-      emitByte(OP_ADD);
+      emitOperator(OP_ADD, OP_ADD_IMM);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_SUBTRACT);
+      emitOperator(OP_SUBTRACT, OP_SUBTRACT_IMM);
       break;
     case TOKEN_STAR:
       emitByte(OP_MULTIPLY);
@@ -390,10 +708,33 @@ static void binary(bool canAssign) {
     default:
       return; // Unreachable.
   }
+
+  if (rule->precedence == PREC_EQUALITY || rule->precedence == PREC_COMPARISON) {
+    // The immediate form starts where the operand it replaced did.
+    current->comparisonStart = immediate ? start - 3 : start;
+    current->comparisonEnd = currentChunk()->count;
+  }
 }
 
 static void call(bool canAssign) {
+  // A callee that is just the global of a math builtin, not a local that
+  // shadows it, compiles to OP_INTRINSIC when the arguments fit.
+  Chunk *chunk = currentChunk();
+  int start = chunk->count - 3;
+  int intrinsic = -1;
+  if (start >= 0 && current->lastGlobal == start &&
+      chunk->code[start] == OP_GET_GLOBAL &&
+      current->lastJumpTarget != chunk->count) {
+    int slot = (chunk->code[start + 1] << 8) | chunk->code[start + 2];
+    intrinsic = findIntrinsic(AS_STRING(vm.globalNames.values[slot]));
+  }
+
   uint8_t argCount = argumentList();
+  if (intrinsic != -1 && argCount == intrinsics[intrinsic].arity) {
+    emitBytes(OP_INTRINSIC, (uint8_t) intrinsic);
+    return;
+  }
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -410,6 +751,7 @@ static void dot(bool canAssign) {
   } else if (match(TOKEN_LEFT_PAREN)) {
     // we are getting a method then immediately invoking it.
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
   } else {
@@ -418,6 +760,7 @@ static void dot(bool canAssign) {
 }
 
 static void literal(bool canAssign) {
+  current->lastConstant = currentChunk()->count;
   switch (parser.previous.type) {
     case TOKEN_FALSE:
       emitByte(OP_FALSE);
@@ -445,7 +788,7 @@ static void number(bool canAssign) {
   // so we won't stray into memory we do not own.
 
   double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  emitNumber(value);
 }
 
 static void and_(bool canAssign) {
@@ -481,39 +824,92 @@ static void string(bool canAssign) {
                        copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+// The compiler of the script, which declares every global.
+static Compiler *scriptCompiler() {
+  Compiler *compiler = current;
+  while (compiler->enclosing != NULL) compiler = compiler->enclosing;
+  return compiler;
+}
+
+// The local [name] resolves to in a function [compiler] is nested in, or NULL.
+static Local *enclosingLocal(Compiler *compiler, Token *name) {
+  for (compiler = compiler->enclosing; compiler != NULL; compiler = compiler->enclosing) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+      if (identifiersEqual(name, &compiler->locals[i].name)) return &compiler->locals[i];
+    }
+  }
+  return NULL;
+}
+
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
+  bool assign = canAssign && check(TOKEN_EQUAL);
   int arg = resolveLocal(current, &name);
-  bool mutable;
+  bool mutable = true;
+  // A final variable with a literal initialiser compiles to the literal, even
+  // in nested functions, which then don't capture it.
+  Value constant = UNDEFINED_VAL;
+  Local *outer = arg == -1 ? enclosingLocal(current, &name) : NULL;
+  if (outer != NULL && !IS_UNDEFINED(outer->constant)) {
+    // Nothing to get or set, the local is never captured.
+    if (assign) {
+      advance();
+      error("Attempted to mutate a final variable.");
+      return;
+    }
+    emitValue(outer->constant);
+    return;
+  }
+
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
     Local local = current->locals[arg];
     mutable = local.mutable;
+    constant = local.constant;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     // This branch is hit if we fail to resolve the variable as one within the
     // scope of the function being compiled.
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    mutable = outer->mutable;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
-    Value mutableVal;
-    Value *key = &currentChunk()->constants.values[arg];
-    tableGet(&current->globalMutability, *key, &mutableVal);
+    Compiler *script = scriptCompiler();
+    Value mutableVal = BOOL_VAL(true);
+    Value *key = &vm.globalNames.values[arg];
+    // Remember the assignment, a final declaration after it can't be
+    // trusted to hold its value.
+    if (!tableGet(&script->globalMutability, *key, &mutableVal) && assign) {
+      tableSet(&script->globalMutability, *key, BOOL_VAL(true));
+    }
     mutable = AS_BOOL(mutableVal);
+    tableGet(&script->globalConstants, *key, &constant);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    if (!mutable) {
+  if (!IS_UNDEFINED(constant) && !assign) {
+    emitValue(constant);
+    return;
+  }
+
+  uint8_t op = getOp;
+  if (assign) {
+    advance();
+    if (!mutable || !IS_UNDEFINED(constant)) {
       error("Attempted to mutate a final variable.");
       return;
     }
     expression();
-    emitBytes(setOp, (uint8_t) arg);
+    op = setOp;
+  }
+
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    if (op == OP_GET_GLOBAL) current->lastGlobal = currentChunk()->count;
+    emitGlobal(op, arg);
   } else {
-    emitBytes(getOp, (uint8_t) arg);
+    emitBytes(op, (uint8_t) arg);
   }
 }
 
@@ -571,8 +967,25 @@ static void unary(bool canAssign) {
 
   // Compile the operand
   // When parsing an expression such as -a.b + c;, it will stop after -a.b
+  int start = currentChunk()->count;
   parsePrecedence(PREC_UNARY);
 
+  // Fold a literal operand, leaving ones '-' rejects to fail at runtime.
+  Value operand;
+  if (current->lastConstant == start && constantAt(start, &operand)) {
+    if (operatorType == TOKEN_BANG) {
+      removeConstant(start);
+      emitValue(BOOL_VAL(IS_NIL(operand) ||
+                         (IS_BOOL(operand) && !AS_BOOL(operand))));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      removeConstant(start);
+      emitValue(NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   // emit the operator instruction.
   switch (operatorType) {
     case TOKEN_BANG:
@@ -602,7 +1015,7 @@ ParseRule rules[] = {
         [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
         [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
         [TOKEN_BANG] = {unary, NULL, PREC_EQUALITY},
-        [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_NONE},
+        [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
         [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
         [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
         [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
@@ -680,6 +1093,18 @@ static uint8_t identifierConstant(Token *name) {
   return (uint8_t) constPoolIndex;
 }
 
+// Globals are resolved to a slot shared by every chunk, so the VM can index
+// their values instead of hashing the name.
+static int globalVariable(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return slot;
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length)
     return false;
@@ -747,7 +1172,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 }
 
 static void addLocal(Token name, bool mutable) {
-  if (current->localCount == UINT16_COUNT) {
+  if (current->localCount == UINT8_COUNT) {
     error("Too many local variables in function.");
     return;
   }
@@ -757,6 +1182,7 @@ static void addLocal(Token name, bool mutable) {
   local->depth = -1;
   local->mutable = mutable;
   local->isCaptured = false;
+  local->constant = UNDEFINED_VAL;
 }
 
 static void declareVariable(bool mutable) {
@@ -780,7 +1206,26 @@ static void declareVariable(bool mutable) {
   addLocal(*name, mutable);
 }
 
-static uint8_t parseVariable(const char *errorMessage, bool mutable) {
+// Record the script's declaration of the global in [slot]. Code compiled
+// since a final global was declared may have its value built in, so a final
+// global can't be declared again.
+static void declareGlobal(int slot, bool mutable) {
+  Value *name = &vm.globalNames.values[slot];
+  Value constant;
+  if (tableGet(&current->globalConstants, *name, &constant)) {
+    error("Can't redeclare a final variable.");
+  }
+  tableSet(&current->globalMutability, *name, BOOL_VAL(mutable));
+}
+
+// Whether the script declared or assigned the global [name] earlier.
+static bool globalKnown(Token *name) {
+  Value mutable;
+  Value *key = &vm.globalNames.values[globalVariable(name)];
+  return tableGet(&current->globalMutability, *key, &mutable);
+}
+
+static int parseVariable(const char *errorMessage, bool mutable) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable(mutable);
@@ -788,10 +1233,9 @@ static uint8_t parseVariable(const char *errorMessage, bool mutable) {
   if (current->scopeDepth > 0)
     return 0;
 
-  uint8_t constPoolIndex = identifierConstant(&parser.previous);
-  Value *varName = &currentChunk()->constants.values[constPoolIndex];
-  tableSet(&current->globalMutability, *varName, BOOL_VAL(mutable));
-  return constPoolIndex;
+  int slot = globalVariable(&parser.previous);
+  declareGlobal(slot, mutable);
+  return slot;
 }
 
 static void markInitialized() {
@@ -800,7 +1244,7 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   // Is the variable a local variable?
   if (current->scopeDepth > 0) {
     markInitialized();
@@ -808,8 +1252,8 @@ static void defineVariable(uint8_t global) {
     return;
   }
 
-  // 'global' is the index of the name of the variable in the constants table.
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  // 'global' is the slot of the variable in the VM's global values.
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 // After '(' has been parsed, parse 0 or more arguments and return the number
@@ -915,7 +1359,12 @@ static void classDeclaration() {
   declareVariable(false);
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  int global = 0;
+  if (current->scopeDepth == 0) {
+    global = globalVariable(&className);
+    declareGlobal(global, true);
+  }
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.hasSuperClass = false;
@@ -963,7 +1412,7 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.", false);
+  int global = parseVariable("Expect function name.", false);
   // Variables suffered from an issue where referencing a variable while it is
   // being defined is invalid. This is fine for (recursive) functions.
   markInitialized();
@@ -972,7 +1421,7 @@ static void funDeclaration() {
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.", true);
+  int global = parseVariable("Expect variable name.", true);
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -985,8 +1434,14 @@ static void varDeclaration() {
 }
 
 static void finalVarDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.", false);
-
+  // Code that ran before this declaration may have given the global another
+  // value, which functions compiled before it could still use. In the REPL,
+  // code compiled after it may as well.
+  bool fresh = current->scopeDepth > 0 ||
+               (!vm.repl && check(TOKEN_IDENTIFIER) && !globalKnown(&parser.current));
+  int global = parseVariable("Expect variable name.", false);
+
+  int start = currentChunk()->count;
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -995,6 +1450,16 @@ static void finalVarDeclaration() {
   }
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
+  // Uses compile to the literal from here on, see namedVariable(). A final
+  // global is recorded without one too, so it can't be declared again.
+  Value value = UNDEFINED_VAL;
+  if (fresh) constantAt(start, &value);
+  if (current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].constant = value;
+  } else {
+    tableSet(&current->globalConstants, vm.globalNames.values[global], value);
+  }
+
   defineVariable(global);
 }
 
@@ -1027,13 +1492,14 @@ static void forStatement() {
   int loopStart = currentChunk()->count;
   // We can optionally skip the loop condition (infinite loop)
   int exitJump = -1;
+  bool popCondition = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Remove
+    exitJump = emitConditionJump(&popCondition);
+    if (popCondition) emitByte(OP_POP); // Remove
   }
 
   // True if the increment clause is present.
@@ -1069,7 +1535,7 @@ static void forStatement() {
 
   if (exitJump != -1) {
     patchJump(exitJump);
-    emitByte(OP_POP);
+    if (popCondition) emitByte(OP_POP);
   }
 
   // Patch all the OP_JUMP instructions produced by break statements.
@@ -1089,8 +1555,10 @@ static void ifStatement() {
 
   // We don't know how many instructions to jump over until we have compiled
   // the body of the if statement so we use a temporary value.
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP); // Runs in the 'then' branch to remove the if condition.
+  bool popCondition;
+  int thenJump = emitConditionJump(&popCondition);
+  // Runs in the 'then' branch to remove the if condition.
+  if (popCondition) emitByte(OP_POP);
   statement();
 
   // If we evaluate the 'then' branch (if condition is true)
@@ -1098,7 +1566,8 @@ static void ifStatement() {
   int elseJump = emitJump(OP_JUMP);
 
   patchJump(thenJump);
-  emitByte(OP_POP); // Runs in the 'else' branch to remove the if condition
+  // Runs in the 'else' branch to remove the if condition
+  if (popCondition) emitByte(OP_POP);
 
   if (match(TOKEN_ELSE))
     statement();
@@ -1126,6 +1595,16 @@ static void returnStatement() {
     // Parse the return value
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // 'return f(x);' and 'return o.m(x);' reuse this function's frame for
+    // the callee. The OP_RETURN still follows for callees that can't, and
+    // for jumps that land on it.
+    Chunk *chunk = currentChunk();
+    int last = current->lastCall;
+    if (last != -1 && last == chunk->count - 2 && chunk->code[last] == OP_CALL) {
+      chunk->code[last] = OP_TAIL_CALL;
+    } else if (last != -1 && last == chunk->count - 3 && chunk->code[last] == OP_INVOKE) {
+      chunk->code[last] = OP_TAIL_INVOKE;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1138,8 +1617,9 @@ static void whileStatement() {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
   // Skip over the while statement if the condition is false.
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP); // Remove the loop condition
+  bool popCondition;
+  int exitJump = emitConditionJump(&popCondition);
+  if (popCondition) emitByte(OP_POP); // Remove the loop condition
 
   CurrentLoop loop = {
           .enclosing = currentLoop,
@@ -1159,7 +1639,7 @@ static void whileStatement() {
   emitLoop(loopStart);
 
   patchJump(exitJump); // Where to skip to if the loop condition is false
-  emitByte(OP_POP);    // Remove loop condition
+  if (popCondition) emitByte(OP_POP); // Remove loop condition
 
   // Patch all the OP_JUMP instructions produced by break statements.
   // This goes after the OP_POP to remove the loop condition as breaks will only
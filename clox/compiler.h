@@ -7,5 +7,9 @@
 ObjFunction *compile(const char *source);
 void markCompilerRoots();
 
+// Set [function]'s InlineKind from its finished bytecode. The compiler does
+// this for every function, loading an --emit-c program again for each.
+void classifyInline(ObjFunction *function);
+
 #endif
 
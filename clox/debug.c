@@ -5,6 +5,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -51,6 +52,15 @@ static int constantInstructionLong(const char *name, Chunk *chunk, int offset) {
   return offset + 4;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %9d '", name, slot);
+  // The slot indexes the VM's global values. Its name is kept alongside.
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -62,6 +72,24 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int intrinsicInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t id = chunk->code[offset + 1];
+  printf("%-16s %4d '%s'\n", name, id, intrinsics[id].name);
+  return offset + 2;
+}
+
+static int immediateInstruction(const char *name, Chunk *chunk, int offset) {
+  int16_t value = (int16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %9d\n", name, value);
+  return offset + 3;
+}
+
+static int immediateJumpInstruction(const char *name, Chunk *chunk, int offset) {
+  int16_t value = (int16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %9d %4d -> %d\n", name, value, offset, jumpTarget(chunk, offset));
+  return offset + 5;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
   uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -82,23 +110,38 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   }
 
   uint8_t instruction = chunk->code[offset];
-  switch (instruction) {
-    case OP_JUMP:
-      return jumpInstruction("OP_JUMP", 1, chunk, offset);
-    case OP_JUMP_IF_FALSE:
-      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-    case OP_LOOP:
-      return jumpInstruction("OP_LOOP", -1, chunk, offset);
-    case OP_CALL:
-      return byteInstruction("OP_CALL", chunk, offset);
-    case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
-    case OP_SUPER_INVOKE:
-      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
+  if (instruction >= OPCODE_COUNT) {
+    printf("Unknown opcode %d\n", instruction);
+    return offset + 1;
+  }
+
+  const char *name = opInfo[instruction].name;
+  if (instruction == OP_INTRINSIC) return intrinsicInstruction(name, chunk, offset);
+  switch (opInfo[instruction].format) {
+    case OPERAND_NONE:
+      return simpleInstruction(name, offset);
+    case OPERAND_BYTE:
+      return byteInstruction(name, chunk, offset);
+    case OPERAND_CONSTANT:
+      return constantInstruction(name, chunk, offset);
+    case OPERAND_CONSTANT_LONG:
+      return constantInstructionLong(name, chunk, offset);
+    case OPERAND_JUMP:
+      return jumpInstruction(name, 1, chunk, offset);
+    case OPERAND_LOOP:
+      return jumpInstruction(name, -1, chunk, offset);
+    case OPERAND_GLOBAL:
+      return globalInstruction(name, chunk, offset);
+    case OPERAND_IMMEDIATE:
+      return immediateInstruction(name, chunk, offset);
+    case OPERAND_IMMEDIATE_JUMP:
+      return immediateJumpInstruction(name, chunk, offset);
+    case OPERAND_INVOKE:
+      return invokeInstruction(name, chunk, offset);
+    case OPERAND_CLOSURE: {
       offset++;
       uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      printf("%-16s %4d ", name, constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
 
@@ -112,72 +155,6 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       }
       return offset;
     }
-    case OP_CLOSE_UPVALUE:
-      return simpleInstruction("OP_CLOSE_UPVALUE", offset);
-    case OP_RETURN:
-      return simpleInstruction("OP_RETURN", offset);
-    case OP_CLASS:
-      return constantInstruction("OP_CLASS", chunk, offset);
-    case OP_METHOD:
-      return constantInstruction("OP_METHOD", chunk, offset);
-    case OP_CONSTANT:
-      return constantInstruction("OP_CONSTANT", chunk, offset);
-    case OP_CONSTANT_LONG:
-      return constantInstructionLong("OP_CONSTANT_LONG", chunk, offset);
-    case OP_NIL:
-      return simpleInstruction("OP_NIL", offset);
-    case OP_TRUE:
-      return simpleInstruction("OP_TRUE", offset);
-    case OP_FALSE:
-      return simpleInstruction("OP_FALSE", offset);
-    case OP_POP:
-      return simpleInstruction("OP_POP", offset);
-    case OP_GET_LOCAL:
-      return byteInstruction("OP_GET_LOCAL", chunk, offset);
-    case OP_SET_LOCAL:
-      return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-    case OP_GET_UPVALUE:
-      return byteInstruction("OP_GET_UPVALUE", chunk, offset);
-    case OP_SET_UPVALUE:
-      return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-    case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-    case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
-    case OP_GET_SUPER:
-      return constantInstruction("OP_GET_SUPER", chunk, offset);
-    case OP_EQUAL:
-      return simpleInstruction("OP_EQUAL", offset);
-    case OP_EQUAL_PRESERVE:
-      return simpleInstruction("OP_EQUAL_PRESERVE", offset);
-    case OP_GREATER:
-      return simpleInstruction("OP_GREATER", offset);
-    case OP_LESS:
-      return simpleInstruction("OP_LESS", offset);
-    case OP_ADD:
-      return simpleInstruction("OP_ADD", offset);
-    case OP_SUBTRACT:
-      return simpleInstruction("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:
-      return simpleInstruction("OP_MULTIPLY", offset);
-    case OP_DIVIDE:
-      return simpleInstruction("OP_DIVIDE", offset);
-    case OP_NOT:
-      return simpleInstruction("OP_NOT", offset);
-    case OP_NEGATE:
-      return simpleInstruction("OP_NEGATE", offset);
-    case OP_PRINT:
-      return simpleInstruction("OP_PRINT", offset);
-    case OP_INHERIT:
-      return simpleInstruction("OP_INHERIT", offset);
-    default:
-      printf("Unknown opcode %d\n", instruction);
-      return offset + 1;
   }
+  return offset + 1; // Unreachable.
 }
@@ -0,0 +1,1121 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+
+// A baseline compiler from bytecode to x86-64. Each instruction becomes a
+// fixed sequence of machine code working on the VM's own stack, so the frame
+// looks the same in machine code and in the interpreter and either can pick
+// it up at any instruction. Numbers are handled inline. Anything else calls
+// the same C code the interpreter uses. Calls and returns go through helpers
+// that push or pop the CallFrame and hand back the code to continue at, so
+// Lox calls never nest on the C stack.
+//
+// While in machine code these registers hold the interpreter's state. All of
+// them are callee-saved, so they survive the calls into C.
+//   rbx  the stack top
+//   r12  the frame's slots
+//   r13  the CallFrame
+//   r14  &vm
+//   r15  QNAN, which the other tags are small offsets from
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define STACK_TOP RBX
+#define SLOTS R12
+#define FRAME R13
+#define VM_BASE R14
+#define NAN_MASK R15
+
+// Condition codes, as in the low nibble of Jcc and SETcc
+enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_S = 0x8,
+  // Not a condition, an unconditional jump
+  CC_ALWAYS = -1
+};
+
+// Opcodes of the register to register forms of the ALU instructions
+enum {
+  ALU_ADD = 0x01,
+  ALU_AND = 0x21,
+  ALU_CMP = 0x39,
+  ALU_MOV = 0x89
+};
+
+// The second opcode byte of the scalar double instructions
+enum {
+  SSE_ADD = 0x58,
+  SSE_MUL = 0x59,
+  SSE_SUB = 0x5C,
+  SSE_DIV = 0x5E
+};
+
+// What the machine code returns to jitRun()
+typedef enum {
+  JIT_EXIT,
+  JIT_ERROR
+} JitStatus;
+
+// What a jump goes to
+typedef enum {
+  // The instruction at a bytecode offset
+  TARGET_INSTRUCTION,
+  // A position in the hot or cold code
+  TARGET_HOT,
+  TARGET_COLD,
+  // The blocks at the end of the function that leave the machine code
+  TARGET_EXIT,
+  TARGET_ERROR
+} TargetKind;
+
+// A rel32 jump to patch once the whole function is laid out
+typedef struct {
+  bool inCold;
+  int at;
+  TargetKind kind;
+  int target;
+} Fixup;
+
+typedef struct {
+  uint8_t *bytes;
+  int count;
+  int capacity;
+} Buffer;
+
+// Slow paths go to the cold code, which is laid out after the hot code, so
+// that the instructions of a hot loop stay close together.
+typedef struct {
+  Buffer hot;
+  Buffer cold;
+  Buffer *code;
+  // Where the fast path continues after the slow path being emitted
+  int resume;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+} Assembler;
+
+typedef int (*JitEntry)(CallFrame *frame, Value *stackTop, void *target);
+
+// Shared by all functions: the entry loads the registers above and jumps to
+// the target, the epilogue restores them and returns the status in eax.
+// [leave] returns JIT_EXIT.
+static JitEntry enterCode = NULL;
+static uint8_t *epilogue = NULL;
+static uint8_t *leave = NULL;
+
+// Machine code is bump allocated from executable mappings this big. Giving
+// every function pages of its own would put the same code of different
+// functions at the same page offsets, where the CPU's branch predictor and
+// instruction cache confuse them. The code of a freed function isn't reused.
+#define ARENA_SIZE (1024 * 1024)
+#define CODE_ALIGNMENT 16
+
+static uint8_t *arena = NULL;
+static size_t arenaSize = 0;
+static size_t arenaUsed = 0;
+
+static FILE *perfMap = NULL;
+
+static void emitByte(Assembler *as, uint8_t byte) {
+  Buffer *code = as->code;
+  if (code->count == code->capacity) {
+    int capacity = GROW_CAPACITY(code->capacity);
+    code->bytes = GROW_ARRAY(uint8_t, code->bytes, code->capacity, capacity);
+    code->capacity = capacity;
+  }
+  code->bytes[code->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (uint8_t) (value >> (8 * i)));
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(as, (uint8_t) (value >> (8 * i)));
+}
+
+static void patch32(uint8_t *at, uint32_t value) {
+  for (int i = 0; i < 4; i++) at[i] = (uint8_t) (value >> (8 * i));
+}
+
+static bool fitsByte(int32_t value) {
+  return value >= -128 && value <= 127;
+}
+
+static void emitRex(Assembler *as, int reg, int base) {
+  emitByte(as, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+}
+
+// The ModRM byte, and SIB when needed, for [base + disp]
+static void emitMemory(Assembler *as, int reg, int base, int32_t disp) {
+  bool shortDisp = fitsByte(disp);
+  emitByte(as, (shortDisp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emitByte(as, 0x24);
+  if (shortDisp) {
+    emitByte(as, (uint8_t) disp);
+  } else {
+    emit32(as, (uint32_t) disp);
+  }
+}
+
+// mov reg, imm64
+static void moveImmediate(Assembler *as, int reg, uint64_t value) {
+  emitRex(as, 0, reg);
+  emitByte(as, 0xB8 + (reg & 7));
+  emit64(as, value);
+}
+
+// lea reg, [r15 + tag], the value with that tag: nil, false, true...
+static void moveTagged(Assembler *as, int reg, int tag) {
+  emitRex(as, reg, NAN_MASK);
+  emitByte(as, 0x8D);
+  emitMemory(as, reg, NAN_MASK, tag);
+}
+
+// mov dst, [base + disp]
+static void load(Assembler *as, int dst, int base, int32_t disp) {
+  emitRex(as, dst, base);
+  emitByte(as, 0x8B);
+  emitMemory(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void store(Assembler *as, int base, int32_t disp, int src) {
+  emitRex(as, src, base);
+  emitByte(as, 0x89);
+  emitMemory(as, src, base, disp);
+}
+
+// op dst, src
+static void alu(Assembler *as, uint8_t op, int dst, int src) {
+  emitRex(as, src, dst);
+  emitByte(as, op);
+  emitByte(as, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// add reg, imm (sub with a negative amount)
+static void addImmediate(Assembler *as, int reg, int32_t amount) {
+  emitRex(as, 0, reg);
+  if (fitsByte(amount)) {
+    emitByte(as, 0x83);
+    emitByte(as, 0xC0 | (reg & 7));
+    emitByte(as, (uint8_t) amount);
+  } else {
+    emitByte(as, 0x81);
+    emitByte(as, 0xC0 | (reg & 7));
+    emit32(as, (uint32_t) amount);
+  }
+}
+
+// Moves the stack top by [count] values.
+static void adjustStack(Assembler *as, int count) {
+  addImmediate(as, STACK_TOP, count * (int32_t) sizeof(Value));
+}
+
+// The address of the value [distance] below the stack top
+static int32_t peek(int distance) {
+  return (int32_t) (-(distance + 1) * sizeof(Value));
+}
+
+// movq xmm, gpr and movq gpr, xmm. Only xmm0-7 and rax-rdi.
+static void moveToXmm(Assembler *as, int xmm, int reg) {
+  emitByte(as, 0x66);
+  emitByte(as, 0x48);
+  emitByte(as, 0x0F);
+  emitByte(as, 0x6E);
+  emitByte(as, 0xC0 | (xmm << 3) | reg);
+}
+
+static void moveFromXmm(Assembler *as, int reg, int xmm) {
+  emitByte(as, 0x66);
+  emitByte(as, 0x48);
+  emitByte(as, 0x0F);
+  emitByte(as, 0x7E);
+  emitByte(as, 0xC0 | (xmm << 3) | reg);
+}
+
+// addsd/subsd/mulsd/divsd dst, src
+static void sse(Assembler *as, uint8_t op, int dst, int src) {
+  emitByte(as, 0xF2);
+  emitByte(as, 0x0F);
+  emitByte(as, op);
+  emitByte(as, 0xC0 | (dst << 3) | src);
+}
+
+// ucomisd a, b
+static void compareDoubles(Assembler *as, int a, int b) {
+  emitByte(as, 0x66);
+  emitByte(as, 0x0F);
+  emitByte(as, 0x2E);
+  emitByte(as, 0xC0 | (a << 3) | b);
+}
+
+// call through rax to [function]
+static void callFunction(Assembler *as, void *function) {
+  moveImmediate(as, RAX, (uint64_t) (uintptr_t) function);
+  emitByte(as, 0xFF);
+  emitByte(as, 0xD0);
+}
+
+// jmp or jcc rel32, returning where the displacement goes
+static int emitJump(Assembler *as, int condition) {
+  if (condition == CC_ALWAYS) {
+    emitByte(as, 0xE9);
+  } else {
+    emitByte(as, 0x0F);
+    emitByte(as, 0x80 | condition);
+  }
+  emit32(as, 0);
+  return as->code->count - 4;
+}
+
+// Point a jump from emitJump() at the code emitted next in the same buffer.
+static void patchJump(Assembler *as, int at) {
+  patch32(&as->code->bytes[at], (uint32_t) (as->code->count - (at + 4)));
+}
+
+// A jump resolved once the whole function is laid out.
+static void jumpTo(Assembler *as, int condition, TargetKind kind, int target) {
+  int at = emitJump(as, condition);
+  if (as->fixupCount == as->fixupCapacity) {
+    int capacity = GROW_CAPACITY(as->fixupCapacity);
+    as->fixups = GROW_ARRAY(Fixup, as->fixups, as->fixupCapacity, capacity);
+    as->fixupCapacity = capacity;
+  }
+  as->fixups[as->fixupCount++] = (Fixup) {as->code == &as->cold, at, kind, target};
+}
+
+static void jumpToInstruction(Assembler *as, int condition, int offset) {
+  jumpTo(as, condition, TARGET_INSTRUCTION, offset);
+}
+
+// The fast path of an instruction jumps to its slow path with these. The
+// slow path comes next in the cold code once the fast path is done.
+static void jumpToSlowPath(Assembler *as, int condition) {
+  jumpTo(as, condition, TARGET_COLD, as->cold.count);
+}
+
+static void beginSlowPath(Assembler *as) {
+  as->resume = as->hot.count;
+  as->code = &as->cold;
+}
+
+// Ends a slow path, which continues with the code after the fast path if
+// [resumes].
+static void endSlowPath(Assembler *as, bool resumes) {
+  if (resumes) jumpTo(as, CC_ALWAYS, TARGET_HOT, as->resume);
+  as->code = &as->hot;
+}
+
+// Set frame->ip, the interpreter's view of where the code is.
+static void storeIp(Assembler *as, Code *ip) {
+  moveImmediate(as, RAX, (uint64_t) (uintptr_t) ip);
+  store(as, FRAME, (int32_t) offsetof(CallFrame, ip), RAX);
+}
+
+// Leave the machine code for the interpreter to run the instruction at
+// [slot].
+static void exitTo(Assembler *as, Code *slot) {
+  moveImmediate(as, RAX, (uint64_t) (uintptr_t) slot);
+  jumpTo(as, CC_ALWAYS, TARGET_EXIT, 0);
+}
+
+// Report a runtime error on the instruction at [slot]. runtimeError() finds
+// the line through frame->ip, which points just past the handler slot in the
+// interpreter.
+static void runtimeErrorAt(Assembler *as, Code *slot, const char *message) {
+  storeIp(as, slot + 1);
+  moveImmediate(as, RDI, (uint64_t) (uintptr_t) message);
+  callFunction(as, (void *) jitRuntimeError);
+  jumpTo(as, CC_ALWAYS, TARGET_ERROR, 0);
+}
+
+// Call a helper that works on vm.stackTop.
+static void callHelper(Assembler *as, void *function) {
+  store(as, VM_BASE, (int32_t) offsetof(VM, stackTop), STACK_TOP);
+  callFunction(as, function);
+  load(as, STACK_TOP, VM_BASE, (int32_t) offsetof(VM, stackTop));
+}
+
+// Sets the flags from the bool a C function just returned.
+static void testResult(Assembler *as) {
+  emitByte(as, 0x84); // test al, al
+  emitByte(as, 0xC0);
+}
+
+// Leave through the error block if the helper just called returned false.
+static void checkHelper(Assembler *as) {
+  testResult(as);
+  jumpTo(as, CC_E, TARGET_ERROR, 0);
+}
+
+// Continue at the code a call or return helper handed back in rax, in the
+// frame now on top. Each call site gets its own indirect jump so the CPU can
+// predict them apart.
+static void continueInFrame(Assembler *as) {
+  emitByte(as, 0x48); // test rax, rax
+  emitByte(as, 0x85);
+  emitByte(as, 0xC0);
+  jumpTo(as, CC_E, TARGET_ERROR, 0);
+  // frame = &vm.frames[vm.frameCount - 1]
+  load(as, FRAME, VM_BASE, (int32_t) offsetof(VM, frames));
+  emitRex(as, RDX, VM_BASE); // movsxd rdx, [r14 + frameCount]
+  emitByte(as, 0x63);
+  emitMemory(as, RDX, VM_BASE, (int32_t) offsetof(VM, frameCount));
+  emitByte(as, 0x48); // imul rdx, rdx, sizeof(CallFrame)
+  emitByte(as, 0x6B);
+  emitByte(as, 0xD2);
+  emitByte(as, (uint8_t) sizeof(CallFrame));
+  alu(as, ALU_ADD, FRAME, RDX);
+  addImmediate(as, FRAME, -(int32_t) sizeof(CallFrame));
+  load(as, SLOTS, FRAME, (int32_t) offsetof(CallFrame, slots));
+  emitByte(as, 0xFF); // jmp rax
+  emitByte(as, 0xE0);
+}
+
+// The machine code only does arithmetic on doubles, so small integer
+// constants become doubles when compiling.
+static uint64_t asDouble(Value value) {
+  return IS_INT(value) ? NUMBER_VAL(AS_NUMBER(value)) : value;
+}
+
+// Jumps to the slow path unless [reg] holds a double. Clobbers rdx.
+static void checkNumber(Assembler *as, int reg) {
+  alu(as, ALU_MOV, RDX, reg);
+  alu(as, ALU_AND, RDX, NAN_MASK);
+  alu(as, ALU_CMP, RDX, NAN_MASK);
+  jumpToSlowPath(as, CC_E);
+}
+
+// Small integers from the interpreter fail checkNumber() too. A slow path
+// starts by turning those among the first [count] of rax and rcx into the
+// same doubles and going back to the fast path at [retry], right after the
+// checks. Anything else goes on with the rest of the slow path.
+static void convertInts(Assembler *as, int count, int retry) {
+  int notNumber[2];
+  for (int i = 0; i < count; i++) {
+    int reg = i == 0 ? RAX : RCX;
+    alu(as, ALU_MOV, RDX, reg);
+    alu(as, ALU_AND, RDX, NAN_MASK);
+    alu(as, ALU_CMP, RDX, NAN_MASK);
+    int isDouble = emitJump(as, CC_NE);
+    alu(as, ALU_MOV, RDX, reg);
+    emitByte(as, 0x48); // shr rdx, 48
+    emitByte(as, 0xC1);
+    emitByte(as, 0xEA);
+    emitByte(as, 48);
+    emitByte(as, 0x81); // cmp edx, INT_TAG >> 48
+    emitByte(as, 0xFA);
+    emit32(as, (uint32_t) (INT_TAG >> 48));
+    notNumber[i] = emitJump(as, CC_NE);
+    emitByte(as, 0x48); // movsxd reg, reg32
+    emitByte(as, 0x63);
+    emitByte(as, 0xC0 | (reg << 3) | reg);
+    emitByte(as, 0xF2); // cvtsi2sd xmm0, reg
+    emitByte(as, 0x48);
+    emitByte(as, 0x0F);
+    emitByte(as, 0x2A);
+    emitByte(as, 0xC0 | reg);
+    moveFromXmm(as, reg, 0);
+    patchJump(as, isDouble);
+  }
+  jumpTo(as, CC_ALWAYS, TARGET_HOT, retry);
+  for (int i = 0; i < count; i++) patchJump(as, notNumber[i]);
+}
+
+// Loads a and b of a binary instruction into xmm0 and xmm1, going to the
+// slow path unless both are doubles. [b] is the immediate operand or NULL
+// for the value on top of the stack. Returns where the slow path retries
+// after convertInts().
+static int loadNumbers(Assembler *as, Value *b) {
+  int retry;
+  if (b == NULL) {
+    load(as, RAX, STACK_TOP, peek(1));
+    load(as, RCX, STACK_TOP, peek(0));
+    checkNumber(as, RAX);
+    checkNumber(as, RCX);
+    retry = as->hot.count;
+  } else {
+    load(as, RAX, STACK_TOP, peek(0));
+    checkNumber(as, RAX);
+    retry = as->hot.count;
+    moveImmediate(as, RCX, asDouble(*b));
+  }
+  moveToXmm(as, 0, RAX);
+  moveToXmm(as, 1, RCX);
+  return retry;
+}
+
+// Turns the flags of a comparison into a Lox bool in rax.
+static void boolFromFlags(Assembler *as, int condition) {
+  emitByte(as, 0x0F); // setcc al
+  emitByte(as, 0x90 | condition);
+  emitByte(as, 0xC0);
+  emitByte(as, 0x0F); // movzx eax, al
+  emitByte(as, 0xB6);
+  emitByte(as, 0xC0);
+  emitByte(as, 0x49); // lea rax, [r15 + rax + TAG_FALSE]
+  emitByte(as, 0x8D);
+  emitByte(as, 0x44);
+  emitByte(as, 0x07);
+  emitByte(as, TAG_FALSE);
+}
+
+// ucomisd sets 'above' for a > b only, so every comparison is a > b or b > a
+// and its negation, which also gets NaN right.
+static void compareNumbers(Assembler *as, bool greater) {
+  if (greater) {
+    compareDoubles(as, 0, 1);
+  } else {
+    compareDoubles(as, 1, 0);
+  }
+}
+
+// Replaces the operands of a binary instruction with the result in rax.
+static void storeResult(Assembler *as, Value *b) {
+  if (b == NULL) {
+    store(as, STACK_TOP, peek(1), RAX);
+    adjustStack(as, -1);
+  } else {
+    store(as, STACK_TOP, peek(0), RAX);
+  }
+}
+
+// Arithmetic on the two numbers on top of the stack or on top of the stack
+// and the immediate [b]. Other operands go to jitAdd() if [message] is NULL
+// and are an error with [message] otherwise.
+static void arithmetic(Assembler *as, Code *slot, uint8_t op, Value *b,
+                       const char *message) {
+  int retry = loadNumbers(as, b);
+  sse(as, op, 0, 1);
+  moveFromXmm(as, RAX, 0);
+  storeResult(as, b);
+
+  beginSlowPath(as);
+  convertInts(as, b == NULL ? 2 : 1, retry);
+  if (message == NULL) {
+    storeIp(as, slot + 1);
+    callHelper(as, (void *) jitAdd);
+    checkHelper(as);
+  } else {
+    runtimeErrorAt(as, slot, message);
+  }
+  endSlowPath(as, message == NULL);
+}
+
+static void comparison(Assembler *as, Code *slot, bool greater, Value *b) {
+  int retry = loadNumbers(as, b);
+  compareNumbers(as, greater);
+  boolFromFlags(as, CC_A);
+  storeResult(as, b);
+
+  beginSlowPath(as);
+  convertInts(as, b == NULL ? 2 : 1, retry);
+  runtimeErrorAt(as, slot, "Operands must be numbers.");
+  endSlowPath(as, false);
+}
+
+// The fused compare-and-jump instructions. Jumps to [target] if a > b (or
+// b > a unless [greater]) is [whenTrue].
+static void compareJump(Assembler *as, Code *slot, bool greater, bool whenTrue,
+                        Value *b, int target) {
+  int retry = loadNumbers(as, b);
+  adjustStack(as, b == NULL ? -2 : -1);
+  compareNumbers(as, greater);
+  jumpToInstruction(as, whenTrue ? CC_A : CC_BE, target);
+
+  beginSlowPath(as);
+  convertInts(as, b == NULL ? 2 : 1, retry);
+  runtimeErrorAt(as, slot, "Operands must be numbers.");
+  endSlowPath(as, false);
+}
+
+// rax = valuesEqual(a, b) for the two values on top of the stack
+static void callValuesEqual(Assembler *as) {
+  load(as, RDI, STACK_TOP, peek(1));
+  load(as, RSI, STACK_TOP, peek(0));
+  callFunction(as, (void *) valuesEqual);
+}
+
+// Jumps to the instruction at [target] if the value in rax is nil or false.
+static void jumpIfFalsey(Assembler *as, int target) {
+  moveTagged(as, RDX, TAG_NIL);
+  alu(as, ALU_CMP, RAX, RDX);
+  jumpToInstruction(as, CC_E, target);
+  moveTagged(as, RDX, TAG_FALSE);
+  alu(as, ALU_CMP, RAX, RDX);
+  jumpToInstruction(as, CC_E, target);
+}
+
+// rcx = the ObjUpvalue's location
+static void loadUpvalue(Assembler *as, int index) {
+  load(as, RCX, FRAME, (int32_t) offsetof(CallFrame, closure));
+  load(as, RCX, RCX, (int32_t) offsetof(ObjClosure, upvalues));
+  load(as, RCX, RCX, index * (int32_t) sizeof(ObjUpvalue *));
+  load(as, RCX, RCX, (int32_t) offsetof(ObjUpvalue, location));
+}
+
+// rcx = vm.globalValues.values. The array moves when it grows, so it is
+// looked up every time.
+static void loadGlobals(Assembler *as) {
+  load(as, RCX, VM_BASE, (int32_t) (offsetof(VM, globalValues) + offsetof(ValueArray, values)));
+}
+
+static int32_t globalAt(int slot) {
+  return slot * (int32_t) sizeof(Value);
+}
+
+// Errors unless the global in rax is defined.
+static void checkDefined(Assembler *as, Code *slot, int global) {
+  moveTagged(as, RDX, TAG_UNDEFINED);
+  alu(as, ALU_CMP, RAX, RDX);
+  jumpToSlowPath(as, CC_E);
+
+  beginSlowPath(as);
+  storeIp(as, slot + 1);
+  moveImmediate(as, RDI, (uint64_t) global);
+  callFunction(as, (void *) jitUndefinedVariable);
+  jumpTo(as, CC_ALWAYS, TARGET_ERROR, 0);
+  endSlowPath(as, false);
+}
+
+// OP_GET_PROPERTY. A field found through the first entry of the inline
+// cache is read inline, everything else goes to jitGetProperty().
+static void getProperty(Assembler *as, Code *slot) {
+  InlineCache *cache = slot[2].cache;
+  load(as, RAX, STACK_TOP, peek(0));
+  // An object has all of QNAN and the sign bit set, the top 14 bits.
+  alu(as, ALU_MOV, RDX, RAX);
+  emitByte(as, 0x48); // shr rdx, 50
+  emitByte(as, 0xC1);
+  emitByte(as, 0xEA);
+  emitByte(as, 50);
+  emitByte(as, 0x81); // cmp edx, 0x3fff
+  emitByte(as, 0xFA);
+  emit32(as, 0x3FFF);
+  jumpToSlowPath(as, CC_NE);
+  emitByte(as, 0x48); // shl rax, 14
+  emitByte(as, 0xC1);
+  emitByte(as, 0xE0);
+  emitByte(as, 14);
+  emitByte(as, 0x48); // shr rax, 14
+  emitByte(as, 0xC1);
+  emitByte(as, 0xE8);
+  emitByte(as, 14);
+  emitByte(as, 0x83); // cmp dword [rax + type], OBJ_INSTANCE
+  emitMemory(as, 7, RAX, (int32_t) offsetof(Obj, type));
+  emitByte(as, OBJ_INSTANCE);
+  jumpToSlowPath(as, CC_NE);
+
+  // The cache must hold a field, not a transition or a method, for the
+  // instance's shape. An unused entry's slot is -1.
+  moveImmediate(as, RCX, (uint64_t) (uintptr_t) &cache->entries[0]);
+  load(as, RDX, RAX, (int32_t) offsetof(ObjInstance, shape));
+  emitRex(as, RDX, RCX); // cmp rdx, [rcx + shape]
+  emitByte(as, 0x3B);
+  emitMemory(as, RDX, RCX, (int32_t) offsetof(CacheEntry, shape));
+  jumpToSlowPath(as, CC_NE);
+  emitRex(as, 7, RCX); // cmp qword [rcx + transition], 0
+  emitByte(as, 0x83);
+  emitMemory(as, 7, RCX, (int32_t) offsetof(CacheEntry, transition));
+  emitByte(as, 0);
+  jumpToSlowPath(as, CC_NE);
+  emitRex(as, RDX, RCX); // movsxd rdx, [rcx + slot]
+  emitByte(as, 0x63);
+  emitMemory(as, RDX, RCX, (int32_t) offsetof(CacheEntry, slot));
+  emitByte(as, 0x85); // test edx, edx
+  emitByte(as, 0xD2);
+  jumpToSlowPath(as, CC_S);
+  load(as, RAX, RAX, (int32_t) offsetof(ObjInstance, fields));
+  emitRex(as, RAX, RAX); // mov rax, [rax + rdx * 8]
+  emitByte(as, 0x8B);
+  emitByte(as, 0x04);
+  emitByte(as, 0xD0);
+  store(as, STACK_TOP, peek(0), RAX);
+
+  beginSlowPath(as);
+  storeIp(as, slot + 1);
+  moveImmediate(as, RDI, (uint64_t) (uintptr_t) AS_OBJ(slot[1].value));
+  moveImmediate(as, RSI, (uint64_t) (uintptr_t) cache);
+  callHelper(as, (void *) jitGetProperty);
+  checkHelper(as);
+  endSlowPath(as, true);
+}
+
+// Push rax.
+static void pushResult(Assembler *as) {
+  store(as, STACK_TOP, 0, RAX);
+  adjustStack(as, 1);
+}
+
+// The instruction at [offset] in [function], whose threaded code starts at
+// [slot] and ends before [next].
+static void compileInstruction(Assembler *as, ObjFunction *function, int offset,
+                               Code *slot, Code *next) {
+  Chunk *chunk = &function->chunk;
+  uint8_t opcode = untypedOpcode(chunk->code[offset]);
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_SMALL_INT:
+      moveImmediate(as, RAX, asDouble(slot[1].value));
+      pushResult(as);
+      break;
+    case OP_NIL:
+      moveTagged(as, RAX, TAG_NIL);
+      pushResult(as);
+      break;
+    case OP_TRUE:
+      moveTagged(as, RAX, TAG_TRUE);
+      pushResult(as);
+      break;
+    case OP_FALSE:
+      moveTagged(as, RAX, TAG_FALSE);
+      pushResult(as);
+      break;
+    case OP_POP:
+      adjustStack(as, -1);
+      break;
+    case OP_POPN:
+      adjustStack(as, -slot[1].operand);
+      break;
+    case OP_GET_LOCAL:
+      load(as, RAX, SLOTS, slot[1].operand * (int32_t) sizeof(Value));
+      pushResult(as);
+      break;
+    case OP_SET_LOCAL:
+      load(as, RAX, STACK_TOP, peek(0));
+      store(as, SLOTS, slot[1].operand * (int32_t) sizeof(Value), RAX);
+      break;
+    case OP_GET_GLOBAL:
+      loadGlobals(as);
+      load(as, RAX, RCX, globalAt(slot[1].operand));
+      checkDefined(as, slot, slot[1].operand);
+      pushResult(as);
+      break;
+    case OP_DEFINE_GLOBAL:
+      loadGlobals(as);
+      load(as, RAX, STACK_TOP, peek(0));
+      store(as, RCX, globalAt(slot[1].operand), RAX);
+      adjustStack(as, -1);
+      break;
+    case OP_SET_GLOBAL:
+      loadGlobals(as);
+      load(as, RAX, RCX, globalAt(slot[1].operand));
+      checkDefined(as, slot, slot[1].operand);
+      load(as, RAX, STACK_TOP, peek(0));
+      store(as, RCX, globalAt(slot[1].operand), RAX);
+      break;
+    case OP_GET_UPVALUE:
+      loadUpvalue(as, slot[1].operand);
+      load(as, RAX, RCX, 0);
+      pushResult(as);
+      break;
+    case OP_SET_UPVALUE:
+      loadUpvalue(as, slot[1].operand);
+      load(as, RAX, STACK_TOP, peek(0));
+      store(as, RCX, 0, RAX);
+      break;
+    case OP_GET_PROPERTY:
+      getProperty(as, slot);
+      break;
+    case OP_SET_PROPERTY:
+      storeIp(as, slot + 1);
+      moveImmediate(as, RDI, (uint64_t) (uintptr_t) AS_OBJ(slot[1].value));
+      moveImmediate(as, RSI, (uint64_t) (uintptr_t) slot[2].cache);
+      callHelper(as, (void *) jitSetProperty);
+      checkHelper(as);
+      break;
+    case OP_EQUAL:
+      callValuesEqual(as);
+      testResult(as);
+      boolFromFlags(as, CC_NE);
+      storeResult(as, NULL);
+      break;
+    case OP_EQUAL_PRESERVE:
+      callValuesEqual(as);
+      testResult(as);
+      boolFromFlags(as, CC_NE);
+      store(as, STACK_TOP, peek(0), RAX);
+      break;
+    case OP_GREATER:
+      comparison(as, slot, true, NULL);
+      break;
+    case OP_LESS:
+      comparison(as, slot, false, NULL);
+      break;
+    case OP_ADD:
+      arithmetic(as, slot, SSE_ADD, NULL, NULL);
+      break;
+    case OP_SUBTRACT:
+      arithmetic(as, slot, SSE_SUB, NULL, "Operands must be numbers.");
+      break;
+    case OP_MULTIPLY:
+      arithmetic(as, slot, SSE_MUL, NULL, "Operands must be numbers.");
+      break;
+    case OP_DIVIDE:
+      arithmetic(as, slot, SSE_DIV, NULL, "Operands must be numbers.");
+      break;
+    case OP_NOT: {
+      load(as, RAX, STACK_TOP, peek(0));
+      moveTagged(as, RCX, TAG_TRUE);
+      moveTagged(as, RDX, TAG_NIL);
+      alu(as, ALU_CMP, RAX, RDX);
+      int isNil = emitJump(as, CC_E);
+      moveTagged(as, RDX, TAG_FALSE);
+      alu(as, ALU_CMP, RAX, RDX);
+      int isFalse = emitJump(as, CC_E);
+      moveTagged(as, RCX, TAG_FALSE);
+      patchJump(as, isNil);
+      patchJump(as, isFalse);
+      store(as, STACK_TOP, peek(0), RCX);
+      break;
+    }
+    case OP_NEGATE: {
+      load(as, RAX, STACK_TOP, peek(0));
+      checkNumber(as, RAX);
+      int retry = as->hot.count;
+      emitByte(as, 0x48); // btc rax, 63
+      emitByte(as, 0x0F);
+      emitByte(as, 0xBA);
+      emitByte(as, 0xF8);
+      emitByte(as, 63);
+      store(as, STACK_TOP, peek(0), RAX);
+
+      beginSlowPath(as);
+      convertInts(as, 1, retry);
+      runtimeErrorAt(as, slot, "Operand must be a number.");
+      endSlowPath(as, false);
+      break;
+    }
+    case OP_PRINT:
+      load(as, RDI, STACK_TOP, peek(0));
+      adjustStack(as, -1);
+      callFunction(as, (void *) jitPrint);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      jumpToInstruction(as, CC_ALWAYS, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      load(as, RAX, STACK_TOP, peek(0));
+      jumpIfFalsey(as, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+      callValuesEqual(as);
+      adjustStack(as, -2);
+      testResult(as);
+      jumpToInstruction(as, opcode == OP_JUMP_IF_EQUAL ? CC_NE : CC_E,
+                        jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      compareJump(as, slot, false, false, NULL, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      compareJump(as, slot, true, true, NULL, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      compareJump(as, slot, true, false, NULL, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      compareJump(as, slot, false, true, NULL, jumpTarget(chunk, offset));
+      break;
+    case OP_ADD_IMM:
+      arithmetic(as, slot, SSE_ADD, &slot[1].value,
+                 "Operands must be two numbers or two strings");
+      break;
+    case OP_SUBTRACT_IMM:
+      arithmetic(as, slot, SSE_SUB, &slot[1].value, "Operands must be numbers.");
+      break;
+    case OP_GREATER_IMM:
+      comparison(as, slot, true, &slot[1].value);
+      break;
+    case OP_LESS_IMM:
+      comparison(as, slot, false, &slot[1].value);
+      break;
+    case OP_JUMP_IF_NOT_LESS_IMM:
+      compareJump(as, slot, false, false, &slot[1].value, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+      compareJump(as, slot, true, true, &slot[1].value, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_GREATER_IMM:
+      compareJump(as, slot, true, false, &slot[1].value, jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM:
+      compareJump(as, slot, false, true, &slot[1].value, jumpTarget(chunk, offset));
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      // The caller continues after the call, in either engine.
+      storeIp(as, next);
+      moveImmediate(as, RDI, (uint64_t) slot[1].operand);
+      callHelper(as, opcode == OP_CALL ? (void *) jitCall : (void *) jitTailCall);
+      continueInFrame(as);
+      break;
+    case OP_INTRINSIC:
+      // Carries on in this frame unless the builtin was replaced, which
+      // makes it a call.
+      storeIp(as, next);
+      moveImmediate(as, RDI, (uint64_t) slot[1].operand);
+      callHelper(as, (void *) jitIntrinsic);
+      testResult(as);
+      jumpTo(as, CC_E, TARGET_ERROR, 0);
+      emitByte(as, 0x3C); // cmp al, INTRINSIC_DONE
+      emitByte(as, INTRINSIC_DONE);
+      jumpToSlowPath(as, CC_NE);
+      beginSlowPath(as);
+      moveImmediate(as, RDI, (uint64_t) intrinsics[slot[1].operand].arity);
+      callHelper(as, (void *) jitCall);
+      continueInFrame(as);
+      endSlowPath(as, false);
+      break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_SUPER_INVOKE:
+      storeIp(as, next);
+      moveImmediate(as, RDI, (uint64_t) (uintptr_t) AS_OBJ(slot[1].value));
+      moveImmediate(as, RSI, (uint64_t) slot[2].operand);
+      if (opcode != OP_SUPER_INVOKE) {
+        moveImmediate(as, RDX, (uint64_t) (uintptr_t) slot[3].cache);
+        callHelper(as, opcode == OP_INVOKE ? (void *) jitInvoke : (void *) jitTailInvoke);
+      } else {
+        callHelper(as, (void *) jitSuperInvoke);
+      }
+      continueInFrame(as);
+      break;
+    case OP_RETURN:
+      // The script's frame is the last one. Returning from it ends the run,
+      // which is up to the interpreter.
+      if (function->name == NULL) {
+        exitTo(as, slot);
+        break;
+      }
+      callHelper(as, (void *) jitReturn);
+      continueInFrame(as);
+      break;
+    case OP_CLOSURE:
+      storeIp(as, slot + 1);
+      moveImmediate(as, RDI, (uint64_t) (uintptr_t) AS_OBJ(slot[1].value));
+      moveImmediate(as, RSI, (uint64_t) (uintptr_t) &slot[2]);
+      callHelper(as, (void *) jitClosure);
+      break;
+    case OP_CLOSE_UPVALUE:
+      callHelper(as, (void *) jitCloseUpvalue);
+      break;
+    default:
+      // Class definitions and super accesses
+      exitTo(as, slot);
+      break;
+  }
+}
+
+// Copy [count] bytes of [code] into executable memory. Returns NULL if it
+// can't be mapped.
+static uint8_t *mapCode(uint8_t *code, int count) {
+  size_t size = ((size_t) count + CODE_ALIGNMENT - 1) & ~(size_t) (CODE_ALIGNMENT - 1);
+  if (arena == NULL || arenaUsed + size > arenaSize) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mapSize = size > ARENA_SIZE ? size : ARENA_SIZE;
+    mapSize = (mapSize + pageSize - 1) / pageSize * pageSize;
+    uint8_t *mapped = mmap(NULL, mapSize, PROT_READ | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return NULL;
+    arena = mapped;
+    arenaSize = mapSize;
+    arenaUsed = 0;
+  }
+
+  // Never writable and executable at once. No machine code runs while the
+  // compiler does.
+  if (mprotect(arena, arenaSize, PROT_READ | PROT_WRITE) != 0) return NULL;
+  uint8_t *mapped = arena + arenaUsed;
+  memcpy(mapped, code, count);
+  arenaUsed += size;
+  if (mprotect(arena, arenaSize, PROT_READ | PROT_EXEC) != 0) return NULL;
+  return mapped;
+}
+
+// Tell perf where the code is, see tools/perf/Documentation/jit-interface.txt
+// in the Linux tree.
+static void writePerfMap(void *code, int size, const char *name) {
+  if (!vm.perfMap) return;
+  if (perfMap == NULL) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+    perfMap = fopen(path, "a");
+    if (perfMap == NULL) return;
+  }
+  fprintf(perfMap, "%lx %x clox:%s\n", (unsigned long) (uintptr_t) code, size, name);
+  fflush(perfMap);
+}
+
+static void initAssembler(Assembler *as) {
+  as->hot = (Buffer) {NULL, 0, 0};
+  as->cold = (Buffer) {NULL, 0, 0};
+  as->code = &as->hot;
+  as->resume = 0;
+  as->fixups = NULL;
+  as->fixupCount = 0;
+  as->fixupCapacity = 0;
+}
+
+static void freeAssembler(Assembler *as) {
+  FREE_ARRAY(uint8_t, as->hot.bytes, as->hot.capacity);
+  FREE_ARRAY(uint8_t, as->cold.bytes, as->cold.capacity);
+  FREE_ARRAY(Fixup, as->fixups, as->fixupCapacity);
+}
+
+// The entry and epilogue every function's code shares.
+static bool compileStubs() {
+  Assembler as;
+  initAssembler(&as);
+
+  // rbp and rbx, then r12 to r15
+  emitByte(&as, 0x55);
+  emitByte(&as, 0x53);
+  for (int reg = R12; reg <= R15; reg++) {
+    emitByte(&as, 0x41);
+    emitByte(&as, 0x50 + (reg & 7));
+  }
+  // Six pushes leave the stack 8 bytes off the 16 the ABI wants at calls.
+  addImmediate(&as, RSP, -8);
+  alu(&as, ALU_MOV, FRAME, RDI);
+  alu(&as, ALU_MOV, STACK_TOP, RSI);
+  load(&as, SLOTS, FRAME, (int32_t) offsetof(CallFrame, slots));
+  moveImmediate(&as, VM_BASE, (uint64_t) (uintptr_t) &vm);
+  moveImmediate(&as, NAN_MASK, QNAN);
+  emitByte(&as, 0xFF); // jmp rdx
+  emitByte(&as, 0xE2);
+
+  int leaveStart = as.hot.count;
+  emitByte(&as, 0xB8); // mov eax, JIT_EXIT
+  emit32(&as, JIT_EXIT);
+
+  int epilogueStart = as.hot.count;
+  addImmediate(&as, RSP, 8);
+  for (int reg = R15; reg >= R12; reg--) {
+    emitByte(&as, 0x41);
+    emitByte(&as, 0x58 + (reg & 7));
+  }
+  emitByte(&as, 0x5B);
+  emitByte(&as, 0x5D);
+  emitByte(&as, 0xC3);
+
+  uint8_t *code = mapCode(as.hot.bytes, as.hot.count);
+  if (code != NULL) {
+    enterCode = (JitEntry) (void *) code;
+    leave = code + leaveStart;
+    epilogue = code + epilogueStart;
+    writePerfMap(code, as.hot.count, "jit_entry");
+  }
+  freeAssembler(&as);
+  return code != NULL;
+}
+
+void jitCompile(ObjFunction *function) {
+  if (enterCode == NULL && !compileStubs()) return;
+
+  Chunk *chunk = &function->chunk;
+  Assembler as;
+  initAssembler(&as);
+  int *nativeOffset = ALLOCATE(int, chunk->count);
+
+  int slot = 0;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    nativeOffset[offset] = as.hot.count;
+    int length = threadedLength(chunk, offset);
+    compileInstruction(&as, function, offset, &chunk->threaded[slot],
+                       &chunk->threaded[slot + length]);
+    slot += length;
+  }
+
+  // rax holds the ip the interpreter resumes at.
+  int exitLabel = as.hot.count;
+  store(&as, FRAME, (int32_t) offsetof(CallFrame, ip), RAX);
+  store(&as, VM_BASE, (int32_t) offsetof(VM, stackTop), STACK_TOP);
+  emitByte(&as, 0xB8); // mov eax, JIT_EXIT
+  emit32(&as, JIT_EXIT);
+  moveImmediate(&as, RCX, (uint64_t) (uintptr_t) epilogue);
+  emitByte(&as, 0xFF); // jmp rcx
+  emitByte(&as, 0xE1);
+
+  // The error has been reported, which also reset the stack.
+  int errorLabel = as.hot.count;
+  emitByte(&as, 0xB8); // mov eax, JIT_ERROR
+  emit32(&as, JIT_ERROR);
+  moveImmediate(&as, RCX, (uint64_t) (uintptr_t) epilogue);
+  emitByte(&as, 0xFF);
+  emitByte(&as, 0xE1);
+
+  // Lay the cold code out after the hot code and resolve the jumps.
+  int coldStart = as.hot.count;
+  for (int i = 0; i < as.cold.count; i++) emitByte(&as, as.cold.bytes[i]);
+  for (int i = 0; i < as.fixupCount; i++) {
+    Fixup *fixup = &as.fixups[i];
+    int at = fixup->at + (fixup->inCold ? coldStart : 0);
+    int target = 0;
+    switch (fixup->kind) {
+      case TARGET_INSTRUCTION: target = nativeOffset[fixup->target]; break;
+      case TARGET_HOT: target = fixup->target; break;
+      case TARGET_COLD: target = coldStart + fixup->target; break;
+      case TARGET_EXIT: target = exitLabel; break;
+      case TARGET_ERROR: target = errorLabel; break;
+    }
+    patch32(&as.hot.bytes[at], (uint32_t) (target - (at + 4)));
+  }
+
+  uint8_t *code = mapCode(as.hot.bytes, as.hot.count);
+  if (code != NULL) {
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    // Every slot of an instruction maps to its start, as in threadedOffsets.
+    jit->count = chunk->threadedCount;
+    jit->nativeAt = ALLOCATE(void *, chunk->threadedCount);
+    for (int i = 0; i < chunk->threadedCount; i++) {
+      jit->nativeAt[i] = code + nativeOffset[chunk->threadedOffsets[i]];
+    }
+    function->jit = jit;
+    writePerfMap(code, as.hot.count, function->name == NULL ? "script" : function->name->chars);
+  }
+
+  FREE_ARRAY(int, nativeOffset, chunk->count);
+  freeAssembler(&as);
+}
+
+bool jitRun(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  void *target = function->jit->nativeAt[frame->ip - function->chunk.threaded];
+  return enterCode(frame, vm.stackTop, target) == JIT_EXIT;
+}
+
+void *jitResume() {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  ObjFunction *function = frame->closure->function;
+  if (function->jit == NULL) return leave;
+  return function->jit->nativeAt[frame->ip - function->chunk.threaded];
+}
+
+void freeJitCode(JitCode *jit) {
+  if (jit == NULL) return;
+  FREE_ARRAY(void *, jit->nativeAt, jit->count);
+  FREE(JitCode, jit);
+}
+
+#endif
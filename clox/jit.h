@@ -0,0 +1,65 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "vm.h"
+
+// A function is compiled once its calls and loop back-edges add up to this.
+#define JIT_THRESHOLD 1000
+
+// The machine code of one function. Class definitions and super accesses
+// aren't compiled: the code leaves to the interpreter at them, which comes
+// back in through jitRun() on the next call, return or back-edge into the
+// function.
+typedef struct JitCode {
+  uint8_t *code;
+  // Where each instruction starts in [code], indexed by threaded code slot
+  void **nativeAt;
+  int count;
+} JitCode;
+
+// Compile [function], whose chunk must already be threaded. Leaves
+// function->jit NULL if the code can't be mapped.
+void jitCompile(ObjFunction *function);
+
+// Run [frame] in its function's machine code from frame->ip, with the stack
+// top in vm.stackTop. Returns false after a runtime error. Otherwise the
+// frame on top, which calls and returns may have changed, is left at the
+// instruction for the interpreter to run.
+bool jitRun(CallFrame *frame);
+
+void freeJitCode(JitCode *jit);
+
+// Where to continue after a helper switched frames: the machine code for the
+// new top frame's ip, or code that leaves to the interpreter if it has none.
+void *jitResume();
+
+// Helpers in vm.c the machine code calls. Those that can fail report the
+// runtime error themselves and return false. Those that push or pop work on
+// vm.stackTop, which the code stores before the call and reloads after it.
+void jitRuntimeError(const char *message);
+void jitUndefinedVariable(int slot);
+bool jitAdd();
+bool jitGetProperty(ObjString *name, InlineCache *cache);
+bool jitSetProperty(ObjString *name, InlineCache *cache);
+void jitPrint(Value value);
+void jitClosure(ObjFunction *function, Code *operands);
+void jitCloseUpvalue();
+// Doesn't switch frames. A replaced builtin is left to jitCall().
+IntrinsicStatus jitIntrinsic(int id);
+// Calls and returns push or pop the frame, like the interpreter does, and
+// return jitResume() or NULL after an error.
+void *jitCall(int argCount);
+void *jitTailCall(int argCount);
+void *jitInvoke(ObjString *name, int argCount, InlineCache *cache);
+void *jitTailInvoke(ObjString *name, int argCount, InlineCache *cache);
+void *jitSuperInvoke(ObjString *name, int argCount);
+void *jitReturn();
+
+#endif
+
+#endif
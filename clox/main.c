@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "aot.h"
 #include "common.h"
 #include "vm.h"
 
@@ -9,6 +11,7 @@ static void repl() {
     // Max number of characters to evaluate at once
     // 1024 is a hardcoded terminal limit, for longer inputs, the repl mode isn't suitable
     char line[1024];
+    vm.repl = true;
     // REPL = Read-Eval-Print-Loop
     // Here is the loop
     for (;;) {
@@ -69,6 +72,24 @@ static void runFile(const char *path) {
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void emitFile(const char *path, const char *outputPath) {
+    // Compiles the file and writes it out as C instead of running it
+    char *source = readFile(path);
+    FILE *output = fopen(outputPath, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+        exit(74);
+    }
+    InterpretResult result = emitC(source, output);
+    fclose(output);
+    free(source);
+
+    if (result == INTERPRET_COMPILE_ERROR) {
+        remove(outputPath);
+        exit(65);
+    }
+}
+
 void intArrayTest() {
   Array array;
   initArray(&array, sizeof(uint16_t));
@@ -91,18 +112,92 @@ void intArrayTest() {
 
 }
 
+// Whether the environment variable [name] is set to anything but "" or "0".
+static bool envFlag(const char *name) {
+    const char *value = getenv(name);
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O] [--registers] [--no-jit] [--perf-map] [--emit-c output.c] "
+                    "[--print-code] [--trace] [--log-gc] [path]\n");
+    // 64?
+    exit(64);
+}
+
 int main(int argc, const char *argv[]) {
     // argc is the number of arguments?
     initVM();
 
-    if (argc == 1) {
+    // The debugging output can also be turned on from the environment, for
+    // runs whose command line is out of reach.
+    vm.printCode = envFlag("CLOX_PRINT_CODE");
+    vm.traceExecution = envFlag("CLOX_TRACE");
+    vm.logGC = envFlag("CLOX_LOG_GC");
+#ifdef JIT
+    vm.perfMap = envFlag("CLOX_PERF_MAP");
+#endif
+
+    // Options come before the path.
+    const char *emitPath = NULL;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-O") == 0) {
+            // Optimize each function beyond what the single pass compiler
+            // does, at some cost in compile time.
+            vm.optimize = true;
+        } else if (strcmp(argv[arg], "--registers") == 0) {
+            // Run on the register engine instead of the stack one.
+            vm.engine = ENGINE_REGISTER;
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            // Interpret everything. Builds without the JIT always do.
+#ifdef JIT
+            vm.jit = false;
+#endif
+        } else if (strcmp(argv[arg], "--perf-map") == 0) {
+            // Leave /tmp/perf-<pid>.map behind for perf to name the machine
+            // code with.
+#ifdef JIT
+            vm.perfMap = true;
+#endif
+        } else if (strcmp(argv[arg], "--print-code") == 0) {
+            vm.printCode = true;
+        } else if (strcmp(argv[arg], "--trace") == 0) {
+            vm.traceExecution = true;
+        } else if (strcmp(argv[arg], "--log-gc") == 0) {
+            vm.logGC = true;
+        } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc) {
+            // Compile the script to a C program instead of running it.
+            emitPath = argv[++arg];
+        } else {
+            usage();
+        }
+    }
+
+    // Only the stack engine traces, the register engine's loop has no
+    // tracing form.
+    if (vm.traceExecution && vm.engine == ENGINE_REGISTER) {
+        fprintf(stderr, "Tracing only works on the stack engine, not with --registers.\n");
+        exit(64);
+    }
+#ifdef JIT
+    // Only the interpreter traces.
+    if (vm.traceExecution) vm.jit = false;
+#endif
+
+    if (emitPath != NULL) {
+        if (arg != argc - 1) usage();
+        emitFile(argv[arg], emitPath);
+        freeVM();
+        return 0;
+    }
+
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        // 64?
-        exit(64);
+        usage();
     }
 
 
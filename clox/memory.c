@@ -1,14 +1,9 @@
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
-
-#ifdef DEBUG_LOG_GC
+#include "jit.h"
 
 #include <stdio.h>
-#include "debug.h"
-
-#endif
-
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,11 +34,11 @@ void markObject(Obj *object) {
   if (object == NULL) return;
   // Objects can be cyclic, this avoids marking a marked object forever
   if (object->isMarked) return;
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *) object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
-#endif
+  if (vm.logGC) {
+    printf("%p mark ", (void *) object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+  }
 
   object->isMarked = true;
 
@@ -72,11 +67,11 @@ static void markArray(ValueArray *array) {
 }
 
 static void blackenObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p blacken ", (void *) object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
-#endif
+  if (vm.logGC) {
+    printf("%p blacken ", (void *) object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+  }
 
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
@@ -89,6 +84,7 @@ static void blackenObject(Obj *object) {
       ObjClass *klass = (ObjClass *) object;
       markObject((Obj *) klass->name);
       markTable(&klass->methods);
+      markObject((Obj *) klass->rootShape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -103,12 +99,34 @@ static void blackenObject(Obj *object) {
       ObjFunction *function = (ObjFunction *) object;
       markObject((Obj *) function->name);
       markArray(&function->chunk.constants);
+      // A cached shape must stay alive, or a new shape allocated at the same
+      // address would hit its entries.
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+          CacheEntry *entry = &function->chunk.caches[i].entries[j];
+          markObject((Obj *) entry->shape);
+          markObject((Obj *) entry->transition);
+          markObject((Obj *) entry->method);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *) object;
       markObject((Obj *) instance->klass);
-      markTable(&instance->fields);
+      if (instance->shape != NULL) {
+        markObject((Obj *) instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->fields[i]);
+        }
+      }
+      if (instance->dictionary != NULL) markTable(instance->dictionary);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *) object;
+      markTable(&shape->slots);
+      markTable(&shape->transitions);
       break;
     }
     case OBJ_UPVALUE:
@@ -121,9 +139,7 @@ static void blackenObject(Obj *object) {
 
 static void freeObject(Obj *object) {
 
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void *) object, object->type);
-#endif
+  if (vm.logGC) printf("%p free type %d\n", (void *) object, object->type);
 
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
@@ -148,6 +164,9 @@ static void freeObject(Obj *object) {
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
       freeChunk(&function->chunk);
+#ifdef JIT
+      freeJitCode(function->jit);
+#endif
       FREE(ObjFunction, object);
       break;
     }
@@ -157,8 +176,22 @@ static void freeObject(Obj *object) {
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *) object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      }
+      if (instance->dictionary != NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      }
+      // Like strings, instances carry a flexible array member.
+      reallocate(object, sizeof(ObjInstance) + instance->inlineCapacity * sizeof(Value), 0);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *) object;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
+      FREE(ObjShape, object);
       break;
     }
     case OBJ_STRING: {
@@ -189,8 +222,16 @@ void freeObjects() {
 }
 
 static void markRoots() {
-  // Mark every stack value
-  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+  // Mark every stack value. The register engine leaves the stack top at the
+  // last stack form instruction, so its frames are live up to their maxStack.
+  Value *top = vm.stackTop;
+  if (vm.engine == ENGINE_REGISTER) {
+    for (int i = 0; i < vm.frameCount; i++) {
+      Value *end = vm.frames[i].slots + vm.frames[i].closure->function->maxStack;
+      if (end > top) top = end;
+    }
+  }
+  for (Value *slot = vm.stack; slot < top; slot++) {
     markValue(*slot);
   }
 
@@ -205,6 +246,8 @@ static void markRoots() {
   }
 
   markTable(&vm.globals);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
   markCompilerRoots();
   markObject((Obj *) vm.initString);
 }
@@ -248,10 +291,8 @@ static void sweep() {
 }
 
 void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
-#endif
+  if (vm.logGC) printf("-- gc begin\n");
 
   markRoots();
   traceReferences();
@@ -260,12 +301,12 @@ void collectGarbage() {
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
-#ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
-#endif
+  if (vm.logGC) {
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated,
+           vm.nextGC);
+  }
 
 }
 
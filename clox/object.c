@@ -18,9 +18,7 @@ static Obj *allocateObject(size_t size, ObjType type) {
   // Insert the object at the head of the 'objects' linked list.
   object->next = vm.objects;
   vm.objects = object;
-#ifdef DEBUG_LOG_GC
-  printf("%p allocate %zu for %d\n", (void *) object, size, type);
-#endif
+  if (vm.logGC) printf("%p allocate %zu for %d\n", (void *) object, size, type);
   return object;
 }
 
@@ -35,6 +33,8 @@ ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->rootShape = NULL;
+  klass->fieldsHint = 0;
   return klass;
 }
 
@@ -57,15 +57,32 @@ ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name = NULL;
+  function->inlineKind = INLINE_NONE;
+  function->inlineValue = NIL_VAL;
+#ifdef JIT
+  function->hotness = 0;
+  function->jit = NULL;
+#endif
+  function->aot = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  if (klass->rootShape == NULL) klass->rootShape = newShape();
+
+  // Reserve room for as many fields as earlier instances ended up with.
+  int inlineCapacity = klass->fieldsHint;
+  size_t size = sizeof(ObjInstance) + inlineCapacity * sizeof(Value);
+  ObjInstance *instance = (ObjInstance *) allocateObject(size, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = inlineCapacity;
+  instance->inlineCapacity = inlineCapacity;
+  instance->dictionary = NULL;
   return instance;
 }
 
@@ -75,6 +92,110 @@ ObjNative *newNative(NativeFn function) {
   return native;
 }
 
+ObjShape *newShape() {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  shape->fieldCount = 0;
+  return shape;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  Value slot;
+  if (!tableGet(&shape->slots, OBJ_VAL(name), &slot)) return -1;
+  return (int) AS_NUMBER(slot);
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, OBJ_VAL(name), &next)) {
+    return AS_SHAPE(next);
+  }
+  if (shape->fieldCount == SHAPE_MAX_FIELDS) return NULL;
+
+  ObjShape *child = newShape();
+  push(OBJ_VAL(child)); // Make it GC safe
+  tableAddAll(&shape->slots, &child->slots);
+  tableSet(&child->slots, OBJ_VAL(name), NUMBER_VAL(shape->fieldCount));
+  child->fieldCount = shape->fieldCount + 1;
+  tableSet(&shape->transitions, OBJ_VAL(name), OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+void addField(ObjInstance *instance, ObjShape *shape, Value value) {
+  if (shape->fieldCount > instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity > SHAPE_MAX_FIELDS) capacity = SHAPE_MAX_FIELDS;
+    Value *fields = ALLOCATE(Value, capacity);
+    memcpy(fields, instance->fields, oldCapacity * sizeof(Value));
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, oldCapacity);
+    }
+    instance->fields = fields;
+    instance->fieldCapacity = capacity;
+  }
+
+  instance->shape = shape;
+  instance->fields[shape->fieldCount - 1] = value;
+  if (shape->fieldCount > instance->klass->fieldsHint) {
+    instance->klass->fieldsHint = shape->fieldCount;
+  }
+}
+
+// Moves the fields of [instance] out of its slots into a hash table.
+static void makeDictionary(ObjInstance *instance) {
+  Table *dictionary = ALLOCATE(Table, 1);
+  initTable(dictionary);
+  // The GC marks the dictionary from here on while the slots are still live.
+  instance->dictionary = dictionary;
+
+  Table *slots = &instance->shape->slots;
+  for (int i = 0; i < slots->capacity; i++) {
+    Entry *entry = &slots->entries[i];
+    if (tableEntryState(entry) != PRESENT) continue;
+    tableSet(dictionary, entry->key, instance->fields[(int) AS_NUMBER(entry->value)]);
+  }
+
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  }
+  instance->shape = NULL;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = instance->inlineCapacity;
+}
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, OBJ_VAL(name), value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot < 0) return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+void setField(ObjInstance *instance, ObjString *name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+      instance->fields[slot] = value;
+      return;
+    }
+
+    ObjShape *next = shapeTransition(instance->shape, name);
+    if (next != NULL) {
+      addField(instance, next, value);
+      return;
+    }
+    makeDictionary(instance);
+  }
+
+  tableSet(instance->dictionary, OBJ_VAL(name), value);
+}
+
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   // size of 'flexible array member'
   size_t size = sizeof(ObjString) + (length + 1) * sizeof(char);
@@ -163,6 +284,9 @@ void printObject(Value value) {
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
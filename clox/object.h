@@ -14,6 +14,7 @@
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)  isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)     isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *) AS_OBJ(value))
@@ -23,6 +24,7 @@
 #define AS_INSTANCE(value)  ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value)     ((ObjShape *)  AS_OBJ(value))
 #define AS_STRING(value)    ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString *)AS_OBJ(value))->chars)
 
@@ -33,6 +35,7 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
@@ -47,13 +50,42 @@ struct Obj {
   struct Obj *next;
 };
 
+// The C function `clox --emit-c` compiled a Lox function to. Returns an
+// AotStatus, see aot.h.
+typedef int (*AotEntry)();
+
+// What a method's whole body does, when that is simple enough for an invoke
+// to do it in place without pushing a frame. See classifyInline() in
+// compiler.c.
+typedef enum {
+  INLINE_NONE,
+  // Returns the field of 'this' named by inlineValue.
+  INLINE_FIELD,
+  // Returns inlineValue.
+  INLINE_CONSTANT,
+} InlineKind;
+
 typedef struct {
   Obj obj;
   int arity;
   // How many variables does this use that are defined outside the function
   int upvalueCount;
+  // The most stack slots a call uses at once, counting from the frame's first
+  // slot. Computed by the compiler so call() can check for room up front.
+  int maxStack;
   Chunk chunk;
   ObjString *name;
+  InlineKind inlineKind;
+  // A constant of the chunk, so the GC already reaches it.
+  Value inlineValue;
+#ifdef JIT
+  // Calls and loop back-edges so far, until the function is compiled
+  int hotness;
+  // The function's machine code, NULL until it gets hot
+  struct JitCode *jit;
+#endif
+  // Only set in programs built from emitted C, where every function has one
+  AotEntry aot;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -89,18 +121,74 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
+// A hidden class. It records which slot each field of an instance lives in.
+// Instances that add the same fields in the same order share a shape, so the
+// shape alone tells where a field is without hashing its name.
+typedef struct ObjShape {
+  Obj obj;
+  // Field name -> slot index, for every field of the shape.
+  Table slots;
+  // Field name -> the shape an instance moves to when it adds that field.
+  Table transitions;
+  int fieldCount;
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString *name;
   Table methods;
+  // The shape of an instance without fields, created with the first instance.
+  // Every shape belongs to the chain of a single class, so a shape also
+  // identifies the class of its instances.
+  ObjShape *rootShape;
+  // The most fields an instance of this class has had. New instances reserve
+  // that many inline slots.
+  int fieldsHint;
 } ObjClass;
 
+// An instance that gets more fields than this leaves its shape behind and
+// keeps its fields in a hash table instead.
+#define SHAPE_MAX_FIELDS 32
+
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  // NULL once the instance is in dictionary mode.
+  ObjShape *shape;
+  // The field values, indexed by the slots of [shape]. Points at
+  // [inlineFields] until the instance outgrows them.
+  Value *fields;
+  int fieldCapacity;
+  int inlineCapacity;
+  // The fields in dictionary mode, otherwise NULL.
+  Table *dictionary;
+  Value inlineFields[];
 } ObjInstance;
 
+#define INLINE_CACHE_SIZE 4
+
+// What a property name resolved to on instances with [shape].
+typedef struct {
+  // NULL while the entry is unused
+  ObjShape *shape;
+  // The slot of the field, or -1 if the name resolved to [method].
+  int slot;
+  // Set when a store adds the field: the shape the instance moves to.
+  ObjShape *transition;
+  ObjClosure *method;
+  // The slot on [shape] of the field that [method] returns if it is an
+  // INLINE_FIELD getter, or -1.
+  int inlineSlot;
+} CacheEntry;
+
+// Remembers how a property access or invoke site resolved its name for the
+// last few receiver shapes. The first entry is the monomorphic fast path.
+// Sites that see more shapes than fit, or instances in dictionary mode, fall
+// back to plain table lookups.
+struct InlineCache {
+  CacheEntry entries[INLINE_CACHE_SIZE];
+};
+
 typedef struct {
   Obj obj;
   Value receiver; // ObjInstance that this method was called on
@@ -119,6 +207,23 @@ ObjInstance *newInstance(ObjClass *klass);
 
 ObjNative *newNative(NativeFn function);
 
+ObjShape *newShape();
+
+// The slot of the field [name] in [shape], or -1 if the shape lacks it.
+int shapeSlot(ObjShape *shape, ObjString *name);
+
+// The shape [shape] becomes once [name] is added, or NULL if that takes it
+// past SHAPE_MAX_FIELDS.
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+
+// Moves [instance] to [shape], which has one more field than its current
+// shape, storing [value] in the new slot.
+void addField(ObjInstance *instance, ObjShape *shape, Value value);
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value);
+
+void setField(ObjInstance *instance, ObjString *name, Value value);
+
 ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
@@ -0,0 +1,388 @@
+#include "optimizer.h"
+
+#include "memory.h"
+#include "peephole.h"
+
+// What a slot is known to hold at some point in a block.
+typedef enum {
+  KNOWN_NOTHING,
+  // The same value as the local in [slot]
+  KNOWN_LOCAL,
+  // The property [name] of what the local in [slot] holds
+  KNOWN_PROPERTY
+} KnownKind;
+
+typedef struct {
+  KnownKind kind;
+  int slot;
+  ObjString *name;
+} Known;
+
+typedef struct {
+  Chunk *chunk;
+  // The size of the frame, function->maxStack
+  int slotCount;
+  // The stack depth on entry to each instruction, see stackDepths()
+  int *depthAt;
+  // The index of the block starting at each offset, -1 where none does,
+  // see findBlocks()
+  int *blockAt;
+  int blockCount;
+  // Locals that closures capture, so nothing is known about them
+  bool *captured;
+  // The instructions to take out once done
+  bool *removed;
+  // The slots while walking a block
+  Known *known;
+} Optimizer;
+
+static const Known nothing = {KNOWN_NOTHING, -1, NULL};
+
+static void remember(Optimizer *o, int slot, Known value) {
+  o->known[slot] = o->captured[slot] ? nothing : value;
+}
+
+// Slots from [slot] up were popped or overwritten. Forget them and what
+// depended on them.
+static void forgetFrom(Optimizer *o, int slot) {
+  for (int i = 0; i < o->slotCount; i++) {
+    if (i >= slot || (o->known[i].kind != KNOWN_NOTHING && o->known[i].slot >= slot)) {
+      o->known[i] = nothing;
+    }
+  }
+}
+
+// The local [slot] was assigned.
+static void forgetLocal(Optimizer *o, int slot) {
+  for (int i = 0; i < o->slotCount; i++) {
+    if (i == slot || (o->known[i].kind != KNOWN_NOTHING && o->known[i].slot == slot)) {
+      o->known[i] = nothing;
+    }
+  }
+}
+
+// Code that may set fields ran.
+static void forgetProperties(Optimizer *o) {
+  for (int i = 0; i < o->slotCount; i++) {
+    if (o->known[i].kind == KNOWN_PROPERTY) o->known[i] = nothing;
+  }
+}
+
+// Whether the instruction at [offset] uses the value on top of the stack in
+// a way that can't tell two loads of the same property apart. A property
+// that names a method loads a new bound method each time, and '==' or
+// storing it somewhere would notice those are different objects.
+static bool consumesLoad(Optimizer *o, int offset) {
+  if (offset >= o->chunk->count || o->blockAt[offset] != -1) return false;
+  switch (o->chunk->code[offset]) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_GET_PROPERTY:
+    case OP_ADD_IMM:
+    case OP_SUBTRACT_IMM:
+    case OP_GREATER_IMM:
+    case OP_LESS_IMM:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_IMM:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+    case OP_JUMP_IF_NOT_GREATER_IMM:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// A slot below [depth] known to hold [value], or -1.
+static int findKnown(Optimizer *o, Known value, int depth) {
+  for (int i = 0; i < depth; i++) {
+    Known *known = &o->known[i];
+    if (known->kind == value.kind && known->slot == value.slot && known->name == value.name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Walk each block forwards, tracking which slots hold copies of locals and
+// which hold properties loaded from them. Loads of a local that holds a copy
+// of another read the original instead, and loading a property still sitting
+// in a slot reads that slot instead.
+static void propagate(Optimizer *o) {
+  Chunk *chunk = o->chunk;
+  // The instruction before the current one in its block, -1 at the start
+  int previous = -1;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    int depth = o->depthAt[offset];
+    if (depth == -1) continue;
+    if (o->blockAt[offset] != -1) {
+      forgetFrom(o, 0);
+      previous = -1;
+    }
+
+    uint8_t *code = &chunk->code[offset];
+    int after = depth + stackEffect(chunk, offset);
+    switch (code[0]) {
+      case OP_GET_LOCAL: {
+        Known value = o->known[code[1]];
+        if (value.kind == KNOWN_LOCAL) {
+          code[1] = (uint8_t) value.slot;
+        } else if (value.kind == KNOWN_NOTHING && !o->captured[code[1]]) {
+          value = (Known) {KNOWN_LOCAL, code[1], NULL};
+        }
+        forgetFrom(o, depth);
+        remember(o, depth, value);
+        break;
+      }
+      case OP_SET_LOCAL: {
+        Known value = o->known[depth - 1];
+        forgetLocal(o, code[1]);
+        if (value.slot != code[1]) remember(o, code[1], value);
+        break;
+      }
+      case OP_GET_PROPERTY: {
+        Known object = o->known[depth - 1];
+        Known value = nothing;
+        if (object.kind == KNOWN_LOCAL) {
+          value = (Known) {KNOWN_PROPERTY, object.slot,
+                           AS_STRING(chunk->constants.values[code[1]])};
+          int loaded = findKnown(o, value, depth - 1);
+          if (loaded != -1 && previous == offset - 2 &&
+              chunk->code[previous] == OP_GET_LOCAL && consumesLoad(o, offset + 2)) {
+            chunk->code[previous + 1] = (uint8_t) loaded;
+            o->removed[offset] = true;
+          }
+        }
+        forgetFrom(o, depth - 1);
+        remember(o, depth - 1, value);
+        break;
+      }
+      case OP_SET_PROPERTY:
+      case OP_CALL:
+      case OP_TAIL_CALL:
+      case OP_INTRINSIC:
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_SUPER_INVOKE:
+        forgetProperties(o);
+        forgetFrom(o, after - 1);
+        break;
+      case OP_SET_GLOBAL:
+      case OP_SET_UPVALUE:
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_LOOP:
+        // Leave the stack alone.
+        break;
+      case OP_POP:
+      case OP_POPN:
+      case OP_DEFINE_GLOBAL:
+      case OP_PRINT:
+      case OP_CLOSE_UPVALUE:
+      case OP_METHOD:
+      case OP_INHERIT:
+      case OP_JUMP_IF_NOT_EQUAL:
+      case OP_JUMP_IF_EQUAL:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_LESS_EQUAL:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      case OP_JUMP_IF_NOT_LESS_IMM:
+      case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+      case OP_JUMP_IF_NOT_GREATER_IMM:
+      case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM:
+        // Only pop.
+        forgetFrom(o, after);
+        break;
+      default:
+        // The rest replace what they pop with their result.
+        forgetFrom(o, after > 0 ? after - 1 : 0);
+        break;
+    }
+    previous = offset;
+  }
+}
+
+// Update [live] from after the instruction at [offset] to before it. With
+// [rewrite], also remove it if it stores to a local that is dead after it.
+static void transferLiveness(Optimizer *o, int offset, bool *live, bool rewrite) {
+  uint8_t *code = &o->chunk->code[offset];
+  if (code[0] == OP_GET_LOCAL) {
+    live[code[1]] = true;
+  } else if (code[0] == OP_SET_LOCAL) {
+    // The value stays on the stack, so the store can simply go.
+    if (rewrite && !live[code[1]] && !o->captured[code[1]]) o->removed[offset] = true;
+    live[code[1]] = false;
+  }
+}
+
+// Walk [block] backwards from the locals live out of it. Returns whether
+// the ones live into it changed.
+static bool walkBlock(Optimizer *o, int block, const int *starts, bool *liveIn,
+                      bool *live, bool rewrite) {
+  Chunk *chunk = o->chunk;
+  int end = -1;
+  for (int offset = starts[block]; offset < starts[block + 1];
+       offset += instructionLength(chunk, offset)) {
+    if (o->depthAt[offset] != -1) end = offset;
+  }
+  if (end == -1) return false;
+
+  // Live out is what the blocks it continues in need.
+  for (int slot = 0; slot < o->slotCount; slot++) live[slot] = false;
+  uint8_t instruction = chunk->code[end];
+  if (isJump(instruction)) {
+    bool *in = &liveIn[o->blockAt[jumpTarget(chunk, end)] * o->slotCount];
+    for (int slot = 0; slot < o->slotCount; slot++) live[slot] |= in[slot];
+  }
+  if (instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_LOOP &&
+      block + 1 < o->blockCount) {
+    bool *in = &liveIn[(block + 1) * o->slotCount];
+    for (int slot = 0; slot < o->slotCount; slot++) live[slot] |= in[slot];
+  }
+
+  // Offsets only go forwards, so find each previous instruction by walking
+  // up to it again. Blocks are short.
+  for (int offset = end; offset != -1;) {
+    transferLiveness(o, offset, live, rewrite);
+    int previous = -1;
+    for (int at = starts[block]; at < offset; at += instructionLength(chunk, at)) {
+      if (o->depthAt[at] != -1) previous = at;
+    }
+    offset = previous;
+  }
+
+  bool changed = false;
+  bool *in = &liveIn[block * o->slotCount];
+  for (int slot = 0; slot < o->slotCount; slot++) {
+    if (in[slot] != live[slot]) {
+      in[slot] = live[slot];
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Find which locals are read again after each point, then remove the stores
+// to the ones that aren't. Nothing else reads a local: a scope ending only
+// pops it, and closures that capture it are left alone.
+static void removeDeadStores(Optimizer *o) {
+  Chunk *chunk = o->chunk;
+  int *starts = ALLOCATE(int, o->blockCount + 1);
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (o->blockAt[offset] != -1) starts[o->blockAt[offset]] = offset;
+  }
+  starts[o->blockCount] = chunk->count;
+
+  // [slotCount] flags per block: the locals read before being stored to
+  // again from the start of it.
+  bool *liveIn = ALLOCATE(bool, o->blockCount * o->slotCount);
+  for (int i = 0; i < o->blockCount * o->slotCount; i++) liveIn[i] = false;
+  bool *live = ALLOCATE(bool, o->slotCount);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int block = o->blockCount - 1; block >= 0; block--) {
+      if (walkBlock(o, block, starts, liveIn, live, false)) changed = true;
+    }
+  }
+  for (int block = 0; block < o->blockCount; block++) {
+    walkBlock(o, block, starts, liveIn, live, true);
+  }
+
+  FREE_ARRAY(bool, live, o->slotCount);
+  FREE_ARRAY(bool, liveIn, o->blockCount * o->slotCount);
+  FREE_ARRAY(int, starts, o->blockCount + 1);
+}
+
+static bool isPurePush(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_SMALL_INT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Remove values that are pushed and then popped straight away, which is
+// what removing a dead store leaves behind.
+static void removeUnusedPushes(Optimizer *o) {
+  Chunk *chunk = o->chunk;
+  // The instructions kept so far in the current block
+  Array kept;
+  initArray(&kept, sizeof(int));
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (o->depthAt[offset] == -1) continue;
+    // A block starts here even if its first instruction was a dead store.
+    if (o->blockAt[offset] != -1) kept.count = 0;
+    if (o->removed[offset]) continue;
+
+    uint8_t *code = &chunk->code[offset];
+    if (code[0] == OP_POP || code[0] == OP_POPN) {
+      int pops = code[0] == OP_POP ? 1 : code[1];
+      while (pops > 0 && kept.count > 0) {
+        int pushed = READ_AS(int, &kept, kept.count - 1);
+        if (!isPurePush(chunk->code[pushed])) break;
+        o->removed[pushed] = true;
+        kept.count--;
+        pops--;
+      }
+      if (pops == 0) {
+        o->removed[offset] = true;
+        continue;
+      }
+      // removeInstructions() turns an OP_POPN of one back into OP_POP.
+      if (code[0] == OP_POPN) code[1] = (uint8_t) pops;
+    }
+    writeArray(&kept, &offset);
+  }
+  freeArray(&kept);
+}
+
+void optimizeFunction(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int count = chunk->count;
+  if (count == 0) return;
+
+  Optimizer o;
+  o.chunk = chunk;
+  o.slotCount = function->maxStack;
+  o.depthAt = ALLOCATE(int, count);
+  // Slot zero plus the parameters are in place before the first instruction.
+  stackDepths(chunk, function->arity + 1, o.depthAt);
+  o.removed = ALLOCATE(bool, count);
+  for (int offset = 0; offset < count; offset++) o.removed[offset] = false;
+  o.captured = ALLOCATE(bool, o.slotCount);
+  o.blockAt = ALLOCATE(int, count);
+  o.blockCount = findBlocks(chunk, o.depthAt, o.blockAt, o.captured, o.slotCount);
+
+  o.known = ALLOCATE(Known, o.slotCount);
+  propagate(&o);
+  removeDeadStores(&o);
+  removeUnusedPushes(&o);
+  removeInstructions(chunk, o.removed);
+
+  FREE_ARRAY(Known, o.known, o.slotCount);
+  FREE_ARRAY(int, o.blockAt, count);
+  FREE_ARRAY(bool, o.removed, count);
+  FREE_ARRAY(bool, o.captured, o.slotCount);
+  FREE_ARRAY(int, o.depthAt, count);
+}
@@ -0,0 +1,13 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+// The -O pipeline. Split [function]'s bytecode into basic blocks and track
+// what each stack slot holds through them to propagate copies of locals,
+// reuse property loads whose value is still on the stack, and remove stores
+// to locals that are never read again along with values that are pushed only
+// to be popped. Needs function->maxStack.
+void optimizeFunction(ObjFunction *function);
+
+#endif
@@ -0,0 +1,176 @@
+#include "peephole.h"
+
+#include <string.h>
+
+#include "memory.h"
+
+// A jump that stays, and the offset it jumped to before the code moved
+typedef struct {
+  int offset;
+  int target;
+} Jump;
+
+// The operand the jump at [offset] needs to get to [target], or -1 if it
+// can't encode it.
+static int jumpDistance(Chunk *chunk, int offset, int target) {
+  int end = offset + instructionLength(chunk, offset);
+  int distance = opInfo[chunk->code[offset]].format == OPERAND_LOOP
+                 ? end - target
+                 : target - end;
+  return distance < 0 || distance > UINT16_MAX ? -1 : distance;
+}
+
+static void setJumpTarget(Chunk *chunk, int offset, int target) {
+  int end = offset + instructionLength(chunk, offset);
+  int distance = jumpDistance(chunk, offset, target);
+  chunk->code[end - 2] = (distance >> 8) & 0xFF;
+  chunk->code[end - 1] = distance & 0xFF;
+}
+
+// Where the jump at [offset] ends up once it follows the unconditional jumps
+// it lands on. OP_JUMP_IF_FALSE also follows another OP_JUMP_IF_FALSE, which
+// tests the same value and so jumps too. That is how 'and' chains and
+// conditions ending in an 'and' compile.
+static int finalTarget(Chunk *chunk, int offset) {
+  uint8_t instruction = chunk->code[offset];
+  int target = jumpTarget(chunk, offset);
+  // A cycle of jumps is an infinite loop, don't follow it forever.
+  for (int i = 0; i < 16; i++) {
+    uint8_t next = chunk->code[target];
+    if (next != OP_JUMP && next != OP_LOOP &&
+        !(instruction == OP_JUMP_IF_FALSE && next == OP_JUMP_IF_FALSE)) {
+      break;
+    }
+    int onward = jumpTarget(chunk, target);
+    // A jump only goes one way.
+    if (jumpDistance(chunk, offset, onward) == -1) break;
+    target = onward;
+  }
+  return target;
+}
+
+// Which instructions the jumps that stay land on
+static bool *findTargets(Chunk *chunk, const bool *removed) {
+  bool *isTarget = ALLOCATE(bool, chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) isTarget[offset] = false;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (!removed[offset] && isJump(chunk->code[offset])) {
+      isTarget[jumpTarget(chunk, offset)] = true;
+    }
+  }
+  return isTarget;
+}
+
+void removeInstructions(Chunk *chunk, const bool *removed) {
+  int count = chunk->count;
+  bool *isTarget = findTargets(chunk, removed);
+
+  // Slide the remaining code down over the gaps. Nothing grows, so it never
+  // overwrites code it has yet to read.
+  int *newOffset = ALLOCATE(int, count + 1);
+  Array jumps;
+  initArray(&jumps, sizeof(Jump));
+  int write = 0;
+  int offset = 0;
+  while (offset < count) {
+    int length = instructionLength(chunk, offset);
+    newOffset[offset] = write;
+    if (removed[offset]) {
+      offset += length;
+      continue;
+    }
+
+    if (chunk->code[offset] == OP_POP || chunk->code[offset] == OP_POPN) {
+      // Take in the pops that follow unless a jump lands between them, even
+      // on one that goes.
+      int line = chunk->lines[offset];
+      int pops = chunk->code[offset] == OP_POP ? 1 : chunk->code[offset + 1];
+      int next = offset + length;
+      while (next < count) {
+        uint8_t instruction = chunk->code[next];
+        if (isTarget[next]) {
+          break;
+        } else if (removed[next]) {
+          next += instructionLength(chunk, next);
+        } else if (instruction == OP_POP && pops < UINT8_MAX) {
+          pops++;
+          next++;
+        } else if (instruction == OP_POPN &&
+                   pops + chunk->code[next + 1] <= UINT8_MAX) {
+          pops += chunk->code[next + 1];
+          next += 2;
+        } else {
+          break;
+        }
+      }
+
+      if (pops == 1) {
+        chunk->code[write] = OP_POP;
+        chunk->lines[write++] = line;
+      } else if (pops > 1) {
+        chunk->code[write] = OP_POPN;
+        chunk->code[write + 1] = (uint8_t) pops;
+        chunk->lines[write++] = line;
+        chunk->lines[write++] = line;
+      }
+      offset = next;
+      continue;
+    }
+
+    if (isJump(chunk->code[offset])) {
+      Jump jump = {write, jumpTarget(chunk, offset)};
+      writeArray(&jumps, &jump);
+    }
+    memmove(&chunk->code[write], &chunk->code[offset], length);
+    memmove(&chunk->lines[write], &chunk->lines[offset], length * sizeof(int));
+    write += length;
+    offset += length;
+  }
+  newOffset[count] = write;
+  chunk->count = write;
+
+  for (int i = 0; i < jumps.count; i++) {
+    Jump *jump = &READ_AS(Jump, &jumps, i);
+    setJumpTarget(chunk, jump->offset, newOffset[jump->target]);
+  }
+
+  freeArray(&jumps);
+  FREE_ARRAY(int, newOffset, count + 1);
+  FREE_ARRAY(bool, isTarget, count);
+}
+
+void optimizeChunk(Chunk *chunk) {
+  int count = chunk->count;
+  if (count == 0) return;
+
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (isJump(chunk->code[offset])) {
+      setJumpTarget(chunk, offset, finalTarget(chunk, offset));
+    }
+  }
+
+  // Code after a return or an unconditional jump that no jump lands on,
+  // including the jumps threaded past above, goes.
+  int *depthAt = ALLOCATE(int, count);
+  stackDepths(chunk, 0, depthAt);
+  bool *removed = ALLOCATE(bool, count);
+  for (int offset = 0; offset < count; offset++) removed[offset] = depthAt[offset] == -1;
+  FREE_ARRAY(int, depthAt, count);
+
+  // So does an OP_JUMP over nothing but that code, it goes to where
+  // execution would continue anyway.
+  bool *isTarget = findTargets(chunk, removed);
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (removed[offset] || chunk->code[offset] != OP_JUMP || isTarget[offset]) continue;
+    int target = jumpTarget(chunk, offset);
+    int skipped = offset + instructionLength(chunk, offset);
+    while (skipped < target && removed[skipped]) {
+      skipped += instructionLength(chunk, skipped);
+    }
+    if (skipped == target) removed[offset] = true;
+  }
+  FREE_ARRAY(bool, isTarget, count);
+
+  removeInstructions(chunk, removed);
+  FREE_ARRAY(bool, removed, count);
+}
@@ -0,0 +1,17 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// Clean up the bytecode the single pass compiler leaves behind in [chunk]:
+// point jumps that land on another jump at its destination, drop code no
+// path reaches and jumps to the next instruction, and turn runs of OP_POP
+// into OP_POPN. Jump offsets and line numbers are rewritten to match.
+void optimizeChunk(Chunk *chunk);
+
+// Take the instructions marked in [removed], indexed by offset, out of
+// [chunk] and merge the pops that end up next to each other. A jump to a
+// removed instruction goes to the next one that stays.
+void removeInstructions(Chunk *chunk, const bool *removed);
+
+#endif
@@ -0,0 +1,575 @@
+#include "registers.h"
+
+#include <stdio.h>
+
+#include "memory.h"
+#include "vm.h"
+
+const RegOpInfo regOpInfo[] = {
+  // dst, src
+  [REG_MOVE] = {"REG_MOVE", "rr"},
+  // dst, constant
+  [REG_LOAD] = {"REG_LOAD", "rk"},
+  // dst, global slot
+  [REG_GET_GLOBAL] = {"REG_GET_GLOBAL", "rr"},
+  // global slot, src
+  [REG_DEFINE_GLOBAL] = {"REG_DEFINE_GLOBAL", "rr"},
+  [REG_SET_GLOBAL] = {"REG_SET_GLOBAL", "rr"},
+  // dst, upvalue
+  [REG_GET_UPVALUE] = {"REG_GET_UPVALUE", "rr"},
+  // upvalue, src
+  [REG_SET_UPVALUE] = {"REG_SET_UPVALUE", "rr"},
+  // dst, instance, stack top for the slow path, name, cache
+  [REG_GET_PROPERTY] = {"REG_GET_PROPERTY", "rrrkc"},
+  // dst, a, b
+  [REG_EQUAL] = {"REG_EQUAL", "rrr"},
+  [REG_GREATER] = {"REG_GREATER", "rrr"},
+  [REG_LESS] = {"REG_LESS", "rrr"},
+  // dst, a, b, stack top for concatenating strings
+  [REG_ADD] = {"REG_ADD", "rrrr"},
+  [REG_SUBTRACT] = {"REG_SUBTRACT", "rrr"},
+  [REG_MULTIPLY] = {"REG_MULTIPLY", "rrr"},
+  [REG_DIVIDE] = {"REG_DIVIDE", "rrr"},
+  // dst, src
+  [REG_NOT] = {"REG_NOT", "rr"},
+  [REG_NEGATE] = {"REG_NEGATE", "rr"},
+  // dst, a, the immediate b as a number
+  [REG_ADD_IMM] = {"REG_ADD_IMM", "rrk"},
+  [REG_SUBTRACT_IMM] = {"REG_SUBTRACT_IMM", "rrk"},
+  [REG_GREATER_IMM] = {"REG_GREATER_IMM", "rrk"},
+  [REG_LESS_IMM] = {"REG_LESS_IMM", "rrk"},
+  [REG_PRINT] = {"REG_PRINT", "r"},
+  [REG_JUMP] = {"REG_JUMP", "t"},
+  // condition, target
+  [REG_JUMP_IF_FALSE] = {"REG_JUMP_IF_FALSE", "rt"},
+  // a, b, target
+  [REG_JUMP_IF_NOT_EQUAL] = {"REG_JUMP_IF_NOT_EQUAL", "rrt"},
+  [REG_JUMP_IF_EQUAL] = {"REG_JUMP_IF_EQUAL", "rrt"},
+  [REG_JUMP_IF_NOT_LESS] = {"REG_JUMP_IF_NOT_LESS", "rrt"},
+  [REG_JUMP_IF_NOT_LESS_EQUAL] = {"REG_JUMP_IF_NOT_LESS_EQUAL", "rrt"},
+  [REG_JUMP_IF_NOT_GREATER] = {"REG_JUMP_IF_NOT_GREATER", "rrt"},
+  [REG_JUMP_IF_NOT_GREATER_EQUAL] = {"REG_JUMP_IF_NOT_GREATER_EQUAL", "rrt"},
+  // a, the immediate b as a number, target
+  [REG_JUMP_IF_NOT_LESS_IMM] = {"REG_JUMP_IF_NOT_LESS_IMM", "rkt"},
+  [REG_JUMP_IF_NOT_LESS_EQUAL_IMM] = {"REG_JUMP_IF_NOT_LESS_EQUAL_IMM", "rkt"},
+  [REG_JUMP_IF_NOT_GREATER_IMM] = {"REG_JUMP_IF_NOT_GREATER_IMM", "rkt"},
+  [REG_JUMP_IF_NOT_GREATER_EQUAL_IMM] = {"REG_JUMP_IF_NOT_GREATER_EQUAL_IMM", "rkt"},
+  [REG_RETURN] = {"REG_RETURN", "r"},
+  [REG_SET_PROPERTY] = {"REG_SET_PROPERTY", "rs"},
+  [REG_GET_SUPER] = {"REG_GET_SUPER", "rs"},
+  [REG_CALL] = {"REG_CALL", "rs"},
+  [REG_TAIL_CALL] = {"REG_TAIL_CALL", "rs"},
+  [REG_INTRINSIC] = {"REG_INTRINSIC", "rs"},
+  [REG_INVOKE] = {"REG_INVOKE", "rs"},
+  [REG_TAIL_INVOKE] = {"REG_TAIL_INVOKE", "rs"},
+  [REG_SUPER_INVOKE] = {"REG_SUPER_INVOKE", "rs"},
+  [REG_CLOSURE] = {"REG_CLOSURE", "rs"},
+  [REG_CLOSE_UPVALUE] = {"REG_CLOSE_UPVALUE", "rs"},
+  [REG_CLASS] = {"REG_CLASS", "rs"},
+  [REG_INHERIT] = {"REG_INHERIT", "rs"},
+  [REG_METHOD] = {"REG_METHOD", "rs"},
+};
+
+// An instruction before it is laid out in Code slots.
+typedef struct {
+  uint8_t opcode;
+  // The 'r' operands in order
+  int registers[4];
+  // The 'k' operand
+  Value constant;
+  // The bytecode offset a jump goes to
+  int target;
+  // The bytecode instruction it was translated from, for line numbers
+  int offset;
+} RegInstruction;
+
+typedef struct {
+  Chunk *chunk;
+  // The stack depth on entry to each bytecode instruction, see stackDepths()
+  int *depthAt;
+  bool *isJumpTarget;
+  int registerCount;
+  // A GET_LOCAL emits nothing. Instead the register it pushes to is noted
+  // here as a copy of the local's, and reads of it go to the local. The
+  // MOVE is only emitted once the register has to hold the value itself:
+  // before the local changes, where paths join and before instructions that
+  // work on the stack. -1 for registers that hold their own value.
+  int *copyOf;
+  RegInstruction *code;
+  int count;
+  int capacity;
+  // The register the last instruction emitted writes, or -1 if it isn't one
+  // that only writes a register. A store into a local can retarget it.
+  int lastWrite;
+} Translator;
+
+static RegInstruction *emit(Translator *t, uint8_t opcode, int offset) {
+  if (t->capacity < t->count + 1) {
+    int oldCapacity = t->capacity;
+    t->capacity = GROW_CAPACITY(oldCapacity);
+    t->code = GROW_ARRAY(RegInstruction, t->code, oldCapacity, t->capacity);
+  }
+
+  RegInstruction *instruction = &t->code[t->count++];
+  instruction->opcode = opcode;
+  instruction->constant = NIL_VAL;
+  instruction->target = -1;
+  instruction->offset = offset;
+  t->lastWrite = -1;
+  return instruction;
+}
+
+static RegInstruction *emitWrite(Translator *t, uint8_t opcode, int offset, int dst) {
+  RegInstruction *instruction = emit(t, opcode, offset);
+  instruction->registers[0] = dst;
+  t->lastWrite = dst;
+  return instruction;
+}
+
+// The register holding the value [reg] stands for.
+static int resolve(Translator *t, int reg) {
+  return t->copyOf[reg] >= 0 ? t->copyOf[reg] : reg;
+}
+
+static void materialize(Translator *t, int reg, int offset) {
+  if (t->copyOf[reg] < 0) return;
+
+  RegInstruction *move = emit(t, REG_MOVE, offset);
+  move->registers[0] = reg;
+  move->registers[1] = t->copyOf[reg];
+  t->copyOf[reg] = -1;
+}
+
+static void materializeAll(Translator *t, int offset) {
+  for (int reg = 0; reg < t->registerCount; reg++) materialize(t, reg, offset);
+}
+
+static bool hasCopies(Translator *t, int reg) {
+  // Copies are always pushed after the local they copy.
+  for (int copy = reg + 1; copy < t->registerCount; copy++) {
+    if (t->copyOf[copy] == reg) return true;
+  }
+  return false;
+}
+
+// Called before an instruction overwrites [reg], so its copies get the old
+// value first.
+static void prepareWrite(Translator *t, int reg, int offset) {
+  for (int copy = reg + 1; copy < t->registerCount; copy++) {
+    if (t->copyOf[copy] == reg) materialize(t, copy, offset);
+  }
+  t->copyOf[reg] = -1;
+}
+
+// The registers from [reg] up were popped.
+static void discard(Translator *t, int reg) {
+  for (; reg < t->registerCount; reg++) t->copyOf[reg] = -1;
+}
+
+// The value an instruction that pushes a literal pushes.
+static Value literal(Chunk *chunk, int offset) {
+  uint8_t *bytes = &chunk->code[offset];
+  switch (bytes[0]) {
+    case OP_CONSTANT:
+      return chunk->constants.values[bytes[1]];
+    case OP_CONSTANT_LONG:
+      return chunk->constants.values[(bytes[1] << 16) + (bytes[2] << 8) + bytes[3]];
+    case OP_SMALL_INT:
+      return INT_VAL((int16_t) ((bytes[1] << 8) | bytes[2]));
+    case OP_TRUE:
+      return BOOL_VAL(true);
+    case OP_FALSE:
+      return BOOL_VAL(false);
+    default:
+      return NIL_VAL;
+  }
+}
+
+static Value immediate(Chunk *chunk, int offset) {
+  uint8_t *bytes = &chunk->code[offset];
+  return INT_VAL((int16_t) ((bytes[1] << 8) | bytes[2]));
+}
+
+static int globalOperand(Chunk *chunk, int offset) {
+  uint8_t *bytes = &chunk->code[offset];
+  return (bytes[1] << 8) | bytes[2];
+}
+
+// OP_SET_LOCAL. When the value was just computed and is popped straight
+// after, the instruction computing it writes the local instead.
+static void setLocal(Translator *t, int offset, int local, int value) {
+  Chunk *chunk = t->chunk;
+  int next = offset + instructionLength(chunk, offset);
+  bool popped = next < chunk->count && (chunk->code[next] == OP_POP || chunk->code[next] == OP_POPN) &&
+                !t->isJumpTarget[next];
+  if (popped && !t->isJumpTarget[offset] && t->lastWrite == value && value != local &&
+      !hasCopies(t, local)) {
+    t->code[t->count - 1].registers[0] = local;
+    t->copyOf[local] = -1;
+    t->lastWrite = local;
+    return;
+  }
+
+  int source = resolve(t, value);
+  if (source == local) return;
+  prepareWrite(t, local, offset);
+  emitWrite(t, REG_MOVE, offset, local)->registers[1] = source;
+}
+
+static void binary(Translator *t, int offset, uint8_t opcode, int depth) {
+  int a = resolve(t, depth - 2);
+  int b = resolve(t, depth - 1);
+  discard(t, depth - 1);
+  prepareWrite(t, depth - 2, offset);
+  RegInstruction *instruction = emitWrite(t, opcode, offset, depth - 2);
+  instruction->registers[1] = a;
+  instruction->registers[2] = b;
+  // Only used by REG_ADD.
+  instruction->registers[3] = depth;
+}
+
+static RegInstruction *unary(Translator *t, int offset, uint8_t opcode, int depth) {
+  int source = resolve(t, depth - 1);
+  prepareWrite(t, depth - 1, offset);
+  RegInstruction *instruction = emitWrite(t, opcode, offset, depth - 1);
+  instruction->registers[1] = source;
+  return instruction;
+}
+
+static void immediateOp(Translator *t, int offset, uint8_t opcode, int depth) {
+  unary(t, offset, opcode, depth)->constant = immediate(t->chunk, offset);
+}
+
+static void compareJump(Translator *t, int offset, uint8_t opcode, int depth) {
+  int a = resolve(t, depth - 2);
+  int b = resolve(t, depth - 1);
+  discard(t, depth - 2);
+  // The other path has to see the same registers.
+  materializeAll(t, offset);
+  RegInstruction *instruction = emit(t, opcode, offset);
+  instruction->registers[0] = a;
+  instruction->registers[1] = b;
+  instruction->target = jumpTarget(t->chunk, offset);
+}
+
+static void compareImmediateJump(Translator *t, int offset, uint8_t opcode, int depth) {
+  int a = resolve(t, depth - 1);
+  discard(t, depth - 1);
+  materializeAll(t, offset);
+  RegInstruction *instruction = emit(t, opcode, offset);
+  instruction->registers[0] = a;
+  instruction->constant = immediate(t->chunk, offset);
+  instruction->target = jumpTarget(t->chunk, offset);
+}
+
+// An instruction the register engine runs on the stack. Everything it may
+// read has to be in place.
+static void stackForm(Translator *t, int offset, uint8_t opcode, int depth) {
+  materializeAll(t, offset);
+  emit(t, opcode, offset)->registers[0] = depth;
+}
+
+static void translateInstruction(Translator *t, int offset) {
+  Chunk *chunk = t->chunk;
+  uint8_t *bytes = &chunk->code[offset];
+  int depth = t->depthAt[offset];
+  // The register of the value on top of the stack
+  int top = depth - 1;
+
+  switch (untypedOpcode(bytes[0])) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_SMALL_INT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      prepareWrite(t, depth, offset);
+      emitWrite(t, REG_LOAD, offset, depth)->constant = literal(chunk, offset);
+      break;
+    case OP_POP:
+      discard(t, top);
+      t->lastWrite = -1;
+      break;
+    case OP_POPN:
+      discard(t, depth - bytes[1]);
+      t->lastWrite = -1;
+      break;
+    case OP_GET_LOCAL:
+      t->copyOf[depth] = resolve(t, bytes[1]);
+      t->lastWrite = -1;
+      break;
+    case OP_SET_LOCAL:
+      setLocal(t, offset, bytes[1], top);
+      break;
+    case OP_GET_GLOBAL:
+      prepareWrite(t, depth, offset);
+      emitWrite(t, REG_GET_GLOBAL, offset, depth)->registers[1] = globalOperand(chunk, offset);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL: {
+      RegInstruction *instruction = emit(t, bytes[0] == OP_DEFINE_GLOBAL ? REG_DEFINE_GLOBAL : REG_SET_GLOBAL, offset);
+      instruction->registers[0] = globalOperand(chunk, offset);
+      instruction->registers[1] = resolve(t, top);
+      if (bytes[0] == OP_DEFINE_GLOBAL) discard(t, top);
+      break;
+    }
+    case OP_GET_UPVALUE:
+      prepareWrite(t, depth, offset);
+      emitWrite(t, REG_GET_UPVALUE, offset, depth)->registers[1] = bytes[1];
+      break;
+    case OP_SET_UPVALUE: {
+      // Upvalues point into the frames of enclosing functions, which have
+      // no pending copies while this one runs.
+      RegInstruction *instruction = emit(t, REG_SET_UPVALUE, offset);
+      instruction->registers[0] = bytes[1];
+      instruction->registers[1] = resolve(t, top);
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      int instance = resolve(t, top);
+      prepareWrite(t, top, offset);
+      RegInstruction *instruction = emitWrite(t, REG_GET_PROPERTY, offset, top);
+      instruction->registers[1] = instance;
+      instruction->registers[2] = depth;
+      instruction->constant = chunk->constants.values[bytes[1]];
+      break;
+    }
+    case OP_EQUAL: binary(t, offset, REG_EQUAL, depth); break;
+    case OP_GREATER: binary(t, offset, REG_GREATER, depth); break;
+    case OP_LESS: binary(t, offset, REG_LESS, depth); break;
+    case OP_ADD: binary(t, offset, REG_ADD, depth); break;
+    case OP_SUBTRACT: binary(t, offset, REG_SUBTRACT, depth); break;
+    case OP_MULTIPLY: binary(t, offset, REG_MULTIPLY, depth); break;
+    case OP_DIVIDE: binary(t, offset, REG_DIVIDE, depth); break;
+    case OP_EQUAL_PRESERVE: {
+      // Compares into the register above, keeping the first operand.
+      int a = resolve(t, depth - 2);
+      int b = resolve(t, top);
+      prepareWrite(t, top, offset);
+      RegInstruction *instruction = emitWrite(t, REG_EQUAL, offset, top);
+      instruction->registers[1] = a;
+      instruction->registers[2] = b;
+      break;
+    }
+    case OP_NOT: unary(t, offset, REG_NOT, depth); break;
+    case OP_NEGATE: unary(t, offset, REG_NEGATE, depth); break;
+    case OP_ADD_IMM: immediateOp(t, offset, REG_ADD_IMM, depth); break;
+    case OP_SUBTRACT_IMM: immediateOp(t, offset, REG_SUBTRACT_IMM, depth); break;
+    case OP_GREATER_IMM: immediateOp(t, offset, REG_GREATER_IMM, depth); break;
+    case OP_LESS_IMM: immediateOp(t, offset, REG_LESS_IMM, depth); break;
+    case OP_PRINT:
+      emit(t, REG_PRINT, offset)->registers[0] = resolve(t, top);
+      discard(t, top);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      materializeAll(t, offset);
+      emit(t, REG_JUMP, offset)->target = jumpTarget(chunk, offset);
+      break;
+    case OP_JUMP_IF_FALSE: {
+      materializeAll(t, offset);
+      RegInstruction *instruction = emit(t, REG_JUMP_IF_FALSE, offset);
+      instruction->registers[0] = top;
+      instruction->target = jumpTarget(chunk, offset);
+      break;
+    }
+    case OP_JUMP_IF_NOT_EQUAL: compareJump(t, offset, REG_JUMP_IF_NOT_EQUAL, depth); break;
+    case OP_JUMP_IF_EQUAL: compareJump(t, offset, REG_JUMP_IF_EQUAL, depth); break;
+    case OP_JUMP_IF_NOT_LESS: compareJump(t, offset, REG_JUMP_IF_NOT_LESS, depth); break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL: compareJump(t, offset, REG_JUMP_IF_NOT_LESS_EQUAL, depth); break;
+    case OP_JUMP_IF_NOT_GREATER: compareJump(t, offset, REG_JUMP_IF_NOT_GREATER, depth); break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: compareJump(t, offset, REG_JUMP_IF_NOT_GREATER_EQUAL, depth); break;
+    case OP_JUMP_IF_NOT_LESS_IMM: compareImmediateJump(t, offset, REG_JUMP_IF_NOT_LESS_IMM, depth); break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL_IMM: compareImmediateJump(t, offset, REG_JUMP_IF_NOT_LESS_EQUAL_IMM, depth); break;
+    case OP_JUMP_IF_NOT_GREATER_IMM: compareImmediateJump(t, offset, REG_JUMP_IF_NOT_GREATER_IMM, depth); break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM: compareImmediateJump(t, offset, REG_JUMP_IF_NOT_GREATER_EQUAL_IMM, depth); break;
+    case OP_RETURN:
+      emit(t, REG_RETURN, offset)->registers[0] = resolve(t, top);
+      discard(t, 0);
+      break;
+    case OP_SET_PROPERTY: stackForm(t, offset, REG_SET_PROPERTY, depth); break;
+    case OP_GET_SUPER: stackForm(t, offset, REG_GET_SUPER, depth); break;
+    case OP_CALL: stackForm(t, offset, REG_CALL, depth); break;
+    case OP_TAIL_CALL: stackForm(t, offset, REG_TAIL_CALL, depth); break;
+    case OP_INTRINSIC: stackForm(t, offset, REG_INTRINSIC, depth); break;
+    case OP_INVOKE: stackForm(t, offset, REG_INVOKE, depth); break;
+    case OP_TAIL_INVOKE: stackForm(t, offset, REG_TAIL_INVOKE, depth); break;
+    case OP_SUPER_INVOKE: stackForm(t, offset, REG_SUPER_INVOKE, depth); break;
+    case OP_CLOSURE: stackForm(t, offset, REG_CLOSURE, depth); break;
+    case OP_CLOSE_UPVALUE: stackForm(t, offset, REG_CLOSE_UPVALUE, depth); break;
+    case OP_CLASS: stackForm(t, offset, REG_CLASS, depth); break;
+    case OP_INHERIT: stackForm(t, offset, REG_INHERIT, depth); break;
+    case OP_METHOD: stackForm(t, offset, REG_METHOD, depth); break;
+  }
+}
+
+// The number of Code slots [instruction] takes.
+static int encodedLength(Chunk *chunk, RegInstruction *instruction) {
+  int length = 1;
+  for (const char *kind = regOpInfo[instruction->opcode].operands; *kind != '\0'; kind++) {
+    length += *kind == 's' ? threadedLength(chunk, instruction->offset) - 1 : 1;
+  }
+  return length;
+}
+
+static int cachesNeeded(Chunk *chunk, RegInstruction *instruction) {
+  int count = 0;
+  for (const char *kind = regOpInfo[instruction->opcode].operands; *kind != '\0'; kind++) {
+    if (*kind == 'c' || (*kind == 's' && hasInlineCache(chunk, instruction->offset))) count++;
+  }
+  return count;
+}
+
+// Lay out the operands of the bytecode instruction at [offset] the way
+// threadChunk() does. Only used for instructions without jumps.
+static Code *encodeStackOperands(Chunk *chunk, int offset, Code *slot, InlineCache **nextCache) {
+  uint8_t *bytes = &chunk->code[offset];
+  int length = instructionLength(chunk, offset);
+  int i = 1;
+  switch (opInfo[bytes[0]].format) {
+    case OPERAND_CONSTANT:
+    case OPERAND_INVOKE:
+    case OPERAND_CLOSURE:
+      (slot++)->value = chunk->constants.values[bytes[i++]];
+      break;
+    default:
+      break;
+  }
+  for (; i < length; i++) (slot++)->operand = bytes[i];
+  if (hasInlineCache(chunk, offset)) (slot++)->cache = (*nextCache)++;
+  return slot;
+}
+
+static void printRegisters(Translator *t, const int *indexAt, const char *name) {
+  printf("== %s (registers) ==\n", name);
+  for (int i = 0; i < t->count; i++) {
+    RegInstruction *instruction = &t->code[i];
+    printf("%04d %4d %-32s", i, t->chunk->lines[instruction->offset],
+           regOpInfo[instruction->opcode].name);
+    int reg = 0;
+    for (const char *kind = regOpInfo[instruction->opcode].operands; *kind != '\0'; kind++) {
+      switch (*kind) {
+        case 'r':
+          printf(" %d", instruction->registers[reg++]);
+          break;
+        case 'k':
+          printf(" '");
+          printValue(instruction->constant);
+          printf("'");
+          break;
+        case 't':
+          printf(" -> %04d", indexAt[instruction->target]);
+          break;
+        case 's':
+          printf(" (%s)", opInfo[t->chunk->code[instruction->offset]].name);
+          break;
+      }
+    }
+    printf("\n");
+  }
+}
+
+void translateRegisters(ObjFunction *function, void *const *handlers) {
+  Chunk *chunk = &function->chunk;
+  Translator t;
+  t.chunk = chunk;
+  t.registerCount = function->maxStack;
+  t.depthAt = ALLOCATE(int, chunk->count);
+  // Slot zero plus the parameters are in place before the first instruction.
+  stackDepths(chunk, function->arity + 1, t.depthAt);
+  t.isJumpTarget = ALLOCATE(bool, chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) t.isJumpTarget[offset] = false;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (t.depthAt[offset] >= 0 && isJump(chunk->code[offset])) {
+      t.isJumpTarget[jumpTarget(chunk, offset)] = true;
+    }
+  }
+  t.copyOf = ALLOCATE(int, t.registerCount);
+  for (int reg = 0; reg < t.registerCount; reg++) t.copyOf[reg] = -1;
+  t.code = NULL;
+  t.count = 0;
+  t.capacity = 0;
+  t.lastWrite = -1;
+
+  // The index of the first register instruction of each bytecode
+  // instruction. Jump targets are resolved through this.
+  int *indexAt = ALLOCATE(int, chunk->count + 1);
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    if (t.isJumpTarget[offset]) {
+      // Falling into a jump target has to leave the registers the way the
+      // jumps to it do.
+      materializeAll(&t, offset);
+      t.lastWrite = -1;
+    }
+    indexAt[offset] = t.count;
+    // Code no path reaches has no stack depth and is left out.
+    if (t.depthAt[offset] >= 0) translateInstruction(&t, offset);
+  }
+  indexAt[chunk->count] = t.count;
+
+  // Where each register instruction starts in the Code slots.
+  int *slotAt = ALLOCATE(int, t.count + 1);
+  int slotCount = 0;
+  int cacheCount = 0;
+  for (int i = 0; i < t.count; i++) {
+    slotAt[i] = slotCount;
+    slotCount += encodedLength(chunk, &t.code[i]);
+    cacheCount += cachesNeeded(chunk, &t.code[i]);
+  }
+  slotAt[t.count] = slotCount;
+
+  Code *code = ALLOCATE(Code, slotCount);
+  int *offsets = ALLOCATE(int, slotCount);
+  InlineCache *caches = newInlineCaches(cacheCount);
+  InlineCache *nextCache = caches;
+
+  for (int i = 0; i < t.count; i++) {
+    RegInstruction *instruction = &t.code[i];
+    for (int j = slotAt[i]; j < slotAt[i + 1]; j++) offsets[j] = instruction->offset;
+
+    Code *slot = &code[slotAt[i]];
+    if (handlers != NULL) {
+      (slot++)->handler = handlers[instruction->opcode];
+    } else {
+      (slot++)->opcode = instruction->opcode;
+    }
+
+    int reg = 0;
+    for (const char *kind = regOpInfo[instruction->opcode].operands; *kind != '\0'; kind++) {
+      switch (*kind) {
+        case 'r':
+          (slot++)->operand = instruction->registers[reg++];
+          break;
+        case 'k':
+          (slot++)->value = instruction->constant;
+          break;
+        case 't':
+          (slot++)->target = &code[slotAt[indexAt[instruction->target]]];
+          break;
+        case 'c':
+          (slot++)->cache = nextCache++;
+          break;
+        case 's':
+          slot = encodeStackOperands(chunk, instruction->offset, slot, &nextCache);
+          break;
+      }
+    }
+  }
+
+  if (vm.printCode) {
+    printRegisters(&t, indexAt, function->name != NULL ? function->name->chars : "<script>");
+  }
+
+  FREE_ARRAY(int, slotAt, t.count + 1);
+  FREE_ARRAY(int, indexAt, chunk->count + 1);
+  FREE_ARRAY(RegInstruction, t.code, t.capacity);
+  FREE_ARRAY(int, t.copyOf, t.registerCount);
+  FREE_ARRAY(bool, t.isJumpTarget, chunk->count);
+  FREE_ARRAY(int, t.depthAt, chunk->count);
+
+  chunk->caches = caches;
+  chunk->cacheCount = cacheCount;
+  chunk->threaded = code;
+  chunk->threadedCount = slotCount;
+  chunk->threadedOffsets = offsets;
+}
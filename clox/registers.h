@@ -0,0 +1,83 @@
+#ifndef clox_registers_h
+#define clox_registers_h
+
+#include "chunk.h"
+#include "object.h"
+
+// The instructions of the register engine, a three-address form of the
+// bytecode. A register is one of the frame's slots: the value the stack
+// engine keeps at depth n lives in slots[n]. Locals are registers already, so
+// most of the stack shuffling of the bytecode disappears.
+typedef enum {
+  REG_MOVE,
+  REG_LOAD,
+  REG_GET_GLOBAL,
+  REG_DEFINE_GLOBAL,
+  REG_SET_GLOBAL,
+  REG_GET_UPVALUE,
+  REG_SET_UPVALUE,
+  REG_GET_PROPERTY,
+  REG_EQUAL,
+  REG_GREATER,
+  REG_LESS,
+  REG_ADD,
+  REG_SUBTRACT,
+  REG_MULTIPLY,
+  REG_DIVIDE,
+  REG_NOT,
+  REG_NEGATE,
+  REG_ADD_IMM,
+  REG_SUBTRACT_IMM,
+  REG_GREATER_IMM,
+  REG_LESS_IMM,
+  REG_PRINT,
+  REG_JUMP,
+  REG_JUMP_IF_FALSE,
+  REG_JUMP_IF_NOT_EQUAL,
+  REG_JUMP_IF_EQUAL,
+  REG_JUMP_IF_NOT_LESS,
+  REG_JUMP_IF_NOT_LESS_EQUAL,
+  REG_JUMP_IF_NOT_GREATER,
+  REG_JUMP_IF_NOT_GREATER_EQUAL,
+  REG_JUMP_IF_NOT_LESS_IMM,
+  REG_JUMP_IF_NOT_LESS_EQUAL_IMM,
+  REG_JUMP_IF_NOT_GREATER_IMM,
+  REG_JUMP_IF_NOT_GREATER_EQUAL_IMM,
+  REG_RETURN,
+  // Instructions that keep their stack form. They start with the stack depth
+  // at the instruction, which the VM turns into its stack top, followed by
+  // the operands of the bytecode instruction laid out as threadChunk() does.
+  REG_SET_PROPERTY,
+  REG_GET_SUPER,
+  REG_CALL,
+  REG_TAIL_CALL,
+  REG_INTRINSIC,
+  REG_INVOKE,
+  REG_TAIL_INVOKE,
+  REG_SUPER_INVOKE,
+  REG_CLOSURE,
+  REG_CLOSE_UPVALUE,
+  REG_CLASS,
+  REG_INHERIT,
+  REG_METHOD,
+  // Not an instruction, the number of register opcodes above
+  REG_OPCODE_COUNT
+} RegOpCode;
+
+typedef struct {
+  const char *name;
+  // One character per operand slot after the handler: 'r' a register, count
+  // or global slot, 'k' a constant, 't' a jump target, 'c' an inline cache
+  // and 's' the operands of the stack instruction it was made from.
+  const char *operands;
+} RegOpInfo;
+
+// Indexed by RegOpCode.
+extern const RegOpInfo regOpInfo[];
+
+// Translate [function]'s bytecode into register code. The result takes the
+// place of the threaded code in its chunk, [handlers] working the same way
+// as for threadChunk().
+void translateRegisters(ObjFunction *function, void *const *handlers);
+
+#endif
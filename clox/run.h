@@ -0,0 +1,921 @@
+// The stack engine's interpreter loop, included twice by vm.c: once as run()
+// and once as runTraced(). vm.c defines RUN to the function's name,
+// RUN_HANDLERS to where it publishes its handler addresses and
+// TRACE_INSTRUCTION() to what runs before each instruction. There's no
+// include guard on purpose.
+
+static InterpretResult RUN() {
+// ip, the frame's slots and the stack top live in locals so the compiler can
+// keep them in registers. STORE_FRAME() writes them back to the VM before
+// anything that reads the VM's state, may allocate (and so run the GC) or may
+// report a runtime error. LOAD_STACK() picks the stack top up again after a
+// helper that pushed or popped through the VM.
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = stackTop)
+#define LOAD_STACK() (stackTop = vm.stackTop)
+#define LOAD_FRAME()                                                           \
+  (frame = &vm.frames[vm.frameCount - 1], ip = frame->ip, slots = frame->slots)
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define READ_CODE() (ip++)
+#define READ_OPERAND() (READ_CODE()->operand)
+#define READ_CONSTANT() (READ_CODE()->value)
+#define READ_TARGET() (READ_CODE()->target)
+#define READ_CACHE() (READ_CODE()->cache)
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#ifdef JIT
+// Continue [frame] in machine code. It comes back at an instruction the
+// machine code leaves to the interpreter, usually a call or a return.
+#define RUN_JIT()                                                              \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    if (!jitRun(frame)) return INTERPRET_RUNTIME_ERROR;                        \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+  } while (false)
+// After switching frames, run the new one's machine code if it has any.
+#define JIT_ENTRY()                                                            \
+  do {                                                                         \
+    if (frame->closure->function->jit != NULL) RUN_JIT();                      \
+  } while (false)
+// Back-edges count towards compiling a function with a hot loop, then
+// enter the loop's machine code.
+#define JIT_BACK_EDGE()                                                        \
+  do {                                                                         \
+    ObjFunction *looping = frame->closure->function;                           \
+    if (looping->jit == NULL) {                                                \
+      STORE_FRAME();                                                           \
+      warmUp(looping);                                                         \
+    }                                                                          \
+    if (looping->jit != NULL) RUN_JIT();                                       \
+  } while (false)
+#else
+#define JIT_ENTRY() ((void) 0)
+#define JIT_BACK_EDGE() ((void) 0)
+#endif
+// The do block permits additional semicolons when the macro is used so
+// BINARY_OP(+); compiles.
+#define BINARY_OP(valueType, op)                                               \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(PEEK(0));                                             \
+    PEEK(0) = valueType(a op b);                                               \
+  } while (false)
+// The quickened form of BINARY_OP. Hands anything but two numbers back to the
+// generic instruction.
+#define NUMBER_OP(valueType, op, genericOp)                                    \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      DEOPTIMIZE(genericOp);                                                   \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(PEEK(0));                                             \
+    PEEK(0) = valueType(a op b);                                               \
+  } while (false)
+// NUMBER_OP with a fast path for two small integers. [op] runs on 64 bits,
+// which is exact for sums and differences, and [intType] makes the result a
+// value again.
+#define INT_NUMBER_OP(intType, valueType, op, genericOp)                       \
+  do {                                                                         \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) {                                  \
+      int64_t b = AS_INT(POP());                                               \
+      PEEK(0) = intType(AS_INT(PEEK(0)) op b);                                 \
+    } else {                                                                   \
+      NUMBER_OP(valueType, op, genericOp);                                     \
+    }                                                                          \
+  } while (false)
+
+#ifdef COMPUTED_GOTO
+  // Each opcode's handler is a label and every handler ends with its own
+  // indirect jump to the handler stored in the next threaded code slot. The
+  // CPU then predicts the next opcode per handler instead of through the
+  // single shared jump of a switch.
+  static void *dispatchTable[] = {
+          [OP_CONSTANT] = &&OP_CONSTANT,
+          // threadChunk() turns these into OP_CONSTANT
+          [OP_CONSTANT_LONG] = &&OP_CONSTANT,
+          [OP_SMALL_INT] = &&OP_CONSTANT,
+          [OP_NIL] = &&OP_NIL,
+          [OP_TRUE] = &&OP_TRUE,
+          [OP_FALSE] = &&OP_FALSE,
+          [OP_POP] = &&OP_POP,
+          [OP_POPN] = &&OP_POPN,
+          [OP_GET_LOCAL] = &&OP_GET_LOCAL,
+          [OP_SET_LOCAL] = &&OP_SET_LOCAL,
+          [OP_GET_GLOBAL] = &&OP_GET_GLOBAL,
+          [OP_DEFINE_GLOBAL] = &&OP_DEFINE_GLOBAL,
+          [OP_SET_GLOBAL] = &&OP_SET_GLOBAL,
+          [OP_GET_UPVALUE] = &&OP_GET_UPVALUE,
+          [OP_SET_UPVALUE] = &&OP_SET_UPVALUE,
+          [OP_GET_PROPERTY] = &&OP_GET_PROPERTY,
+          [OP_SET_PROPERTY] = &&OP_SET_PROPERTY,
+          [OP_GET_SUPER] = &&OP_GET_SUPER,
+          [OP_EQUAL] = &&OP_EQUAL,
+          [OP_EQUAL_PRESERVE] = &&OP_EQUAL_PRESERVE,
+          [OP_GREATER] = &&OP_GREATER,
+          [OP_LESS] = &&OP_LESS,
+          [OP_ADD] = &&OP_ADD,
+          [OP_SUBTRACT] = &&OP_SUBTRACT,
+          [OP_MULTIPLY] = &&OP_MULTIPLY,
+          [OP_DIVIDE] = &&OP_DIVIDE,
+          [OP_NOT] = &&OP_NOT,
+          [OP_NEGATE] = &&OP_NEGATE,
+          [OP_PRINT] = &&OP_PRINT,
+          [OP_JUMP] = &&OP_JUMP,
+          [OP_JUMP_IF_FALSE] = &&OP_JUMP_IF_FALSE,
+          [OP_LOOP] = &&OP_LOOP,
+          [OP_JUMP_IF_NOT_EQUAL] = &&OP_JUMP_IF_NOT_EQUAL,
+          [OP_JUMP_IF_EQUAL] = &&OP_JUMP_IF_EQUAL,
+          [OP_JUMP_IF_NOT_LESS] = &&OP_JUMP_IF_NOT_LESS,
+          [OP_JUMP_IF_NOT_LESS_EQUAL] = &&OP_JUMP_IF_NOT_LESS_EQUAL,
+          [OP_JUMP_IF_NOT_GREATER] = &&OP_JUMP_IF_NOT_GREATER,
+          [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&OP_JUMP_IF_NOT_GREATER_EQUAL,
+          [OP_ADD_IMM] = &&OP_ADD_IMM,
+          [OP_SUBTRACT_IMM] = &&OP_SUBTRACT_IMM,
+          [OP_GREATER_IMM] = &&OP_GREATER_IMM,
+          [OP_LESS_IMM] = &&OP_LESS_IMM,
+          [OP_JUMP_IF_NOT_LESS_IMM] = &&OP_JUMP_IF_NOT_LESS_IMM,
+          [OP_JUMP_IF_NOT_LESS_EQUAL_IMM] = &&OP_JUMP_IF_NOT_LESS_EQUAL_IMM,
+          [OP_JUMP_IF_NOT_GREATER_IMM] = &&OP_JUMP_IF_NOT_GREATER_IMM,
+          [OP_JUMP_IF_NOT_GREATER_EQUAL_IMM] = &&OP_JUMP_IF_NOT_GREATER_EQUAL_IMM,
+          [OP_CALL] = &&OP_CALL,
+          [OP_TAIL_CALL] = &&OP_TAIL_CALL,
+          [OP_INTRINSIC] = &&OP_INTRINSIC,
+          [OP_CLOSURE] = &&OP_CLOSURE,
+          [OP_INVOKE] = &&OP_INVOKE,
+          [OP_TAIL_INVOKE] = &&OP_TAIL_INVOKE,
+          [OP_SUPER_INVOKE] = &&OP_SUPER_INVOKE,
+          [OP_CLOSE_UPVALUE] = &&OP_CLOSE_UPVALUE,
+          [OP_RETURN] = &&OP_RETURN,
+          [OP_CLASS] = &&OP_CLASS,
+          [OP_INHERIT] = &&OP_INHERIT,
+          [OP_METHOD] = &&OP_METHOD,
+          [OP_ADD_NUMBERS] = &&OP_ADD_NUMBERS,
+          [OP_ADD_STRINGS] = &&OP_ADD_STRINGS,
+          [OP_SUBTRACT_NUMBERS] = &&OP_SUBTRACT_NUMBERS,
+          [OP_MULTIPLY_NUMBERS] = &&OP_MULTIPLY_NUMBERS,
+          [OP_DIVIDE_NUMBERS] = &&OP_DIVIDE_NUMBERS,
+          [OP_GREATER_NUMBERS] = &&OP_GREATER_NUMBERS,
+          [OP_LESS_NUMBERS] = &&OP_LESS_NUMBERS,
+          [OP_NEGATE_NUMBER] = &&OP_NEGATE_NUMBER,
+          [OP_JUMP_IF_NOT_LESS_NUMBERS] = &&OP_JUMP_IF_NOT_LESS_NUMBERS,
+          [OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS] = &&OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS,
+          [OP_JUMP_IF_NOT_GREATER_NUMBERS] = &&OP_JUMP_IF_NOT_GREATER_NUMBERS,
+          [OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS] = &&OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS,
+          [OP_ADD_IMM_NUMBER] = &&OP_ADD_IMM_NUMBER,
+          [OP_SUBTRACT_IMM_NUMBER] = &&OP_SUBTRACT_IMM_NUMBER,
+          [OP_JUMP_IF_NOT_LESS_IMM_NUMBER] = &&OP_JUMP_IF_NOT_LESS_IMM_NUMBER,
+          [OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER] = &&OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER,
+          [OP_JUMP_IF_NOT_GREATER_IMM_NUMBER] = &&OP_JUMP_IF_NOT_GREATER_IMM_NUMBER,
+          [OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER] = &&OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER,
+          [OP_ADD_NUM] = &&OP_ADD_NUM,
+          [OP_ADD_STR] = &&OP_ADD_STR,
+          [OP_SUBTRACT_NUM] = &&OP_SUBTRACT_NUM,
+          [OP_MULTIPLY_NUM] = &&OP_MULTIPLY_NUM,
+          [OP_DIVIDE_NUM] = &&OP_DIVIDE_NUM,
+          [OP_GREATER_NUM] = &&OP_GREATER_NUM,
+          [OP_LESS_NUM] = &&OP_LESS_NUM,
+#define SUPERINSTRUCTION(name, length, ...) [name] = &&name,
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION
+  };
+
+  if (vm.frameCount == 0) {
+    // Called from initVM() to publish the handler addresses.
+    RUN_HANDLERS = dispatchTable;
+    return INTERPRET_OK;
+  }
+
+#define CASE(op) op
+// Rewrite the handler slot of the instruction being executed. Only used by
+// instructions without operands, so that slot is just behind ip.
+#define QUICKEN(op) (ip[-1].handler = dispatchTable[op])
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    goto *READ_CODE()->handler;                                                \
+  } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#else
+  if (vm.frameCount == 0) return INTERPRET_OK;
+
+#define CASE(op) case op
+#define QUICKEN(op) (ip[-1].opcode = (op))
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  TRACE_INSTRUCTION();                                                         \
+  switch (READ_CODE()->opcode)
+#endif
+
+// Turn a quickened instruction back into [genericOp] and run that instead.
+#define DEOPTIMIZE(genericOp)                                                  \
+  do {                                                                         \
+    QUICKEN(genericOp);                                                        \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+
+// The bodies of the instructions a superinstruction can be made of. Each one
+// reads its own operands and leaves ip on the next instruction's handler
+// slot. Arithmetic and comparisons take their quickened form. Other operands
+// deoptimise into the standalone instruction, whose slot is just behind ip
+// inside a superinstruction too. Jumps only ever end a superinstruction.
+#define DO_OP_CONSTANT() PUSH(READ_CONSTANT())
+#define DO_OP_NIL() PUSH(NIL_VAL)
+#define DO_OP_TRUE() PUSH(BOOL_VAL(true))
+#define DO_OP_FALSE() PUSH(BOOL_VAL(false))
+#define DO_OP_POP() (stackTop--)
+#define DO_OP_POPN() (stackTop -= READ_OPERAND())
+#define DO_OP_GET_LOCAL() PUSH(slots[READ_OPERAND()])
+#define DO_OP_SET_LOCAL() (slots[READ_OPERAND()] = PEEK(0))
+#define DO_OP_GET_GLOBAL()                                                     \
+  do {                                                                         \
+    int slot = READ_OPERAND();                                                 \
+    Value value = vm.globalValues.values[slot];                                \
+    if (IS_UNDEFINED(value)) {                                                 \
+      RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));            \
+    }                                                                          \
+    PUSH(value);                                                               \
+  } while (false)
+#define DO_OP_SET_GLOBAL()                                                     \
+  do {                                                                         \
+    int slot = READ_OPERAND();                                                 \
+    if (IS_UNDEFINED(vm.globalValues.values[slot])) {                          \
+      RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));            \
+    }                                                                          \
+    vm.globalValues.values[slot] = PEEK(0);                                    \
+  } while (false)
+// Functions have an upvalue array. The operand is an index into it.
+#define DO_OP_GET_UPVALUE()                                                    \
+  PUSH(*frame->closure->upvalues[READ_OPERAND()]->location)
+#define DO_OP_SET_UPVALUE()                                                    \
+  (*frame->closure->upvalues[READ_OPERAND()]->location = PEEK(0))
+#define DO_OP_GET_PROPERTY()                                                   \
+  do {                                                                         \
+    /* We can only use the .property notation on class instances */            \
+    if (!IS_INSTANCE(PEEK(0))) {                                               \
+      RUNTIME_ERROR("Only instances have properties.");                        \
+    }                                                                          \
+    ObjInstance *instance = AS_INSTANCE(PEEK(0));                              \
+    ObjString *name = READ_STRING();                                           \
+    InlineCache *cache = READ_CACHE();                                         \
+    int slot = cachedField(cache, instance);                                   \
+    if (slot >= 0) {                                                           \
+      CACHE_HIT();                                                             \
+      PEEK(0) = instance->fields[slot]; /* Replace the instance */             \
+    } else {                                                                   \
+      STORE_FRAME();                                                           \
+      if (!getProperty(name, cache)) {                                         \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+  } while (false)
+#define DO_OP_EQUAL()                                                          \
+  do {                                                                         \
+    Value b = POP();                                                           \
+    PEEK(0) = BOOL_VAL(valuesEqual(PEEK(0), b));                               \
+  } while (false)
+#define DO_OP_GREATER() INT_NUMBER_OP(BOOL_VAL, BOOL_VAL, >, OP_GREATER)
+#define DO_OP_LESS() INT_NUMBER_OP(BOOL_VAL, BOOL_VAL, <, OP_LESS)
+#define DO_OP_ADD() INT_NUMBER_OP(WIDE_INT_VAL, NUMBER_VAL, +, OP_ADD)
+#define DO_OP_SUBTRACT() INT_NUMBER_OP(WIDE_INT_VAL, NUMBER_VAL, -, OP_SUBTRACT)
+#define DO_OP_MULTIPLY() NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY)
+#define DO_OP_DIVIDE() NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE)
+#define DO_OP_NOT() (PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))))
+// Negate the value on top of the stack in place.
+#define DO_OP_NEGATE()                                                         \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0))) {                                                 \
+      RUNTIME_ERROR("Operand must be a number.");                              \
+    }                                                                          \
+    PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));                                 \
+  } while (false)
+// Targets were resolved to absolute addresses when threading.
+#define DO_OP_JUMP()                                                           \
+  do {                                                                         \
+    Code *target = READ_TARGET();                                              \
+    ip = target;                                                               \
+  } while (false)
+#define DO_OP_JUMP_IF_FALSE()                                                  \
+  do {                                                                         \
+    Code *target = READ_TARGET();                                              \
+    if (isFalsey(PEEK(0))) ip = target;                                        \
+  } while (false)
+#define DO_OP_LOOP()                                                           \
+  do {                                                                         \
+    Code *target = READ_TARGET();                                              \
+    ip = target;                                                               \
+    JIT_BACK_EDGE();                                                           \
+  } while (false)
+// Pops two numbers [a] and [b] and jumps if [condition] on them holds. '<='
+// and '>=' negate '>' and '<' like their OP_NOT forms do, NaN included.
+// Small integers compare as doubles here: with a separate integer branch GCC
+// turns the jumps into conditional moves of ip, which stalls dispatch.
+#define COMPARE_JUMP(condition)                                                \
+  do {                                                                         \
+    Value bValue = PEEK(0);                                                    \
+    Value aValue = PEEK(1);                                                    \
+    if (!IS_NUMBER(aValue) || !IS_NUMBER(bValue)) {                            \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double a = AS_NUMBER(aValue);                                              \
+    double b = AS_NUMBER(bValue);                                              \
+    stackTop -= 2;                                                             \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+#define EQUAL_JUMP(jumpIfEqual)                                                \
+  do {                                                                         \
+    Code *target = READ_TARGET();                                              \
+    Value b = POP();                                                           \
+    Value a = POP();                                                           \
+    if (valuesEqual(a, b) == (jumpIfEqual)) ip = target;                       \
+  } while (false)
+#define DO_OP_JUMP_IF_NOT_EQUAL() EQUAL_JUMP(false)
+#define DO_OP_JUMP_IF_EQUAL() EQUAL_JUMP(true)
+#define DO_OP_JUMP_IF_NOT_LESS() COMPARE_JUMP(!(a < b))
+#define DO_OP_JUMP_IF_NOT_LESS_EQUAL() COMPARE_JUMP(a > b)
+#define DO_OP_JUMP_IF_NOT_GREATER() COMPARE_JUMP(!(a > b))
+#define DO_OP_JUMP_IF_NOT_GREATER_EQUAL() COMPARE_JUMP(a < b)
+// The immediate forms. [b] is the operand, which threadChunk() already
+// turned into a small integer.
+#define IMMEDIATE_OP(intType, valueType, op, message)                          \
+  do {                                                                         \
+    if (IS_INT(PEEK(0))) {                                                     \
+      int64_t b = AS_INT(READ_CONSTANT());                                     \
+      PEEK(0) = intType(AS_INT(PEEK(0)) op b);                                 \
+    } else {                                                                   \
+      if (!IS_DOUBLE(PEEK(0))) {                                               \
+        RUNTIME_ERROR(message);                                                \
+      }                                                                        \
+      double b = AS_INT(READ_CONSTANT());                                      \
+      PEEK(0) = valueType(AS_DOUBLE(PEEK(0)) op b);                            \
+    }                                                                          \
+  } while (false)
+#define COMPARE_IMMEDIATE_JUMP(condition)                                      \
+  do {                                                                         \
+    Value aValue = PEEK(0);                                                    \
+    if (!IS_NUMBER(aValue)) {                                                  \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double a = AS_NUMBER(aValue);                                              \
+    double b = AS_NUMBER(READ_CONSTANT());                                     \
+    stackTop--;                                                                \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+#define DO_OP_ADD_IMM()                                                        \
+  IMMEDIATE_OP(WIDE_INT_VAL, NUMBER_VAL, +,                                    \
+               "Operands must be two numbers or two strings")
+#define DO_OP_SUBTRACT_IMM()                                                   \
+  IMMEDIATE_OP(WIDE_INT_VAL, NUMBER_VAL, -, "Operands must be numbers.")
+#define DO_OP_GREATER_IMM()                                                    \
+  IMMEDIATE_OP(BOOL_VAL, BOOL_VAL, >, "Operands must be numbers.")
+#define DO_OP_LESS_IMM()                                                       \
+  IMMEDIATE_OP(BOOL_VAL, BOOL_VAL, <, "Operands must be numbers.")
+#define DO_OP_JUMP_IF_NOT_LESS_IMM() COMPARE_IMMEDIATE_JUMP(!(a < b))
+#define DO_OP_JUMP_IF_NOT_LESS_EQUAL_IMM() COMPARE_IMMEDIATE_JUMP(a > b)
+#define DO_OP_JUMP_IF_NOT_GREATER_IMM() COMPARE_IMMEDIATE_JUMP(!(a > b))
+#define DO_OP_JUMP_IF_NOT_GREATER_EQUAL_IMM() COMPARE_IMMEDIATE_JUMP(a < b)
+
+// The typed forms. inferTypes() proved their operands are numbers, so they
+// don't check.
+#define NUMBERS_OP(valueType, op)                                              \
+  do {                                                                         \
+    double b = AS_NUMBER(POP());                                               \
+    PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b);                              \
+  } while (false)
+#define INT_NUMBERS_OP(intType, valueType, op)                                 \
+  do {                                                                         \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) {                                  \
+      int64_t b = AS_INT(POP());                                               \
+      PEEK(0) = intType(AS_INT(PEEK(0)) op b);                                 \
+    } else {                                                                   \
+      NUMBERS_OP(valueType, op);                                               \
+    }                                                                          \
+  } while (false)
+#define NUMBER_IMMEDIATE_OP(op)                                                \
+  do {                                                                         \
+    if (IS_INT(PEEK(0))) {                                                     \
+      int64_t b = AS_INT(READ_CONSTANT());                                     \
+      PEEK(0) = WIDE_INT_VAL(AS_INT(PEEK(0)) op b);                            \
+    } else {                                                                   \
+      double b = AS_INT(READ_CONSTANT());                                      \
+      PEEK(0) = NUMBER_VAL(AS_DOUBLE(PEEK(0)) op b);                           \
+    }                                                                          \
+  } while (false)
+#define NUMBERS_COMPARE_JUMP(condition)                                        \
+  do {                                                                         \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+#define NUMBER_COMPARE_IMMEDIATE_JUMP(condition)                               \
+  do {                                                                         \
+    double a = AS_NUMBER(POP());                                               \
+    double b = AS_INT(READ_CONSTANT());                                        \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+
+// The bodies of the instructions the register engine keeps in their stack
+// form. runRegisters() points stackTop at the instruction's stack depth and
+// runs the same code.
+#define DO_OP_GET_SUPER()                                                      \
+  do {                                                                         \
+    ObjString *name = READ_STRING();                                           \
+    ObjClass *superclass = AS_CLASS(POP());                                    \
+    STORE_FRAME();                                                             \
+    if (!bindMethod(superclass, name)) {                                       \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_STACK();                                                              \
+  } while (false)
+#define DO_OP_SET_PROPERTY()                                                   \
+  do {                                                                         \
+    if (!IS_INSTANCE(PEEK(1))) {                                               \
+      RUNTIME_ERROR("Only instances have fields.");                            \
+    }                                                                          \
+    ObjInstance *instance = AS_INSTANCE(PEEK(1));                              \
+    ObjString *name = READ_STRING();                                           \
+    InlineCache *cache = READ_CACHE();                                         \
+    CacheEntry *entry = findCacheEntry(cache, instance->shape);                \
+    if (entry != NULL && entry->slot >= 0) {                                   \
+      CACHE_HIT();                                                             \
+      if (entry->transition == NULL) {                                         \
+        instance->fields[entry->slot] = PEEK(0);                               \
+      } else {                                                                 \
+        /* Adding a field can grow the slots and trigger a GC. */              \
+        STORE_FRAME();                                                         \
+        addField(instance, entry->transition, PEEK(0));                        \
+      }                                                                        \
+    } else {                                                                   \
+      STORE_FRAME();                                                           \
+      setProperty(instance, name, PEEK(0), cache);                             \
+    }                                                                          \
+    Value value = POP();                                                       \
+    PEEK(0) = value; /* Replace the instance */                                \
+  } while (false)
+// callValue() will produce a frame on the CallFrame stack for the new fn.
+#define DO_OP_CALL()                                                           \
+  do {                                                                         \
+    int argCount = READ_OPERAND();                                             \
+    STORE_FRAME();                                                             \
+    if (!callValue(PEEK(argCount), argCount)) {                                \
+      return INTERPRET_RUNTIME_ERROR;                                           \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    JIT_ENTRY();                                                               \
+  } while (false)
+// The builtin runs without a frame. If its global was reassigned, whatever
+// it holds now is called instead.
+#define DO_OP_INTRINSIC()                                                      \
+  do {                                                                         \
+    int id = READ_OPERAND();                                                   \
+    STORE_FRAME();                                                             \
+    IntrinsicStatus status = callIntrinsic(id);                                \
+    if (status == INTRINSIC_ERROR) return INTERPRET_RUNTIME_ERROR;             \
+    if (status == INTRINSIC_REPLACED) {                                        \
+      int argCount = intrinsics[id].arity;                                     \
+      if (!callValue(PEEK(argCount), argCount)) {                              \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+      LOAD_FRAME();                                                            \
+      LOAD_STACK();                                                            \
+      JIT_ENTRY();                                                             \
+    } else {                                                                   \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+  } while (false)
+#define DO_OP_TAIL_CALL()                                                      \
+  do {                                                                         \
+    int argCount = READ_OPERAND();                                             \
+    STORE_FRAME();                                                             \
+    if (!tailCallValue(PEEK(argCount), argCount)) {                            \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    JIT_ENTRY();                                                               \
+  } while (false)
+#define DO_OP_INVOKE()                                                         \
+  do {                                                                         \
+    ObjString *method = READ_STRING();                                         \
+    int argCount = READ_OPERAND();                                             \
+    InlineCache *cache = READ_CACHE();                                         \
+    STORE_FRAME();                                                             \
+    if (!invoke(method, argCount, cache, false)) {                             \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    JIT_ENTRY();                                                               \
+  } while (false)
+#define DO_OP_TAIL_INVOKE()                                                    \
+  do {                                                                         \
+    ObjString *method = READ_STRING();                                         \
+    int argCount = READ_OPERAND();                                             \
+    InlineCache *cache = READ_CACHE();                                         \
+    STORE_FRAME();                                                             \
+    if (!invoke(method, argCount, cache, true)) {                              \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    JIT_ENTRY();                                                               \
+  } while (false)
+#define DO_OP_SUPER_INVOKE()                                                   \
+  do {                                                                         \
+    ObjString *method = READ_STRING();                                         \
+    int argCount = READ_OPERAND();                                             \
+    ObjClass *superclass = AS_CLASS(POP());                                    \
+    STORE_FRAME();                                                             \
+    if (!invokeFromClass(superclass, method, argCount)) {                      \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    JIT_ENTRY();                                                               \
+  } while (false)
+#define DO_OP_CLOSURE()                                                        \
+  do {                                                                         \
+    ObjFunction *function = AS_FUNCTION(READ_CONSTANT());                      \
+    STORE_FRAME();                                                             \
+    ObjClosure *closure = newClosure(function);                                \
+    PUSH(OBJ_VAL(closure));                                                    \
+    /* Capturing allocates upvalues so the GC must see the closure. */         \
+    vm.stackTop = stackTop;                                                    \
+    for (int i = 0; i < closure->upvalueCount; i++) {                          \
+      int isLocal = READ_OPERAND();                                            \
+      int index = READ_OPERAND();                                              \
+      if (isLocal) {                                                           \
+        closure->upvalues[i] = captureUpvalue(slots + index);                  \
+      } else {                                                                 \
+        closure->upvalues[i] = frame->closure->upvalues[index];                \
+      }                                                                        \
+    }                                                                          \
+  } while (false)
+#define DO_OP_CLOSE_UPVALUE()                                                  \
+  do {                                                                         \
+    closeUpvalues(stackTop - 1);                                               \
+    stackTop--;                                                                \
+  } while (false)
+// Create a new class object with the given name.
+#define DO_OP_CLASS()                                                          \
+  do {                                                                         \
+    ObjString *name = READ_STRING();                                           \
+    STORE_FRAME();                                                             \
+    PUSH(OBJ_VAL(newClass(name)));                                             \
+  } while (false)
+// Inheriting a class simply copies all methods from the superclass to the
+// subclass. This doesn't affect inheritance as we perform this before parsing
+// the class methods. The superclass stays behind as the 'super' local.
+#define DO_OP_INHERIT()                                                        \
+  do {                                                                         \
+    Value superclass = PEEK(1);                                                \
+    if (!IS_CLASS(superclass)) {                                               \
+      RUNTIME_ERROR("Superclass must be a class.");                            \
+    }                                                                          \
+    ObjClass *subclass = AS_CLASS(PEEK(0));                                    \
+    STORE_FRAME();                                                             \
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);           \
+    stackTop--;                                                                \
+  } while (false)
+#define DO_OP_METHOD()                                                         \
+  do {                                                                         \
+    ObjString *name = READ_STRING();                                           \
+    STORE_FRAME();                                                             \
+    defineMethod(name);                                                        \
+    LOAD_STACK();                                                              \
+  } while (false)
+
+// A superinstruction runs its parts back to back, stepping over the handler
+// slot each part after the first still has for jumps that land on it.
+#define FUSED_2(a, b) DO_##a(); ip++; DO_##b()
+#define FUSED_3(a, b, c) FUSED_2(a, b); ip++; DO_##c()
+#define FUSED_4(a, b, c, d) FUSED_3(a, b, c); ip++; DO_##d()
+
+  CallFrame *frame;
+  register Code *ip;
+  register Value *slots;
+  register Value *stackTop = vm.stackTop;
+  LOAD_FRAME();
+
+  INTERPRET_LOOP
+  {
+    CASE(OP_CONSTANT):
+      DO_OP_CONSTANT();
+      DISPATCH();
+    CASE(OP_NIL):
+      DO_OP_NIL();
+      DISPATCH();
+    CASE(OP_TRUE):
+      DO_OP_TRUE();
+      DISPATCH();
+    CASE(OP_FALSE):
+      DO_OP_FALSE();
+      DISPATCH();
+    CASE(OP_POP):
+      DO_OP_POP();
+      DISPATCH();
+    CASE(OP_POPN):
+      DO_OP_POPN();
+      DISPATCH();
+    CASE(OP_GET_LOCAL):
+      DO_OP_GET_LOCAL();
+      DISPATCH();
+    CASE(OP_SET_LOCAL):
+      DO_OP_SET_LOCAL();
+      DISPATCH();
+    CASE(OP_GET_GLOBAL):
+      DO_OP_GET_GLOBAL();
+      DISPATCH();
+    CASE(OP_DEFINE_GLOBAL): {
+      int slot = READ_OPERAND();
+      vm.globalValues.values[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL):
+      DO_OP_SET_GLOBAL();
+      DISPATCH();
+    CASE(OP_GET_UPVALUE):
+      DO_OP_GET_UPVALUE();
+      DISPATCH();
+    CASE(OP_SET_UPVALUE):
+      DO_OP_SET_UPVALUE();
+      DISPATCH();
+    CASE(OP_GET_SUPER):
+      DO_OP_GET_SUPER();
+      DISPATCH();
+    CASE(OP_EQUAL):
+      DO_OP_EQUAL();
+      DISPATCH();
+    CASE(OP_GET_PROPERTY):
+      DO_OP_GET_PROPERTY();
+      DISPATCH();
+    CASE(OP_SET_PROPERTY):
+      DO_OP_SET_PROPERTY();
+      DISPATCH();
+    CASE(OP_EQUAL_PRESERVE): {
+      Value b = POP();
+      Value a = PEEK(0);
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    // The generic arithmetic and comparison instructions quicken themselves
+    // into a form specialised for the operands they just saw.
+    CASE(OP_GREATER):
+      BINARY_OP(BOOL_VAL, >);
+      QUICKEN(OP_GREATER_NUM);
+      DISPATCH();
+    CASE(OP_GREATER_NUM):
+      DO_OP_GREATER();
+      DISPATCH();
+    CASE(OP_LESS):
+      BINARY_OP(BOOL_VAL, <);
+      QUICKEN(OP_LESS_NUM);
+      DISPATCH();
+    CASE(OP_LESS_NUM):
+      DO_OP_LESS();
+      DISPATCH();
+    CASE(OP_ADD):
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        STORE_FRAME();
+        concatenate();
+        LOAD_STACK();
+        QUICKEN(OP_ADD_STR);
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(PEEK(0));
+        PEEK(0) = NUMBER_VAL(a + b);
+        QUICKEN(OP_ADD_NUM);
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings");
+      }
+      DISPATCH();
+    CASE(OP_ADD_NUM):
+      DO_OP_ADD();
+      DISPATCH();
+    CASE(OP_ADD_STR):
+      if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      STORE_FRAME();
+      concatenate();
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_SUBTRACT):
+      BINARY_OP(NUMBER_VAL, -);
+      QUICKEN(OP_SUBTRACT_NUM);
+      DISPATCH();
+    CASE(OP_SUBTRACT_NUM):
+      DO_OP_SUBTRACT();
+      DISPATCH();
+    CASE(OP_MULTIPLY):
+      BINARY_OP(NUMBER_VAL, *);
+      QUICKEN(OP_MULTIPLY_NUM);
+      DISPATCH();
+    CASE(OP_MULTIPLY_NUM):
+      DO_OP_MULTIPLY();
+      DISPATCH();
+    CASE(OP_DIVIDE):
+      BINARY_OP(NUMBER_VAL, /);
+      QUICKEN(OP_DIVIDE_NUM);
+      DISPATCH();
+    CASE(OP_DIVIDE_NUM):
+      DO_OP_DIVIDE();
+      DISPATCH();
+    CASE(OP_NOT):
+      DO_OP_NOT();
+      DISPATCH();
+    CASE(OP_NEGATE):
+      DO_OP_NEGATE();
+      DISPATCH();
+    CASE(OP_PRINT):
+      printValue(POP());
+      printf("\n");
+      DISPATCH();
+    CASE(OP_JUMP):
+      DO_OP_JUMP();
+      DISPATCH();
+    CASE(OP_JUMP_IF_FALSE):
+      DO_OP_JUMP_IF_FALSE();
+      DISPATCH();
+    CASE(OP_LOOP):
+      DO_OP_LOOP();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_EQUAL):
+      DO_OP_JUMP_IF_NOT_EQUAL();
+      DISPATCH();
+    CASE(OP_JUMP_IF_EQUAL):
+      DO_OP_JUMP_IF_EQUAL();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS):
+      DO_OP_JUMP_IF_NOT_LESS();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL):
+      DO_OP_JUMP_IF_NOT_LESS_EQUAL();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER):
+      DO_OP_JUMP_IF_NOT_GREATER();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL):
+      DO_OP_JUMP_IF_NOT_GREATER_EQUAL();
+      DISPATCH();
+    CASE(OP_ADD_IMM):
+      DO_OP_ADD_IMM();
+      DISPATCH();
+    CASE(OP_SUBTRACT_IMM):
+      DO_OP_SUBTRACT_IMM();
+      DISPATCH();
+    CASE(OP_GREATER_IMM):
+      DO_OP_GREATER_IMM();
+      DISPATCH();
+    CASE(OP_LESS_IMM):
+      DO_OP_LESS_IMM();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_IMM):
+      DO_OP_JUMP_IF_NOT_LESS_IMM();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_IMM):
+      DO_OP_JUMP_IF_NOT_LESS_EQUAL_IMM();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_IMM):
+      DO_OP_JUMP_IF_NOT_GREATER_IMM();
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_IMM):
+      DO_OP_JUMP_IF_NOT_GREATER_EQUAL_IMM();
+      DISPATCH();
+    CASE(OP_CALL):
+      DO_OP_CALL();
+      DISPATCH();
+    CASE(OP_TAIL_CALL):
+      DO_OP_TAIL_CALL();
+      DISPATCH();
+    CASE(OP_INTRINSIC):
+      DO_OP_INTRINSIC();
+      DISPATCH();
+    CASE(OP_INVOKE):
+      DO_OP_INVOKE();
+      DISPATCH();
+    CASE(OP_TAIL_INVOKE):
+      DO_OP_TAIL_INVOKE();
+      DISPATCH();
+    CASE(OP_SUPER_INVOKE):
+      DO_OP_SUPER_INVOKE();
+      DISPATCH();
+    CASE(OP_CLOSURE):
+      DO_OP_CLOSURE();
+      DISPATCH();
+    CASE(OP_CLOSE_UPVALUE):
+      DO_OP_CLOSE_UPVALUE();
+      DISPATCH();
+    CASE(OP_RETURN): {
+      // The returned value will be top of stack
+      // We save it, pop the function, then restore it
+      Value result = POP();
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        // This wasn't a `return` keyword but just the end of the <script>
+        vm.stackTop = stackTop - 1;
+        return INTERPRET_OK;
+      }
+
+      stackTop = slots;
+      // restore the return value
+      PUSH(result);
+      LOAD_FRAME();
+      JIT_ENTRY();
+      DISPATCH();
+    }
+    CASE(OP_CLASS):
+      DO_OP_CLASS();
+      DISPATCH();
+    CASE(OP_INHERIT):
+      DO_OP_INHERIT();
+      DISPATCH();
+    CASE(OP_METHOD):
+      DO_OP_METHOD();
+      DISPATCH();
+    CASE(OP_ADD_NUMBERS):
+      INT_NUMBERS_OP(WIDE_INT_VAL, NUMBER_VAL, +);
+      DISPATCH();
+    CASE(OP_ADD_STRINGS):
+      STORE_FRAME();
+      concatenate();
+      LOAD_STACK();
+      DISPATCH();
+    CASE(OP_SUBTRACT_NUMBERS):
+      INT_NUMBERS_OP(WIDE_INT_VAL, NUMBER_VAL, -);
+      DISPATCH();
+    CASE(OP_MULTIPLY_NUMBERS):
+      NUMBERS_OP(NUMBER_VAL, *);
+      DISPATCH();
+    CASE(OP_DIVIDE_NUMBERS):
+      NUMBERS_OP(NUMBER_VAL, /);
+      DISPATCH();
+    CASE(OP_GREATER_NUMBERS):
+      INT_NUMBERS_OP(BOOL_VAL, BOOL_VAL, >);
+      DISPATCH();
+    CASE(OP_LESS_NUMBERS):
+      INT_NUMBERS_OP(BOOL_VAL, BOOL_VAL, <);
+      DISPATCH();
+    CASE(OP_NEGATE_NUMBER):
+      PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_NUMBERS):
+      NUMBERS_COMPARE_JUMP(!(a < b));
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS):
+      NUMBERS_COMPARE_JUMP(a > b);
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_NUMBERS):
+      NUMBERS_COMPARE_JUMP(!(a > b));
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS):
+      NUMBERS_COMPARE_JUMP(a < b);
+      DISPATCH();
+    CASE(OP_ADD_IMM_NUMBER):
+      NUMBER_IMMEDIATE_OP(+);
+      DISPATCH();
+    CASE(OP_SUBTRACT_IMM_NUMBER):
+      NUMBER_IMMEDIATE_OP(-);
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_IMM_NUMBER):
+      NUMBER_COMPARE_IMMEDIATE_JUMP(!(a < b));
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER):
+      NUMBER_COMPARE_IMMEDIATE_JUMP(a > b);
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_IMM_NUMBER):
+      NUMBER_COMPARE_IMMEDIATE_JUMP(!(a > b));
+      DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER):
+      NUMBER_COMPARE_IMMEDIATE_JUMP(a < b);
+      DISPATCH();
+#define SUPERINSTRUCTION(name, length, ...)                                    \
+    CASE(name):                                                                \
+      FUSED_##length(__VA_ARGS__);                                             \
+      DISPATCH();
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION
+  }
+
+  // Only reachable with an opcode the switch doesn't know about.
+  return INTERPRET_RUNTIME_ERROR;
+}
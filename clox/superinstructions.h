@@ -0,0 +1,40 @@
+// Generated by tools/superinstructions.py from opcode n-gram counts.
+// Rerun it on your own workload to retune the selection rather than
+// editing this file by hand.
+//
+// SUPERINSTRUCTION(name, length, parts...)
+// Each entry's comment is the share of instructions the sequence covered,
+// averaged over the profiled scripts.
+
+// 28.5%
+SUPERINSTRUCTION(OP_POP_GET_GLOBAL, 2, OP_POP, OP_GET_GLOBAL)
+// 17.8%
+SUPERINSTRUCTION(OP_GET_LOCAL_GET_PROPERTY, 2, OP_GET_LOCAL, OP_GET_PROPERTY)
+// 11.1%
+SUPERINSTRUCTION(OP_POP_GET_GLOBAL_POP_GET_GLOBAL, 4, OP_POP, OP_GET_GLOBAL, OP_POP, OP_GET_GLOBAL)
+// 11.1%
+SUPERINSTRUCTION(OP_GET_GLOBAL_POP_GET_GLOBAL_POP, 4, OP_GET_GLOBAL, OP_POP, OP_GET_GLOBAL, OP_POP)
+// 5.5%
+SUPERINSTRUCTION(OP_POP_GET_GLOBAL_GET_GLOBAL_EQUAL, 4, OP_POP, OP_GET_GLOBAL, OP_GET_GLOBAL, OP_EQUAL)
+// 5.5%
+SUPERINSTRUCTION(OP_GET_GLOBAL_GET_GLOBAL_EQUAL_POP, 4, OP_GET_GLOBAL, OP_GET_GLOBAL, OP_EQUAL, OP_POP)
+// 5.5%
+SUPERINSTRUCTION(OP_GET_GLOBAL_EQUAL_POP_GET_GLOBAL, 4, OP_GET_GLOBAL, OP_EQUAL, OP_POP, OP_GET_GLOBAL)
+// 5.5%
+SUPERINSTRUCTION(OP_EQUAL_POP_GET_GLOBAL_GET_GLOBAL, 4, OP_EQUAL, OP_POP, OP_GET_GLOBAL, OP_GET_GLOBAL)
+// 6.1%
+SUPERINSTRUCTION(OP_GET_GLOBAL_GET_LOCAL_SUBTRACT_IMM, 3, OP_GET_GLOBAL, OP_GET_LOCAL, OP_SUBTRACT_IMM)
+// 7.1%
+SUPERINSTRUCTION(OP_ADD_GET_GLOBAL, 2, OP_ADD, OP_GET_GLOBAL)
+// 4.0%
+SUPERINSTRUCTION(OP_POP_CONSTANT_POP, 3, OP_POP, OP_CONSTANT, OP_POP)
+// 3.2%
+SUPERINSTRUCTION(OP_POP_CONSTANT_POP_CONSTANT, 4, OP_POP, OP_CONSTANT, OP_POP, OP_CONSTANT)
+// 3.2%
+SUPERINSTRUCTION(OP_CONSTANT_POP_CONSTANT_POP, 4, OP_CONSTANT, OP_POP, OP_CONSTANT, OP_POP)
+// 4.7%
+SUPERINSTRUCTION(OP_GET_LOCAL_JUMP_IF_NOT_LESS_IMM, 2, OP_GET_LOCAL, OP_JUMP_IF_NOT_LESS_IMM)
+// 3.3%
+SUPERINSTRUCTION(OP_SET_GLOBAL_POP_LOOP, 3, OP_SET_GLOBAL, OP_POP, OP_LOOP)
+// 2.8%
+SUPERINSTRUCTION(OP_ADD_SET_GLOBAL_POP_LOOP, 4, OP_ADD, OP_SET_GLOBAL, OP_POP, OP_LOOP)
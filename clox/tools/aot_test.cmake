@@ -0,0 +1,63 @@
+# Checks that a Lox script compiled with `clox --emit-c` behaves like the
+# interpreter running it: same exit code, output and errors. Run by ctest, see
+# CLOX_AOT_TESTS in CMakeLists.txt.
+#
+#   cmake -DCLOX=<clox> -DCC=<C compiler> -DINCLUDE=<clox source dir>
+#         -DLIBRARY=<libcloxrt.a> -DDEFINES=<definitions> -DSCRIPT=<script>
+#         -DWORK=<scratch dir> -P aot_test.cmake
+
+file(MAKE_DIRECTORY ${WORK})
+set(source ${WORK}/program.c)
+set(program ${WORK}/program)
+
+execute_process(
+        COMMAND ${CLOX} --no-jit ${SCRIPT}
+        RESULT_VARIABLE expectedResult
+        OUTPUT_VARIABLE expectedOutput
+        ERROR_VARIABLE expectedError
+        TIMEOUT 60)
+
+execute_process(
+        COMMAND ${CLOX} --emit-c ${source} ${SCRIPT}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error)
+
+# A script that doesn't compile has no C to emit, but has to fail the same way.
+if (NOT result EQUAL 0)
+    if (NOT result STREQUAL expectedResult OR NOT error STREQUAL expectedError)
+        message(FATAL_ERROR "--emit-c exited with ${result}, the interpreter with "
+                "${expectedResult}:\n${error}")
+    endif ()
+    return()
+endif ()
+
+set(flags)
+foreach (define IN LISTS DEFINES)
+    list(APPEND flags -D${define})
+endforeach ()
+execute_process(
+        COMMAND ${CC} -O1 -w ${flags} -I${INCLUDE} ${source} ${LIBRARY} -lm -o ${program}
+        RESULT_VARIABLE result
+        ERROR_VARIABLE error)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "The emitted C doesn't build:\n${error}")
+endif ()
+
+execute_process(
+        COMMAND ${program}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+        TIMEOUT 60)
+if (NOT result STREQUAL expectedResult)
+    message(FATAL_ERROR "Exited with ${result}, the interpreter with ${expectedResult}.")
+endif ()
+if (NOT output STREQUAL expectedOutput)
+    message(FATAL_ERROR "Output differs from the interpreter's.\n"
+            "Expected:\n${expectedOutput}\nGot:\n${output}")
+endif ()
+if (NOT error STREQUAL expectedError)
+    message(FATAL_ERROR "Errors differ from the interpreter's.\n"
+            "Expected:\n${expectedError}\nGot:\n${error}")
+endif ()
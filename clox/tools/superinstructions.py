@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Generates superinstructions.h from opcode n-gram counts.
+
+Build clox with DEBUG_COUNT_NGRAMS defined in common.h and the VM prints how
+often each run of 2 to 4 instructions executed. This script picks the runs
+that would save the most dispatches and writes the X-macro list that chunk.h,
+chunk.c and vm.c expand into opcodes, threading rules and handlers.
+
+    # Profile scripts with a counting build and regenerate the header:
+    tools/superinstructions.py --run build/clox bench/*.lox -o superinstructions.h
+
+    # Or use counts saved from earlier runs:
+    tools/superinstructions.py counts/*.txt -o superinstructions.h
+"""
+
+import argparse
+import collections
+import subprocess
+import sys
+
+# The instructions run() has a DO_ body for. Keep in sync with vm.c.
+FUSABLE = {
+    "OP_CONSTANT", "OP_NIL", "OP_TRUE", "OP_FALSE", "OP_POP",
+    "OP_GET_LOCAL", "OP_SET_LOCAL", "OP_GET_GLOBAL", "OP_SET_GLOBAL",
+    "OP_GET_UPVALUE", "OP_SET_UPVALUE", "OP_GET_PROPERTY", "OP_EQUAL",
+    "OP_GREATER", "OP_LESS", "OP_ADD", "OP_SUBTRACT", "OP_MULTIPLY",
+    "OP_DIVIDE", "OP_NOT", "OP_NEGATE",
+    "OP_JUMP", "OP_JUMP_IF_FALSE", "OP_LOOP",
+    "OP_JUMP_IF_NOT_EQUAL", "OP_JUMP_IF_EQUAL", "OP_JUMP_IF_NOT_LESS",
+    "OP_JUMP_IF_NOT_LESS_EQUAL", "OP_JUMP_IF_NOT_GREATER",
+    "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    "OP_ADD_IMM", "OP_SUBTRACT_IMM", "OP_GREATER_IMM", "OP_LESS_IMM",
+    "OP_JUMP_IF_NOT_LESS_IMM", "OP_JUMP_IF_NOT_LESS_EQUAL_IMM",
+    "OP_JUMP_IF_NOT_GREATER_IMM", "OP_JUMP_IF_NOT_GREATER_EQUAL_IMM",
+}
+
+# These move ip elsewhere, so they can only be the last part.
+JUMPS = {op for op in FUSABLE if op.startswith("OP_JUMP") or op == "OP_LOOP"}
+
+
+def read_counts(lines, counts):
+    """Adds one profile's counts to [counts] as a share of its instructions.
+
+    Every profile weighs the same, so one long running script doesn't pick
+    the superinstructions for all of them.
+    """
+    profile = collections.Counter()
+    for line in lines:
+        fields = line.split()
+        if len(fields) < 4 or fields[0] != "ngram":
+            continue
+        profile[tuple(fields[2:])] += int(fields[1])
+
+    # Nearly every instruction starts a 2-gram.
+    total = sum(n for seq, n in profile.items() if len(seq) == 2)
+    for seq, n in profile.items():
+        counts[seq] += n / total
+
+
+def fusable(sequence):
+    if any(op not in FUSABLE for op in sequence):
+        return False
+    return not any(op in JUMPS for op in sequence[:-1])
+
+
+def select(counts, limit):
+    """Greedily picks the sequences that save the most dispatches.
+
+    threadChunk() fuses the longest match, so once a sequence is picked its
+    prefixes only save dispatches where the rest of it doesn't follow.
+    """
+    remaining = {seq: n for seq, n in counts.items() if fusable(seq)}
+    chosen = []
+    while remaining and len(chosen) < limit:
+        best = max(remaining, key=lambda seq: (remaining[seq] * (len(seq) - 1), seq))
+        if remaining[best] <= 0.0:
+            break
+        chosen.append((best, remaining.pop(best)))
+        for seq in remaining:
+            if best[:len(seq)] == seq:
+                remaining[seq] -= chosen[-1][1]
+    return chosen
+
+
+def name(sequence):
+    return "OP_" + "_".join(op[len("OP_"):] for op in sequence)
+
+
+def render(chosen, profiles):
+    out = [
+        "// Generated by tools/superinstructions.py from opcode n-gram counts.",
+        "// Rerun it on your own workload to retune the selection rather than",
+        "// editing this file by hand.",
+        "//",
+        "// SUPERINSTRUCTION(name, length, parts...)",
+        "// Each entry's comment is the share of instructions the sequence covered,",
+        "// averaged over the profiled scripts.",
+        "",
+    ]
+    for sequence, count in chosen:
+        out.append("// %.1f%%" % (100.0 * count * len(sequence) / profiles))
+        out.append("SUPERINSTRUCTION(%s, %d, %s)"
+                   % (name(sequence), len(sequence), ", ".join(sequence)))
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("inputs", nargs="*",
+                        help="files of ngram counts, or scripts with --run")
+    parser.add_argument("--run", metavar="CLOX",
+                        help="a clox built with DEBUG_COUNT_NGRAMS to run the inputs with")
+    parser.add_argument("-n", "--count", type=int, default=12,
+                        help="how many superinstructions to generate")
+    parser.add_argument("-o", "--output", help="where to write the header")
+    args = parser.parse_args()
+
+    counts = collections.Counter()
+    profiles = 0
+    if args.run:
+        for script in args.inputs:
+            result = subprocess.run([args.run, script], stdout=subprocess.DEVNULL,
+                                    stderr=subprocess.PIPE, text=True)
+            read_counts(result.stderr.splitlines(), counts)
+            profiles += 1
+    elif args.inputs:
+        for path in args.inputs:
+            with open(path) as f:
+                read_counts(f, counts)
+            profiles += 1
+    else:
+        read_counts(sys.stdin, counts)
+        profiles = 1
+
+    if not counts:
+        sys.exit("No ngram counts found. Was clox built with DEBUG_COUNT_NGRAMS?")
+
+    header = render(select(counts, args.count), profiles)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(header)
+    else:
+        sys.stdout.write(header)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,286 @@
+#include "types.h"
+
+#include <string.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// The types a value can have, as a set. A slot whose set holds one type is
+// known to have it. The empty set is what slots start at before any path
+// reaches them.
+typedef uint8_t TypeSet;
+
+#define TYPE_NUMBER 1
+#define TYPE_STRING 2
+#define TYPE_OTHER 4
+#define TYPE_ANY (TYPE_NUMBER | TYPE_STRING | TYPE_OTHER)
+
+typedef struct {
+  Chunk *chunk;
+  // The size of the frame, function->maxStack
+  int slotCount;
+  // The stack depth on entry to each instruction, see stackDepths()
+  int *depthAt;
+  // The index of the block starting at each offset, -1 where none does,
+  // see findBlocks()
+  int *blockAt;
+  // [slotCount] sets per block: what the slots can hold on entry to it,
+  // over every path found to reach it so far.
+  TypeSet *entryTypes;
+  bool *reached;
+  // Locals that closures capture, so nothing is known about reading them
+  bool *captured;
+  // Blocks whose entry types grew and that have to be walked again
+  Array worklist;
+  // The slots while walking a block
+  TypeSet *types;
+} Inference;
+
+static TypeSet typeOf(Value value) {
+  if (IS_NUMBER(value)) return TYPE_NUMBER;
+  if (IS_STRING(value)) return TYPE_STRING;
+  return TYPE_OTHER;
+}
+
+// Add the slots at the end of a path into the block at [target].
+static void mergeInto(Inference *in, int target) {
+  int block = in->blockAt[target];
+  TypeSet *entry = &in->entryTypes[block * in->slotCount];
+  bool changed = !in->reached[block];
+  for (int slot = 0; slot < in->depthAt[target]; slot++) {
+    TypeSet merged = entry[slot] | in->types[slot];
+    if (merged != entry[slot]) {
+      entry[slot] = merged;
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    in->reached[block] = true;
+    writeArray(&in->worklist, &target);
+  }
+}
+
+// Replace the instruction at [offset] with its typed form if the slots
+// prove its operands' types.
+static void specialize(Inference *in, int offset) {
+  uint8_t *code = &in->chunk->code[offset];
+  int depth = in->depthAt[offset];
+  if (depth == 0) return;
+  TypeSet a = depth >= 2 ? in->types[depth - 2] : 0;
+  TypeSet b = in->types[depth - 1];
+  bool numbers = a == TYPE_NUMBER && b == TYPE_NUMBER;
+  bool number = b == TYPE_NUMBER;
+
+  switch (*code) {
+    case OP_ADD:
+      if (numbers) {
+        *code = OP_ADD_NUMBERS;
+      } else if (a == TYPE_STRING && b == TYPE_STRING) {
+        *code = OP_ADD_STRINGS;
+      }
+      break;
+    case OP_SUBTRACT: if (numbers) *code = OP_SUBTRACT_NUMBERS; break;
+    case OP_MULTIPLY: if (numbers) *code = OP_MULTIPLY_NUMBERS; break;
+    case OP_DIVIDE: if (numbers) *code = OP_DIVIDE_NUMBERS; break;
+    case OP_GREATER: if (numbers) *code = OP_GREATER_NUMBERS; break;
+    case OP_LESS: if (numbers) *code = OP_LESS_NUMBERS; break;
+    case OP_JUMP_IF_NOT_LESS:
+      if (numbers) *code = OP_JUMP_IF_NOT_LESS_NUMBERS;
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      if (numbers) *code = OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS;
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      if (numbers) *code = OP_JUMP_IF_NOT_GREATER_NUMBERS;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      if (numbers) *code = OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS;
+      break;
+    case OP_NEGATE: if (number) *code = OP_NEGATE_NUMBER; break;
+    case OP_ADD_IMM: if (number) *code = OP_ADD_IMM_NUMBER; break;
+    case OP_SUBTRACT_IMM: if (number) *code = OP_SUBTRACT_IMM_NUMBER; break;
+    case OP_JUMP_IF_NOT_LESS_IMM:
+      if (number) *code = OP_JUMP_IF_NOT_LESS_IMM_NUMBER;
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL_IMM:
+      if (number) *code = OP_JUMP_IF_NOT_LESS_EQUAL_IMM_NUMBER;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_IMM:
+      if (number) *code = OP_JUMP_IF_NOT_GREATER_IMM_NUMBER;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_IMM:
+      if (number) *code = OP_JUMP_IF_NOT_GREATER_EQUAL_IMM_NUMBER;
+      break;
+    default:
+      break;
+  }
+}
+
+// Update the slots for the instruction at [offset]. Only the slots it
+// writes change, those it pops are left for the next push to overwrite.
+static void transfer(Inference *in, int offset) {
+  Chunk *chunk = in->chunk;
+  uint8_t *bytes = &chunk->code[offset];
+  TypeSet *types = in->types;
+  int depth = in->depthAt[offset];
+
+  switch (untypedOpcode(bytes[0])) {
+    case OP_CONSTANT:
+      types[depth] = typeOf(chunk->constants.values[bytes[1]]);
+      break;
+    case OP_CONSTANT_LONG:
+      types[depth] = typeOf(chunk->constants.values[(bytes[1] << 16) + (bytes[2] << 8) + bytes[3]]);
+      break;
+    case OP_SMALL_INT:
+      types[depth] = TYPE_NUMBER;
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      types[depth] = TYPE_OTHER;
+      break;
+    case OP_GET_LOCAL:
+      types[depth] = in->captured[bytes[1]] ? TYPE_ANY : types[bytes[1]];
+      break;
+    case OP_SET_LOCAL:
+      types[bytes[1]] = types[depth - 1];
+      break;
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+      types[depth] = TYPE_ANY;
+      break;
+    case OP_GET_PROPERTY:
+      types[depth - 1] = TYPE_ANY;
+      break;
+    case OP_SET_PROPERTY:
+      // The assigned value takes the instance's place.
+      types[depth - 2] = types[depth - 1];
+      break;
+    case OP_GET_SUPER:
+      types[depth - 2] = TYPE_ANY;
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+      types[depth - 2] = TYPE_OTHER;
+      break;
+    case OP_EQUAL_PRESERVE:
+    case OP_NOT:
+    case OP_GREATER_IMM:
+    case OP_LESS_IMM:
+      types[depth - 1] = TYPE_OTHER;
+      break;
+    case OP_ADD:
+      // Numbers or strings, whichever both operands can be. Anything else
+      // is a runtime error and the path ends.
+      types[depth - 2] &= types[depth - 1] & (TYPE_NUMBER | TYPE_STRING);
+      break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      types[depth - 2] = TYPE_NUMBER;
+      break;
+    case OP_NEGATE:
+    case OP_ADD_IMM:
+    case OP_SUBTRACT_IMM:
+      types[depth - 1] = TYPE_NUMBER;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      // The result takes the callee's place.
+      types[depth - 1 - bytes[1]] = TYPE_ANY;
+      break;
+    case OP_INTRINSIC:
+      // A replaced builtin returns anything.
+      types[depth - 1 - intrinsics[bytes[1]].arity] = TYPE_ANY;
+      break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      types[depth - 1 - bytes[2]] = TYPE_ANY;
+      break;
+    case OP_SUPER_INVOKE:
+      // The superclass is on top of the arguments.
+      types[depth - 2 - bytes[2]] = TYPE_ANY;
+      break;
+    default:
+      // The rest only pop, jump or store elsewhere.
+      break;
+  }
+}
+
+// Follow the straight line of code from the block at [start] to where it
+// ends or runs into another block, adding its slots to the blocks it
+// continues in. With [rewrite], the types on entry are final and the
+// instructions on the way get specialized.
+static void walkBlock(Inference *in, int start, bool rewrite) {
+  Chunk *chunk = in->chunk;
+  memcpy(in->types, &in->entryTypes[in->blockAt[start] * in->slotCount],
+         in->slotCount * sizeof(TypeSet));
+
+  for (int offset = start;;) {
+    uint8_t instruction = untypedOpcode(chunk->code[offset]);
+    if (rewrite) specialize(in, offset);
+    transfer(in, offset);
+    if (instruction == OP_RETURN) return;
+
+    if (isJump(instruction)) {
+      mergeInto(in, jumpTarget(chunk, offset));
+      // Only a conditional jump falls through.
+      if (instruction == OP_JUMP || instruction == OP_LOOP) return;
+    }
+
+    offset += instructionLength(chunk, offset);
+    if (offset >= chunk->count) return;
+    if (in->blockAt[offset] != -1) {
+      mergeInto(in, offset);
+      return;
+    }
+  }
+}
+
+void inferTypes(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0) return;
+
+  Inference in;
+  in.chunk = chunk;
+  in.slotCount = function->maxStack;
+  in.depthAt = ALLOCATE(int, chunk->count);
+  // Slot zero plus the parameters are in place before the first instruction.
+  stackDepths(chunk, function->arity + 1, in.depthAt);
+  in.captured = ALLOCATE(bool, in.slotCount);
+  in.blockAt = ALLOCATE(int, chunk->count);
+  int blockCount = findBlocks(chunk, in.depthAt, in.blockAt, in.captured, in.slotCount);
+
+  in.entryTypes = ALLOCATE(TypeSet, blockCount * in.slotCount);
+  memset(in.entryTypes, 0, blockCount * in.slotCount * sizeof(TypeSet));
+  in.reached = ALLOCATE(bool, blockCount);
+  for (int block = 0; block < blockCount; block++) in.reached[block] = false;
+  in.types = ALLOCATE(TypeSet, in.slotCount);
+  initArray(&in.worklist, sizeof(int));
+
+  // Nothing is known about the callee and the arguments.
+  for (int slot = 0; slot <= function->arity; slot++) in.types[slot] = TYPE_ANY;
+  mergeInto(&in, 0);
+  while (in.worklist.count > 0) {
+    int start = READ_AS(int, &in.worklist, --in.worklist.count);
+    walkBlock(&in, start, false);
+  }
+
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (in.blockAt[offset] != -1 && in.reached[in.blockAt[offset]]) {
+      walkBlock(&in, offset, true);
+    }
+  }
+
+  freeArray(&in.worklist);
+  FREE_ARRAY(TypeSet, in.types, in.slotCount);
+  FREE_ARRAY(bool, in.reached, blockCount);
+  FREE_ARRAY(TypeSet, in.entryTypes, blockCount * in.slotCount);
+  FREE_ARRAY(int, in.blockAt, chunk->count);
+  FREE_ARRAY(bool, in.captured, in.slotCount);
+  FREE_ARRAY(int, in.depthAt, chunk->count);
+}
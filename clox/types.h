@@ -0,0 +1,12 @@
+#ifndef clox_types_h
+#define clox_types_h
+
+#include "object.h"
+
+// Work out what types the values in [function]'s frame can have at each
+// instruction, and replace the arithmetic, comparisons and conditional jumps
+// whose operands are always numbers (or, for OP_ADD, always strings) with
+// the typed forms that skip the checks. Needs function->maxStack.
+void inferTypes(ObjFunction *function);
+
+#endif
@@ -58,17 +58,25 @@ void printValue(Value value) {
         case VAL_OBJ:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            break;
     }
 #endif
 }
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+  if (a == b) {
     // Technically nan != nan
-    return AS_NUMBER(a) == AS_NUMBER(b);
+    return !IS_DOUBLE(a) || AS_DOUBLE(a) == AS_DOUBLE(b);
+  }
+  // Different bits can still be the same number: 0 and -0, or a small
+  // integer and a double
+  if (IS_DOUBLE(a)) {
+    if (IS_DOUBLE(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+    return IS_INT(b) && AS_DOUBLE(a) == AS_INT(b);
   }
-  return a == b;
+  return IS_INT(a) && IS_DOUBLE(b) && AS_INT(a) == AS_DOUBLE(b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
@@ -16,6 +16,12 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE  3 // 11
+// Never seen by Lox code. Marks a global slot that hasn't been defined yet.
+#define TAG_UNDEFINED 4 // 100
+// Small integers are the quiet NaNs with bit 48 set, the int32 in the low 32
+// bits. The tags above and object pointers keep bits 48 and 49 clear.
+#define INT_TAG   ((uint64_t)0x7ffd000000000000)
+#define INT_MASK  ((uint64_t)0xffff000000000000)
 
 
 typedef uint64_t Value;
@@ -23,12 +29,20 @@ typedef uint64_t Value;
 // Converts false->true then compares
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+// Numbers are either doubles or small integers. Both print, compare and hash
+// the same for the same value.
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value)       (((value) & INT_MASK) == INT_TAG)
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value) \
   (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
-#define AS_NUMBER(value)    valueToNum(value)
+#define AS_NUMBER(value)    numberToDouble(value)
+// Only for values known to be doubles
+#define AS_DOUBLE(value)    valueToNum(value)
+#define AS_INT(value)       ((int32_t)(uint32_t)(value))
 #define AS_OBJ(value) \
   ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -36,7 +50,12 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_VAL(num)    ((Value)(INT_TAG | (uint32_t)(int32_t)(num)))
+// The sum or difference of two small integers, which always fits in 64 bits.
+// Goes back to a double if it overflowed.
+#define WIDE_INT_VAL(num) wideIntToValue(num)
 #define OBJ_VAL(obj) \
   (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -53,6 +72,14 @@ static inline Value numToValue(double num) {
   return value;
 }
 
+static inline double numberToDouble(Value value) {
+  return IS_INT(value) ? AS_INT(value) : valueToNum(value);
+}
+
+static inline Value wideIntToValue(int64_t num) {
+  return num == (int32_t) num ? INT_VAL(num) : NUMBER_VAL((double) num);
+}
+
 #else
 
 // Tagged unions are the pairing of a ValueType with a value itself.
@@ -61,6 +88,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ, // Heap allocated values
+    VAL_UNDEFINED, // Marks a global slot that hasn't been defined yet
 } ValueType;
 
 // [type, value]
@@ -79,17 +107,28 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)  ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+// Every number is a double without NaN boxing, so the small integer fast paths
+// drop out.
+#define IS_DOUBLE(value)  IS_NUMBER(value)
+#define IS_INT(value)     false
 
 // Macros to read a value
 #define AS_BOOL(value) (((value).as.boolean))
 #define AS_NUMBER(value) (((value).as.number))
 #define AS_OBJ(value) (((value).as.obj))
+#define AS_DOUBLE(value) AS_NUMBER(value)
+#define AS_INT(value) ((int32_t)(value).as.number)
 
 // Macros to produce a value
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*) object}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
+// Wraps to 32 bits like the NaN boxed form, which the bit operations rely on.
+#define INT_VAL(value)      NUMBER_VAL((double)(int32_t)(value))
+#define WIDE_INT_VAL(value) NUMBER_VAL((double)(value))
 #endif
 
 typedef struct {
@@ -1,27 +1,46 @@
 #include "vm.h"
 
+#include <math.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "aot.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "registers.h"
 
 VM vm;
 
+// The address of each opcode's handler in run(), which threadChunk() stores
+// in the threaded code. run() publishes them when initVM() calls it without
+// any frames. Stays NULL with switch dispatch, where opcodes are stored.
+static void *const *handlers = NULL;
+// The same for runTraced(), which threadChunk() uses instead with tracing on.
+static void *const *tracedHandlers = NULL;
+// The same for the register engine's runRegisters() and translateRegisters().
+static void *const *registerHandlers = NULL;
+
+static InterpretResult run();
+static InterpretResult runTraced();
+static InterpretResult runRegisters();
+static bool tailCall(ObjClosure *closure, int argCount);
+static bool tailCallValue(Value callee, int argCount);
+
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
 static void resetStack() {
-  // The stack is defined statically inside the VM struct, so it need not be
-  // allocated/freed.
+  // Keeps whatever capacity the stacks have grown to.
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
@@ -42,7 +61,8 @@ static void runtimeError(const char *format, ...) {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
+    size_t slot = frame->ip - function->chunk.threaded - 1;
+    int instruction = function->chunk.threadedOffsets[slot];
     fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
@@ -61,17 +81,205 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globals, OBJ_VAL(name), &slot)) return (int) AS_NUMBER(slot);
+
+  // Growing the arrays can trigger a GC that must see the name.
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globals, OBJ_VAL(name), NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
 static void defineNative(const char *name, NativeFn function) {
   // The pushing and popping is because the stack isn't GC'd
-  push(OBJ_VAL(copyString(name, (int) strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, vm.stack[0], vm.stack[1]);
-  pop();
-  pop();
+  int slot = globalSlot(copyString(name, (int) strlen(name)));
+  vm.globalValues.values[slot] = pop();
+}
+
+// The math builtins take numbers, small integers included. They report
+// anything else as a runtime error and return UNDEFINED_VAL.
+static bool checkNumbers(const char *name, int arity, int argCount, Value *args) {
+  if (argCount != arity) {
+    runtimeError("Expected %d arguments but got %d.", arity, argCount);
+    return false;
+  }
+  for (int i = 0; i < argCount; i++) {
+    if (!IS_NUMBER(args[i])) {
+      runtimeError("Arguments to %s() must be numbers.", name);
+      return false;
+    }
+  }
+  return true;
+}
+
+static Value sqrtNative(int argCount, Value *args) {
+  if (!checkNumbers("sqrt", 1, argCount, args)) return UNDEFINED_VAL;
+  return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+}
+
+static Value floorNative(int argCount, Value *args) {
+  if (!checkNumbers("floor", 1, argCount, args)) return UNDEFINED_VAL;
+  if (IS_INT(args[0])) return args[0];
+  return NUMBER_VAL(floor(AS_NUMBER(args[0])));
+}
+
+static Value absNative(int argCount, Value *args) {
+  if (!checkNumbers("abs", 1, argCount, args)) return UNDEFINED_VAL;
+  if (IS_INT(args[0])) return WIDE_INT_VAL(llabs(AS_INT(args[0])));
+  return NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+}
+
+static Value minNative(int argCount, Value *args) {
+  if (!checkNumbers("min", 2, argCount, args)) return UNDEFINED_VAL;
+  return AS_NUMBER(args[1]) < AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+
+static Value maxNative(int argCount, Value *args) {
+  if (!checkNumbers("max", 2, argCount, args)) return UNDEFINED_VAL;
+  return AS_NUMBER(args[1]) > AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+
+static Value powNative(int argCount, Value *args) {
+  if (!checkNumbers("pow", 2, argCount, args)) return UNDEFINED_VAL;
+  return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+}
+
+// The bit operations work on numbers as 32 bit integers, which they wrap
+// around to like JavaScript's.
+static int32_t toInt32(Value value) {
+  if (IS_INT(value)) return AS_INT(value);
+  double number = AS_NUMBER(value);
+  if (!isfinite(number)) return 0;
+  number = fmod(trunc(number), 4294967296.0);
+  if (number < 0) number += 4294967296.0;
+  return (int32_t) (uint32_t) number;
+}
+
+static Value bitAndNative(int argCount, Value *args) {
+  if (!checkNumbers("bitAnd", 2, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL(toInt32(args[0]) & toInt32(args[1]));
+}
+
+static Value bitOrNative(int argCount, Value *args) {
+  if (!checkNumbers("bitOr", 2, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL(toInt32(args[0]) | toInt32(args[1]));
+}
+
+static Value bitXorNative(int argCount, Value *args) {
+  if (!checkNumbers("bitXor", 2, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL(toInt32(args[0]) ^ toInt32(args[1]));
+}
+
+static Value bitNotNative(int argCount, Value *args) {
+  if (!checkNumbers("bitNot", 1, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL(~toInt32(args[0]));
+}
+
+// Shifts by the low five bits of the count. shiftRight() keeps the sign.
+static Value shiftLeftNative(int argCount, Value *args) {
+  if (!checkNumbers("shiftLeft", 2, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL((int32_t) ((uint32_t) toInt32(args[0]) << (toInt32(args[1]) & 31)));
+}
+
+static Value shiftRightNative(int argCount, Value *args) {
+  if (!checkNumbers("shiftRight", 2, argCount, args)) return UNDEFINED_VAL;
+  return INT_VAL(toInt32(args[0]) >> (toInt32(args[1]) & 31));
+}
+
+const Intrinsic intrinsics[] = {
+  {"sqrt", 1, sqrtNative},
+  {"floor", 1, floorNative},
+  {"abs", 1, absNative},
+  {"min", 2, minNative},
+  {"max", 2, maxNative},
+  {"pow", 2, powNative},
+  {"bitAnd", 2, bitAndNative},
+  {"bitOr", 2, bitOrNative},
+  {"bitXor", 2, bitXorNative},
+  {"bitNot", 1, bitNotNative},
+  {"shiftLeft", 2, shiftLeftNative},
+  {"shiftRight", 2, shiftRightNative},
+  {NULL, 0, NULL}
+};
+
+int findIntrinsic(ObjString *name) {
+  for (int id = 0; intrinsics[id].name != NULL; id++) {
+    if (strlen(intrinsics[id].name) == (size_t) name->length &&
+        memcmp(intrinsics[id].name, name->chars, name->length) == 0) {
+      return id;
+    }
+  }
+  return -1;
 }
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+// Makes sure the stack holds [count] values from [base] on, growing it up to
+// STACK_MAX. Growing moves the stack, so every pointer into it is relocated:
+// stackTop, each frame's slots and the open upvalues' locations.
+static bool ensureStack(Value *base, int count) {
+  int needed = (int) (base - vm.stack) + count + STACK_RESERVE;
+  if (needed <= vm.stackCapacity) return true;
+  if (needed > STACK_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+  if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+  Value *oldStack = vm.stack;
+  vm.stack = GROW_ARRAY(Value, vm.stack, vm.stackCapacity, capacity);
+  vm.stackCapacity = capacity;
+  if (vm.stack == oldStack) return true;
+
+  vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = vm.stack + (upvalue->location - oldStack);
+  }
+  return true;
+}
+
+// Where frames running [function] start, translating its chunk for the
+// engine in use on the first call.
+static Code *entryCode(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->threaded == NULL) {
+    if (vm.engine == ENGINE_REGISTER) {
+      translateRegisters(function, registerHandlers);
+    } else {
+      threadChunk(chunk, vm.traceExecution ? tracedHandlers : handlers);
+    }
+  }
+  return chunk->threaded;
+}
+
+#ifdef JIT
+// Count a call or back-edge towards compiling [function] to machine code.
+static void warmUp(ObjFunction *function) {
+  if (!vm.jit || vm.engine != ENGINE_STACK || function->jit != NULL) return;
+  if (++function->hotness == JIT_THRESHOLD) jitCompile(function);
+}
+#endif
+
+// The register engine's frames are marked up to their maxStack, not to the
+// stack top, so the registers past the arguments can't keep values left
+// behind by earlier calls.
+static void clearRegisters(Value *slots, int argCount, int maxStack) {
+  for (int i = argCount + 1; i < maxStack; i++) {
+    slots[i] = NIL_VAL;
+  }
+}
 
 static bool call(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
@@ -84,11 +292,30 @@ static bool call(ObjClosure *closure, int argCount) {
     runtimeError("Stack overflow.");
     return false;
   }
+  if (vm.frameCount == vm.frameCapacity) {
+    int capacity = GROW_CAPACITY(vm.frameCapacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, vm.frameCapacity, capacity);
+    vm.frameCapacity = capacity;
+  }
+
+  // The compiler worked out how deep the callee's stack gets, so this one
+  // check covers every push the call makes.
+  if (!ensureStack(vm.stackTop - argCount - 1, closure->function->maxStack)) {
+    return false;
+  }
 
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+  if (vm.engine == ENGINE_REGISTER) {
+    clearRegisters(frame->slots, argCount, closure->function->maxStack);
+  }
+  // Translating allocates, so the frame must be complete enough for the GC.
+  frame->ip = entryCode(closure->function);
+#ifdef JIT
+  warmUp(closure->function);
+#endif
   return true;
 }
 
@@ -122,6 +349,8 @@ static bool callValue(Value callee, int argCount) {
         NativeFn native = AS_NATIVE(callee);
         // Invocation of the C function
         Value result = native(argCount, vm.stackTop - argCount);
+        // The native reported an error, which reset the stack.
+        if (IS_UNDEFINED(result)) return false;
         vm.stackTop -= argCount + 1;
         push(result);
         return true;
@@ -135,6 +364,97 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
+// Runs intrinsic [id] in place of the call whose callee and arguments are on
+// top of the stack, if the callee is still the builtin.
+static IntrinsicStatus callIntrinsic(int id) {
+  const Intrinsic *intrinsic = &intrinsics[id];
+  Value callee = peek(intrinsic->arity);
+  if (!IS_NATIVE(callee) || AS_NATIVE(callee) != intrinsic->function) {
+    return INTRINSIC_REPLACED;
+  }
+  Value result = intrinsic->function(intrinsic->arity, vm.stackTop - intrinsic->arity);
+  if (IS_UNDEFINED(result)) return INTRINSIC_ERROR;
+  vm.stackTop -= intrinsic->arity;
+  vm.stackTop[-1] = result;
+  return INTRINSIC_DONE;
+}
+
+#ifdef DEBUG_INLINE_CACHE_STATS
+#define CACHE_HIT() (vm.cacheHits++)
+#define CACHE_MISS() (vm.cacheMisses++)
+#else
+#define CACHE_HIT() ((void) 0)
+#define CACHE_MISS() ((void) 0)
+#endif
+
+// The entry [cache] holds for [shape], or NULL.
+static inline CacheEntry *findCacheEntry(InlineCache *cache, ObjShape *shape) {
+  for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// Remember what a name resolved to on instances with [shape]. Once every entry
+// is taken by another shape the site is megamorphic and stays uncached.
+static void updateCache(InlineCache *cache, ObjShape *shape, int slot,
+                        ObjShape *transition, ObjClosure *method) {
+  // Instances in dictionary mode have no layout to remember.
+  if (shape == NULL) return;
+
+  CacheEntry *entry = findCacheEntry(cache, shape);
+  if (entry == NULL) entry = findCacheEntry(cache, NULL);
+  if (entry == NULL) return;
+
+  entry->shape = shape;
+  entry->slot = slot;
+  entry->transition = transition;
+  entry->method = method;
+  entry->inlineSlot = -1;
+  if (method != NULL && method->function->inlineKind == INLINE_FIELD) {
+    entry->inlineSlot = shapeSlot(shape, AS_STRING(method->function->inlineValue));
+  }
+}
+
+// The slot of the field [cache] resolved its name to on [instance], or -1.
+static inline int cachedField(InlineCache *cache, ObjInstance *instance) {
+  CacheEntry *entry = findCacheEntry(cache, instance->shape);
+  if (entry == NULL || entry->transition != NULL) return -1;
+  return entry->slot;
+}
+
+// The entry for the method [cache] resolved its name to on [instance], or
+// NULL.
+static inline CacheEntry *cachedMethod(InlineCache *cache, ObjInstance *instance) {
+  CacheEntry *entry = findCacheEntry(cache, instance->shape);
+  if (entry == NULL || entry->slot >= 0 || entry->method == NULL) return NULL;
+  // The entry was filled for a shape without a field of this name, so no
+  // field shadows the method.
+  return entry;
+}
+
+// Do what the method of [entry] would when invoked on [instance] with the
+// [argCount] arguments on top of the stack, if that is simple enough to need
+// no frame. The entry's shape guards the receiver's class, which fixes the
+// method and where its field is. Returns false if the method must be called.
+static inline bool invokeInline(CacheEntry *entry, ObjInstance *instance, int argCount) {
+  ObjFunction *function = entry->method->function;
+  if (argCount != function->arity) return false;
+  switch (function->inlineKind) {
+    case INLINE_FIELD:
+      // A shape without the field leaves the error to the call.
+      if (entry->inlineSlot < 0) return false;
+      vm.stackTop[-1] = instance->fields[entry->inlineSlot];
+      return true;
+    case INLINE_CONSTANT:
+      vm.stackTop -= argCount;
+      vm.stackTop[-1] = function->inlineValue;
+      return true;
+    default:
+      return false;
+  }
+}
+
 static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
   Value method;
   // Find the desired method in the class
@@ -146,7 +466,9 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+// OP_INVOKE, or OP_TAIL_INVOKE when [tail] is set: the method call reuses the
+// current frame like tailCallValue().
+static bool invoke(ObjString *name, int argCount, InlineCache *cache, bool tail) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -155,16 +477,29 @@ static bool invoke(ObjString *name, int argCount) {
   }
 
   ObjInstance *instance = AS_INSTANCE(receiver);
+  CacheEntry *cached = cachedMethod(cache, instance);
+  if (cached != NULL) {
+    CACHE_HIT();
+    if (invokeInline(cached, instance, argCount)) return true;
+    return tail ? tailCall(cached->method, argCount) : call(cached->method, argCount);
+  }
+  CACHE_MISS();
 
   // Checks if we are invoking a field? This is possible if the field was
   // assigned a function.
   Value value;
-  if (tableGet(&instance->fields, OBJ_VAL(name), &value)) {
+  if (getField(instance, name, &value)) {
     vm.stackTop[-argCount - 1] = value;
-    return callValue(value, argCount);
+    return tail ? tailCallValue(value, argCount) : callValue(value, argCount);
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  Value method;
+  if (!tableGet(&instance->klass->methods, OBJ_VAL(name), &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  updateCache(cache, instance->shape, -1, NULL, AS_CLOSURE(method));
+  return tail ? tailCall(AS_CLOSURE(method), argCount) : call(AS_CLOSURE(method), argCount);
 }
 
 // Return true if we found a method
@@ -183,6 +518,54 @@ static bool bindMethod(ObjClass *klass, ObjString *name) {
   return true;
 }
 
+// The slow path of OP_GET_PROPERTY for the instance on top of the stack.
+// Resolves [name] through the cached method or the tables and fills [cache].
+static bool getProperty(ObjString *name, InlineCache *cache) {
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  CacheEntry *cached = cachedMethod(cache, instance);
+  ObjClosure *method;
+  if (cached != NULL) {
+    CACHE_HIT();
+    method = cached->method;
+  } else {
+    CACHE_MISS();
+    Value field;
+    if (getField(instance, name, &field)) {
+      if (instance->shape != NULL) {
+        updateCache(cache, instance->shape, shapeSlot(instance->shape, name), NULL, NULL);
+      }
+      vm.stackTop[-1] = field; // Replace the instance
+      return true;
+    }
+
+    Value value;
+    if (!tableGet(&instance->klass->methods, OBJ_VAL(name), &value)) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+    method = AS_CLOSURE(value);
+    updateCache(cache, instance->shape, -1, NULL, method);
+  }
+
+  ObjBoundMethod *bound = newBoundMethod(peek(0), method);
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+// The slow path of OP_SET_PROPERTY. Sets the field and remembers where it
+// ended up, along with the shape change if the store added it.
+static void setProperty(ObjInstance *instance, ObjString *name, Value value, InlineCache *cache) {
+  CACHE_MISS();
+  ObjShape *shape = instance->shape;
+  setField(instance, name, value);
+  if (shape == NULL || instance->shape == NULL) return;
+
+  int slot = shapeSlot(instance->shape, name);
+  ObjShape *transition = instance->shape != shape ? instance->shape : NULL;
+  updateCache(cache, shape, slot, transition, NULL);
+}
+
 static ObjUpvalue *captureUpvalue(Value *local) {
   // The VM keeps track of all open upvalues in case multiple upvalues from
   // different functions point to the same local variable.
@@ -228,6 +611,49 @@ static void closeUpvalues(Value *last) {
   }
 }
 
+// A call in tail position. A Lox function takes over the current frame: its
+// callee and arguments slide down onto the caller's slots and the CallFrame
+// is reused, so tail recursion runs in constant stack space.
+static bool tailCall(ObjClosure *closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d", closure->function->arity, argCount);
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  if (!ensureStack(frame->slots, closure->function->maxStack)) {
+    return false;
+  }
+
+  Code *entry = entryCode(closure->function);
+
+  // The caller's locals are going away, so whatever captured them keeps its
+  // own copy.
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = entry;
+  if (vm.engine == ENGINE_REGISTER) {
+    clearRegisters(frame->slots, argCount, closure->function->maxStack);
+  }
+#ifdef JIT
+  warmUp(closure->function);
+#endif
+  return true;
+}
+
+// Anything but a Lox function is called normally, and the OP_RETURN after
+// the call returns its result.
+static bool tailCallValue(Value callee, int argCount) {
+  if (IS_CLOSURE(callee)) return tailCall(AS_CLOSURE(callee), argCount);
+  if (IS_BOUND_METHOD(callee)) {
+    vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+    return tailCall(AS_BOUND_METHOD(callee)->method, argCount);
+  }
+  return callValue(callee, argCount);
+}
+
 static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
@@ -258,8 +684,350 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
+// The parts of instructions that code compiled out of the interpreter, the
+// JIT's machine code and the C from --emit-c, calls back into the VM for.
+// They work on vm.stackTop like push() and pop() do.
+
+// OP_ADD on anything but two numbers
+static bool addNonNumbers() {
+  if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+    runtimeError("Operands must be two numbers or two strings");
+    return false;
+  }
+  concatenate();
+  return true;
+}
+
+static bool getPropertyOnStack(ObjString *name, InlineCache *cache) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  int slot = cachedField(cache, instance);
+  if (slot < 0) return getProperty(name, cache);
+  CACHE_HIT();
+  vm.stackTop[-1] = instance->fields[slot];
+  return true;
+}
+
+static bool setPropertyOnStack(ObjString *name, InlineCache *cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have fields.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  CacheEntry *entry = findCacheEntry(cache, instance->shape);
+  if (entry != NULL && entry->slot >= 0) {
+    CACHE_HIT();
+    if (entry->transition == NULL) {
+      instance->fields[entry->slot] = peek(0);
+    } else {
+      addField(instance, entry->transition, peek(0));
+    }
+  } else {
+    setProperty(instance, name, peek(0), cache);
+  }
+  Value value = pop();
+  vm.stackTop[-1] = value;
+  return true;
+}
+
+// OP_CLOSURE, whose upvalue operands start at [operands]
+static void closureOnStack(ObjFunction *function, Code *operands) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  ObjClosure *closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    int isLocal = operands[2 * i].operand;
+    int index = operands[2 * i + 1].operand;
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+}
+
+// OP_RETURN. Returns false if the frame popped was the script's.
+static inline bool returnFromFrame() {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  if (vm.frameCount == 0) return false;
+  vm.stackTop = frame->slots;
+  push(result);
+  return true;
+}
+
+#ifdef JIT
+void jitRuntimeError(const char *message) {
+  runtimeError("%s", message);
+}
+
+void jitUndefinedVariable(int slot) {
+  runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+}
+
+bool jitAdd() {
+  return addNonNumbers();
+}
+
+bool jitGetProperty(ObjString *name, InlineCache *cache) {
+  return getPropertyOnStack(name, cache);
+}
+
+bool jitSetProperty(ObjString *name, InlineCache *cache) {
+  return setPropertyOnStack(name, cache);
+}
+
+void jitPrint(Value value) {
+  printValue(value);
+  printf("\n");
+}
+
+void jitClosure(ObjFunction *function, Code *operands) {
+  closureOnStack(function, operands);
+}
+
+void jitCloseUpvalue() {
+  closeUpvalues(vm.stackTop - 1);
+  vm.stackTop--;
+}
+
+void *jitCall(int argCount) {
+  if (!callValue(peek(argCount), argCount)) return NULL;
+  return jitResume();
+}
+
+IntrinsicStatus jitIntrinsic(int id) {
+  return callIntrinsic(id);
+}
+
+void *jitTailCall(int argCount) {
+  if (!tailCallValue(peek(argCount), argCount)) return NULL;
+  return jitResume();
+}
+
+void *jitInvoke(ObjString *name, int argCount, InlineCache *cache) {
+  if (!invoke(name, argCount, cache, false)) return NULL;
+  return jitResume();
+}
+
+void *jitTailInvoke(ObjString *name, int argCount, InlineCache *cache) {
+  if (!invoke(name, argCount, cache, true)) return NULL;
+  return jitResume();
+}
+
+void *jitSuperInvoke(ObjString *name, int argCount) {
+  ObjClass *superclass = AS_CLASS(pop());
+  if (!invokeFromClass(superclass, name, argCount)) return NULL;
+  return jitResume();
+}
+
+// The script's own return never gets here, it leaves to the interpreter.
+void *jitReturn() {
+  returnFromFrame();
+  return jitResume();
+}
+#endif
+
+void aotRuntimeError(const char *message) {
+  runtimeError("%s", message);
+}
+
+void aotUndefinedVariable(int slot) {
+  runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+}
+
+bool aotAdd() {
+  return addNonNumbers();
+}
+
+bool aotGetProperty(ObjString *name, InlineCache *cache) {
+  return getPropertyOnStack(name, cache);
+}
+
+bool aotSetProperty(ObjString *name, InlineCache *cache) {
+  return setPropertyOnStack(name, cache);
+}
+
+bool aotGetSuper(ObjString *name) {
+  ObjClass *superclass = AS_CLASS(pop());
+  return bindMethod(superclass, name);
+}
+
+void aotClosure(ObjFunction *function, Code *operands) {
+  closureOnStack(function, operands);
+}
+
+void aotCloseUpvalue() {
+  closeUpvalues(vm.stackTop - 1);
+  vm.stackTop--;
+}
+
+void aotClass(ObjString *name) {
+  push(OBJ_VAL(newClass(name)));
+}
+
+bool aotInherit() {
+  Value superclass = peek(1);
+  if (!IS_CLASS(superclass)) {
+    runtimeError("Superclass must be a class.");
+    return false;
+  }
+  tableAddAll(&AS_CLASS(superclass)->methods, &AS_CLASS(peek(0))->methods);
+  vm.stackTop--;
+  return true;
+}
+
+void aotMethod(ObjString *name) {
+  defineMethod(name);
+}
+
+// Calls to natives, and to classes without an initialiser, are over by the
+// time they return. The caller carries on in its own frame after those.
+AotStatus aotCall(int argCount) {
+  // Most calls are to closures, which always push a frame.
+  Value callee = peek(argCount);
+  if (IS_CLOSURE(callee)) {
+    return call(AS_CLOSURE(callee), argCount) ? AOT_SWITCH : AOT_ERROR;
+  }
+  int frameCount = vm.frameCount;
+  if (!callValue(callee, argCount)) return AOT_ERROR;
+  return vm.frameCount != frameCount ? AOT_SWITCH : AOT_CONTINUE;
+}
+
+// A tail call to a Lox function restarts the same frame from its first
+// instruction.
+AotStatus aotTailCall(int argCount) {
+  int frameCount = vm.frameCount;
+  Code *ip = vm.frames[frameCount - 1].ip;
+  if (!tailCallValue(peek(argCount), argCount)) return AOT_ERROR;
+  if (vm.frameCount != frameCount) return AOT_SWITCH;
+  return vm.frames[frameCount - 1].ip != ip ? AOT_SWITCH : AOT_CONTINUE;
+}
+
+AotStatus aotIntrinsic(int id) {
+  switch (callIntrinsic(id)) {
+    case INTRINSIC_ERROR:
+      return AOT_ERROR;
+    case INTRINSIC_DONE:
+      return AOT_CONTINUE;
+    default:
+      return aotCall(intrinsics[id].arity);
+  }
+}
+
+AotStatus aotInvoke(ObjString *name, int argCount, InlineCache *cache) {
+  int frameCount = vm.frameCount;
+  if (!invoke(name, argCount, cache, false)) return AOT_ERROR;
+  return vm.frameCount != frameCount ? AOT_SWITCH : AOT_CONTINUE;
+}
+
+// Like aotTailCall(), a method the inline cache runs in place carries on here.
+AotStatus aotTailInvoke(ObjString *name, int argCount, InlineCache *cache) {
+  int frameCount = vm.frameCount;
+  Code *ip = vm.frames[frameCount - 1].ip;
+  if (!invoke(name, argCount, cache, true)) return AOT_ERROR;
+  if (vm.frameCount != frameCount) return AOT_SWITCH;
+  return vm.frames[frameCount - 1].ip != ip ? AOT_SWITCH : AOT_CONTINUE;
+}
+
+AotStatus aotSuperInvoke(ObjString *name, int argCount) {
+  ObjClass *superclass = AS_CLASS(pop());
+  if (!invokeFromClass(superclass, name, argCount)) return AOT_ERROR;
+  return AOT_SWITCH;
+}
+
+AotStatus aotReturn() {
+  return returnFromFrame() ? AOT_SWITCH : AOT_DONE;
+}
+
+#ifdef DEBUG_COUNT_NGRAMS
+#define NGRAM_MAX 4
+#define NGRAM_TABLE_SIZE 65536
+
+typedef struct {
+  // The length of the n-gram above the opcodes packed a byte each, the first
+  // in the lowest byte. 0 while the entry is unused.
+  uint64_t key;
+  uint64_t count;
+} NgramCount;
+
+static struct {
+  NgramCount counts[NGRAM_TABLE_SIZE];
+  int used;
+  // The last few instructions that ran back to back, newest last.
+  uint8_t window[NGRAM_MAX];
+  int windowLength;
+  Chunk *chunk;
+  // Where the instruction after the newest one in the window starts.
+  int nextOffset;
+} ngrams;
+
+static void countNgram(uint64_t key) {
+  uint32_t index = (uint32_t) ((key * 0x9E3779B97F4A7C15u) >> 48) % NGRAM_TABLE_SIZE;
+  while (ngrams.counts[index].key != key) {
+    if (ngrams.counts[index].key == 0) {
+      // Keep one entry free so probing always ends.
+      if (ngrams.used == NGRAM_TABLE_SIZE - 1) return;
+      ngrams.counts[index].key = key;
+      ngrams.used++;
+      break;
+    }
+    index = (index + 1) % NGRAM_TABLE_SIZE;
+  }
+  ngrams.counts[index].count++;
+}
+
+// Count the n-grams ending in the instruction about to be executed.
+static void countNgrams(CallFrame *frame) {
+  Chunk *chunk = &frame->closure->function->chunk;
+  int offset = chunk->threadedOffsets[frame->ip - chunk->threaded];
+  uint8_t opcode = threadedOpcode(chunk->code[offset]);
+
+  // Only instructions that follow each other in the bytecode can be fused,
+  // so a taken jump, a call or a return starts over.
+  if (chunk != ngrams.chunk || offset != ngrams.nextOffset) {
+    ngrams.windowLength = 0;
+  }
+  ngrams.chunk = chunk;
+  ngrams.nextOffset = offset + instructionLength(chunk, offset);
+
+  if (ngrams.windowLength == NGRAM_MAX) {
+    memmove(ngrams.window, ngrams.window + 1, NGRAM_MAX - 1);
+    ngrams.windowLength--;
+  }
+  ngrams.window[ngrams.windowLength++] = opcode;
+
+  for (int n = 2; n <= ngrams.windowLength; n++) {
+    uint64_t key = (uint64_t) n << 32;
+    for (int i = 0; i < n; i++) {
+      key |= (uint64_t) ngrams.window[ngrams.windowLength - n + i] << (8 * i);
+    }
+    countNgram(key);
+  }
+}
+
+// One "ngram <count> <opcode>..." line per sequence.
+static void printNgrams() {
+  for (int i = 0; i < NGRAM_TABLE_SIZE; i++) {
+    NgramCount *entry = &ngrams.counts[i];
+    if (entry->key == 0) continue;
+
+    fprintf(stderr, "ngram %llu", (unsigned long long) entry->count);
+    int length = (int) (entry->key >> 32);
+    for (int j = 0; j < length; j++) {
+      fprintf(stderr, " %s", opInfo[(entry->key >> (8 * j)) & 0xFF].name);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+#endif
+
 void initVM() {
-  resetStack();
   // No allocated objects at the start.
   // Objects are linked list nodes pointing to other objects.
   // The end of the linked list chain should be null so we know when we've
@@ -272,355 +1040,601 @@ void initVM() {
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.engine = ENGINE_STACK;
+#ifdef JIT
+  vm.jit = true;
+  vm.perfMap = false;
+#endif
+  vm.printCode = false;
+  vm.traceExecution = false;
+  vm.logGC = false;
+  vm.optimize = false;
+  vm.repl = false;
+
+  // Empty until the GC can run, since allocating them might trigger it.
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
+  resetStack();
+
+#ifdef DEBUG_INLINE_CACHE_STATS
+  vm.cacheHits = 0;
+  vm.cacheMisses = 0;
+#endif
+
   initTable(&vm.globals);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.strings);
 
   // Copy string may trigger a GC and read uninitialised memory :/
   vm.initString = NULL;
+
+  vm.frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.stack = ALLOCATE(Value, STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
+  resetStack();
+
   vm.initString = copyString("init", 4);
 
   defineNative("clock", clockNative);
+  for (const Intrinsic *intrinsic = intrinsics; intrinsic->name != NULL; intrinsic++) {
+    defineNative(intrinsic->name, intrinsic->function);
+  }
+
+  if (handlers == NULL) run();
+  if (tracedHandlers == NULL) runTraced();
+  if (registerHandlers == NULL) runRegisters();
 }
 
 void freeVM() {
+#ifdef DEBUG_INLINE_CACHE_STATS
+  fprintf(stderr, "inline caches: %zu hits, %zu misses\n", vm.cacheHits, vm.cacheMisses);
+#endif
+#ifdef DEBUG_COUNT_NGRAMS
+  printNgrams();
+#endif
+
   freeTable(&vm.globals);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.strings);
   vm.initString = NULL;
   freeObjects();
+  FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
 }
 
-static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+// Print the stack followed by the instruction about to be executed.
+static void traceExecution(CallFrame *frame) {
+  printf("          ");
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[ ");
+    if (vm.logGC && IS_OBJ(*slot)) {
+      // Print the pointer the GC log knows the object by
+      printf("ptr:%p ", AS_OBJ(*slot));
+    }
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  Chunk *chunk = &frame->closure->function->chunk;
+  disassembleInstruction(chunk, chunk->threadedOffsets[frame->ip - chunk->threaded]);
+}
+
+#ifdef DEBUG_COUNT_NGRAMS
+#define COUNT_NGRAMS() countNgrams(frame)
+#else
+#define COUNT_NGRAMS() ((void) 0)
+#endif
+
+// run() is the loop in run.h as is. runTraced() is the same loop with
+// traceExecution() before every instruction, and runs instead when
+// vm.traceExecution is set. run() never checks for tracing.
+#define RUN run
+#define RUN_HANDLERS handlers
+#ifdef DEBUG_COUNT_NGRAMS
+#define TRACE_INSTRUCTION() (STORE_FRAME(), COUNT_NGRAMS())
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif
+#include "run.h"
+#undef RUN
+#undef RUN_HANDLERS
+#undef TRACE_INSTRUCTION
+
+#define RUN runTraced
+#define RUN_HANDLERS tracedHandlers
+#define TRACE_INSTRUCTION()                                                    \
+  (STORE_FRAME(), traceExecution(frame), COUNT_NGRAMS())
+#include "run.h"
+#undef RUN
+#undef RUN_HANDLERS
+#undef TRACE_INSTRUCTION
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_CONSTANT_LONG()                                                   \
-  (frame->closure->function->chunk.constants                                                         \
-       .values[(READ_BYTE() << 16) + (READ_BYTE() << 8) + READ_BYTE()])
-// Read a pair of bytes as a big endian uint16_t
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-// The do block permits additional semicolons when the macro is used so
-// BINARY_OP(+); compiles.
-#define BINARY_OP(valueType, op)                                               \
+// The register engine. Runs the code translateRegisters() makes, in which
+// operands name the frame's slots directly. It keeps the frame state in the
+// same locals as run() and uses run.h's macros, which stay defined until the
+// end of this function. Instructions it keeps in stack form run the same DO_
+// body as run() with the stack top at the instruction's depth. Execution
+// tracing and n-gram counting only follow the stack engine.
+static InterpretResult runRegisters() {
+// Register code never has machine code.
+#undef JIT_ENTRY
+#define JIT_ENTRY() ((void) 0)
+#define READ_REGISTER() (slots[READ_OPERAND()])
+#define REGISTER_OP(valueType, op)                                             \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    int dst = READ_OPERAND();                                                  \
+    Value a = READ_REGISTER();                                                 \
+    Value b = READ_REGISTER();                                                 \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                      \
   } while (false)
+// REGISTER_OP with the small integer fast path of INT_NUMBER_OP.
+#define REGISTER_INT_OP(intType, valueType, op)                                \
+  do {                                                                         \
+    int dst = READ_OPERAND();                                                  \
+    Value a = READ_REGISTER();                                                 \
+    Value b = READ_REGISTER();                                                 \
+    if (IS_INT(a) && IS_INT(b)) {                                              \
+      slots[dst] = intType((int64_t) AS_INT(a) op AS_INT(b));                  \
+    } else {                                                                   \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                    \
+        RUNTIME_ERROR("Operands must be numbers.");                            \
+      }                                                                        \
+      slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                    \
+    }                                                                          \
+  } while (false)
+#define REGISTER_IMMEDIATE_OP(intType, valueType, op, message)                 \
+  do {                                                                         \
+    int dst = READ_OPERAND();                                                  \
+    Value a = READ_REGISTER();                                                 \
+    Value b = READ_CONSTANT();                                                 \
+    if (IS_INT(a)) {                                                           \
+      slots[dst] = intType((int64_t) AS_INT(a) op AS_INT(b));                  \
+    } else {                                                                   \
+      if (!IS_NUMBER(a)) {                                                     \
+        RUNTIME_ERROR(message);                                                \
+      }                                                                        \
+      slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                    \
+    }                                                                          \
+  } while (false)
+#define REGISTER_COMPARE_JUMP(condition)                                       \
+  do {                                                                         \
+    Value aValue = READ_REGISTER();                                            \
+    Value bValue = READ_REGISTER();                                            \
+    if (!IS_NUMBER(aValue) || !IS_NUMBER(bValue)) {                            \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double a = AS_NUMBER(aValue);                                              \
+    double b = AS_NUMBER(bValue);                                              \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+#define REGISTER_EQUAL_JUMP(jumpIfEqual)                                       \
+  do {                                                                         \
+    Value a = READ_REGISTER();                                                 \
+    Value b = READ_REGISTER();                                                 \
+    Code *target = READ_TARGET();                                              \
+    if (valuesEqual(a, b) == (jumpIfEqual)) ip = target;                       \
+  } while (false)
+#define REGISTER_COMPARE_IMMEDIATE_JUMP(condition)                             \
+  do {                                                                         \
+    Value aValue = READ_REGISTER();                                            \
+    if (!IS_NUMBER(aValue)) {                                                  \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double a = AS_NUMBER(aValue);                                              \
+    double b = AS_NUMBER(READ_CONSTANT());                                     \
+    Code *target = READ_TARGET();                                              \
+    if (condition) ip = target;                                                \
+  } while (false)
+// A stack form instruction starts with its stack depth.
+#define STACK_FORM(op)                                                         \
+    CASE(REG_##op):                                                            \
+      stackTop = slots + READ_OPERAND();                                       \
+      DO_OP_##op();                                                            \
+      DISPATCH();
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    // Print the stack
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-#ifdef DEBUG_LOG_GC
-      if (IS_OBJ(*slot)) {
-        // Print the pointer
-        printf("ptr:%p ", AS_OBJ(*slot));
-      }
-#endif
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.code));
-#endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_CONSTANT_LONG: {
-        Value constant = READ_CONSTANT_LONG();
-        push(constant);
-        break;
-      }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        Value nameKey = OBJ_VAL(name);
-        Value value;
-        if (!tableGet(&vm.globals, nameKey, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-        }
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        ObjString *name = READ_STRING();
-        Value nameKey = OBJ_VAL(name);
-        tableSet(&vm.globals, nameKey, peek(0));
-        pop();
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        Value nameKey = OBJ_VAL(name);
-        if (tableSet(&vm.globals, nameKey, peek(0))) {
-          tableDelete(&vm.globals, nameKey);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_GET_UPVALUE: {
-        // Functions have an upvalue array. Slot is an index into it.
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
-      case OP_GET_SUPER: {
-        ObjString *name = READ_STRING();
-        ObjClass *superclass = AS_CLASS(pop());
+#ifdef COMPUTED_GOTO
+  static void *dispatchTable[] = {
+          [REG_MOVE] = &&REG_MOVE,
+          [REG_LOAD] = &&REG_LOAD,
+          [REG_GET_GLOBAL] = &&REG_GET_GLOBAL,
+          [REG_DEFINE_GLOBAL] = &&REG_DEFINE_GLOBAL,
+          [REG_SET_GLOBAL] = &&REG_SET_GLOBAL,
+          [REG_GET_UPVALUE] = &&REG_GET_UPVALUE,
+          [REG_SET_UPVALUE] = &&REG_SET_UPVALUE,
+          [REG_GET_PROPERTY] = &&REG_GET_PROPERTY,
+          [REG_EQUAL] = &&REG_EQUAL,
+          [REG_GREATER] = &&REG_GREATER,
+          [REG_LESS] = &&REG_LESS,
+          [REG_ADD] = &&REG_ADD,
+          [REG_SUBTRACT] = &&REG_SUBTRACT,
+          [REG_MULTIPLY] = &&REG_MULTIPLY,
+          [REG_DIVIDE] = &&REG_DIVIDE,
+          [REG_NOT] = &&REG_NOT,
+          [REG_NEGATE] = &&REG_NEGATE,
+          [REG_ADD_IMM] = &&REG_ADD_IMM,
+          [REG_SUBTRACT_IMM] = &&REG_SUBTRACT_IMM,
+          [REG_GREATER_IMM] = &&REG_GREATER_IMM,
+          [REG_LESS_IMM] = &&REG_LESS_IMM,
+          [REG_PRINT] = &&REG_PRINT,
+          [REG_JUMP] = &&REG_JUMP,
+          [REG_JUMP_IF_FALSE] = &&REG_JUMP_IF_FALSE,
+          [REG_JUMP_IF_NOT_EQUAL] = &&REG_JUMP_IF_NOT_EQUAL,
+          [REG_JUMP_IF_EQUAL] = &&REG_JUMP_IF_EQUAL,
+          [REG_JUMP_IF_NOT_LESS] = &&REG_JUMP_IF_NOT_LESS,
+          [REG_JUMP_IF_NOT_LESS_EQUAL] = &&REG_JUMP_IF_NOT_LESS_EQUAL,
+          [REG_JUMP_IF_NOT_GREATER] = &&REG_JUMP_IF_NOT_GREATER,
+          [REG_JUMP_IF_NOT_GREATER_EQUAL] = &&REG_JUMP_IF_NOT_GREATER_EQUAL,
+          [REG_JUMP_IF_NOT_LESS_IMM] = &&REG_JUMP_IF_NOT_LESS_IMM,
+          [REG_JUMP_IF_NOT_LESS_EQUAL_IMM] = &&REG_JUMP_IF_NOT_LESS_EQUAL_IMM,
+          [REG_JUMP_IF_NOT_GREATER_IMM] = &&REG_JUMP_IF_NOT_GREATER_IMM,
+          [REG_JUMP_IF_NOT_GREATER_EQUAL_IMM] = &&REG_JUMP_IF_NOT_GREATER_EQUAL_IMM,
+          [REG_RETURN] = &&REG_RETURN,
+          [REG_SET_PROPERTY] = &&REG_SET_PROPERTY,
+          [REG_GET_SUPER] = &&REG_GET_SUPER,
+          [REG_CALL] = &&REG_CALL,
+          [REG_TAIL_CALL] = &&REG_TAIL_CALL,
+          [REG_INTRINSIC] = &&REG_INTRINSIC,
+          [REG_INVOKE] = &&REG_INVOKE,
+          [REG_TAIL_INVOKE] = &&REG_TAIL_INVOKE,
+          [REG_SUPER_INVOKE] = &&REG_SUPER_INVOKE,
+          [REG_CLOSURE] = &&REG_CLOSURE,
+          [REG_CLOSE_UPVALUE] = &&REG_CLOSE_UPVALUE,
+          [REG_CLASS] = &&REG_CLASS,
+          [REG_INHERIT] = &&REG_INHERIT,
+          [REG_METHOD] = &&REG_METHOD,
+  };
 
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
-      }
-      case OP_GET_PROPERTY: {
-        // We can only use the .property notation on class instances
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+  if (vm.frameCount == 0) {
+    // Called from initVM() to publish the handler addresses.
+    registerHandlers = dispatchTable;
+    return INTERPRET_OK;
+  }
 
-        ObjInstance *instance = AS_INSTANCE(peek(0));
-        ObjString *name = READ_STRING();
-        Value nameKey = OBJ_VAL(name);
+#undef DISPATCH
+#define DISPATCH() goto *READ_CODE()->handler
+#else
+  if (vm.frameCount == 0) return INTERPRET_OK;
 
-        Value value;
-        if (tableGet(&instance->fields, nameKey, &value)) {
-          pop(); // Instance
-          push(value);
-          break;
-        }
+#undef INTERPRET_LOOP
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  switch (READ_CODE()->opcode)
+#endif
 
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+  CallFrame *frame;
+  register Code *ip;
+  register Value *slots;
+  register Value *stackTop = vm.stackTop;
+  LOAD_FRAME();
 
-        ObjInstance *instance = AS_INSTANCE(peek(1));
-        ObjString *key = READ_STRING();
-        Value keyv = OBJ_VAL(key);
-        tableSet(&instance->fields, keyv, peek(0));
-        Value value = pop();
-        pop(); // Pop the instance
-        push(value);
-        break;
-      }
-      case OP_EQUAL_PRESERVE: {
-        Value b = pop();
-        Value a = peek(0);
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
-      }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD:
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-          // BINARY_OP(NUMBER_VAL, +);
-        } else {
-          runtimeError("Operands must be two numbers or two strings");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-        // Get the value on the stack, negate it and return it to the
-        // stack.
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        // Optimisation (without benchmark) to update the stack top in
-        // place
-        //  *(vm.stackTop - 1) = -*(vm.stackTop - 1);
-        break;
-      case OP_PRINT:
-        printValue(pop());
-        printf("\n");
-        break;
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+  INTERPRET_LOOP
+  {
+    CASE(REG_MOVE): {
+      int dst = READ_OPERAND();
+      slots[dst] = READ_REGISTER();
+      DISPATCH();
+    }
+    CASE(REG_LOAD): {
+      int dst = READ_OPERAND();
+      slots[dst] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(REG_GET_GLOBAL): {
+      int dst = READ_OPERAND();
+      int slot = READ_OPERAND();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0)))
-          frame->ip += offset;
-        break;
+      slots[dst] = value;
+      DISPATCH();
+    }
+    CASE(REG_DEFINE_GLOBAL): {
+      int slot = READ_OPERAND();
+      vm.globalValues.values[slot] = READ_REGISTER();
+      DISPATCH();
+    }
+    CASE(REG_SET_GLOBAL): {
+      int slot = READ_OPERAND();
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        // Jump backwards by 'offset' bytes.
-        frame->ip -= offset;
-        break;
+      vm.globalValues.values[slot] = READ_REGISTER();
+      DISPATCH();
+    }
+    CASE(REG_GET_UPVALUE): {
+      int dst = READ_OPERAND();
+      slots[dst] = *frame->closure->upvalues[READ_OPERAND()]->location;
+      DISPATCH();
+    }
+    CASE(REG_SET_UPVALUE): {
+      int upvalue = READ_OPERAND();
+      *frame->closure->upvalues[upvalue]->location = READ_REGISTER();
+      DISPATCH();
+    }
+    CASE(REG_GET_PROPERTY): {
+      int dst = READ_OPERAND();
+      Value receiver = READ_REGISTER();
+      int top = READ_OPERAND();
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      if (!IS_INSTANCE(receiver)) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
+
+      ObjInstance *instance = AS_INSTANCE(receiver);
+      int slot = cachedField(cache, instance);
+      if (slot >= 0) {
+        CACHE_HIT();
+        slots[dst] = instance->fields[slot];
+      } else {
+        // getProperty() works on the top of the stack.
+        stackTop = slots + top;
+        PUSH(receiver);
+        STORE_FRAME();
+        if (!getProperty(name, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        // callValue() will produce a frame on the CallFrame stack for the new fn.
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_STACK();
+        slots[dst] = POP();
       }
-      case OP_INVOKE: {
-        ObjString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      DISPATCH();
+    }
+    CASE(REG_EQUAL): {
+      int dst = READ_OPERAND();
+      Value a = READ_REGISTER();
+      Value b = READ_REGISTER();
+      slots[dst] = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
+    }
+    CASE(REG_GREATER):
+      REGISTER_INT_OP(BOOL_VAL, BOOL_VAL, >);
+      DISPATCH();
+    CASE(REG_LESS):
+      REGISTER_INT_OP(BOOL_VAL, BOOL_VAL, <);
+      DISPATCH();
+    CASE(REG_ADD): {
+      int dst = READ_OPERAND();
+      Value a = READ_REGISTER();
+      Value b = READ_REGISTER();
+      int top = READ_OPERAND();
+      if (IS_INT(a) && IS_INT(b)) {
+        slots[dst] = WIDE_INT_VAL((int64_t) AS_INT(a) + AS_INT(b));
+      } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        // concatenate() works on the top of the stack.
+        stackTop = slots + top;
+        PUSH(a);
+        PUSH(b);
+        STORE_FRAME();
+        concatenate();
+        LOAD_STACK();
+        slots[dst] = POP();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings");
       }
-      case OP_SUPER_INVOKE: {
-        ObjString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjClass *superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      DISPATCH();
+    }
+    CASE(REG_SUBTRACT):
+      REGISTER_INT_OP(WIDE_INT_VAL, NUMBER_VAL, -);
+      DISPATCH();
+    CASE(REG_MULTIPLY):
+      REGISTER_OP(NUMBER_VAL, *);
+      DISPATCH();
+    CASE(REG_DIVIDE):
+      REGISTER_OP(NUMBER_VAL, /);
+      DISPATCH();
+    CASE(REG_NOT): {
+      int dst = READ_OPERAND();
+      slots[dst] = BOOL_VAL(isFalsey(READ_REGISTER()));
+      DISPATCH();
+    }
+    CASE(REG_NEGATE): {
+      int dst = READ_OPERAND();
+      Value value = READ_REGISTER();
+      if (!IS_NUMBER(value)) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_CLOSURE: {
-        ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure *closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
+      slots[dst] = NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(REG_ADD_IMM):
+      REGISTER_IMMEDIATE_OP(WIDE_INT_VAL, NUMBER_VAL, +,
+                            "Operands must be two numbers or two strings");
+      DISPATCH();
+    CASE(REG_SUBTRACT_IMM):
+      REGISTER_IMMEDIATE_OP(WIDE_INT_VAL, NUMBER_VAL, -, "Operands must be numbers.");
+      DISPATCH();
+    CASE(REG_GREATER_IMM):
+      REGISTER_IMMEDIATE_OP(BOOL_VAL, BOOL_VAL, >, "Operands must be numbers.");
+      DISPATCH();
+    CASE(REG_LESS_IMM):
+      REGISTER_IMMEDIATE_OP(BOOL_VAL, BOOL_VAL, <, "Operands must be numbers.");
+      DISPATCH();
+    CASE(REG_PRINT):
+      printValue(READ_REGISTER());
+      printf("\n");
+      DISPATCH();
+    CASE(REG_JUMP): {
+      Code *target = READ_TARGET();
+      ip = target;
+      DISPATCH();
+    }
+    CASE(REG_JUMP_IF_FALSE): {
+      Value condition = READ_REGISTER();
+      Code *target = READ_TARGET();
+      if (isFalsey(condition)) ip = target;
+      DISPATCH();
+    }
+    CASE(REG_JUMP_IF_NOT_EQUAL):
+      REGISTER_EQUAL_JUMP(false);
+      DISPATCH();
+    CASE(REG_JUMP_IF_EQUAL):
+      REGISTER_EQUAL_JUMP(true);
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_LESS):
+      REGISTER_COMPARE_JUMP(!(a < b));
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_LESS_EQUAL):
+      REGISTER_COMPARE_JUMP(a > b);
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_GREATER):
+      REGISTER_COMPARE_JUMP(!(a > b));
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_GREATER_EQUAL):
+      REGISTER_COMPARE_JUMP(a < b);
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_LESS_IMM):
+      REGISTER_COMPARE_IMMEDIATE_JUMP(!(a < b));
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_LESS_EQUAL_IMM):
+      REGISTER_COMPARE_IMMEDIATE_JUMP(a > b);
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_GREATER_IMM):
+      REGISTER_COMPARE_IMMEDIATE_JUMP(!(a > b));
+      DISPATCH();
+    CASE(REG_JUMP_IF_NOT_GREATER_EQUAL_IMM):
+      REGISTER_COMPARE_IMMEDIATE_JUMP(a < b);
+      DISPATCH();
+    CASE(REG_RETURN): {
+      Value result = READ_REGISTER();
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = slots;
+        return INTERPRET_OK;
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        // The returned value will be top of stack
-        // We save it, pop the function, then restore it
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          // This wasn't a `return` keyword but just the end of the <script>
-          pop();
-          return INTERPRET_OK;
-        }
 
-        vm.stackTop = frame->slots;
-        // restore the return value
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_CLASS:
-        // Create a new class object with the given name.
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjClass *subclass = AS_CLASS(peek(0));
-        // Inheriting a class simply copies all methods from the superclass to
-        // the subclass.
-        // This doesn't affect inheritance as we perform this before parsing
-        // the class methods
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        break;
-      }
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
+      // The callee's slot zero is the caller's register for the result.
+      slots[0] = result;
+      LOAD_FRAME();
+      DISPATCH();
     }
+    STACK_FORM(SET_PROPERTY)
+    STACK_FORM(GET_SUPER)
+    STACK_FORM(CALL)
+    STACK_FORM(TAIL_CALL)
+    STACK_FORM(INTRINSIC)
+    STACK_FORM(INVOKE)
+    STACK_FORM(TAIL_INVOKE)
+    STACK_FORM(SUPER_INVOKE)
+    STACK_FORM(CLOSURE)
+    STACK_FORM(CLOSE_UPVALUE)
+    STACK_FORM(CLASS)
+    STACK_FORM(INHERIT)
+    STACK_FORM(METHOD)
   }
 
-#undef READ_BYTE
+  // Only reachable with an opcode the switch doesn't know about.
+  return INTERPRET_RUNTIME_ERROR;
+
+#undef READ_REGISTER
+#undef REGISTER_OP
+#undef REGISTER_INT_OP
+#undef REGISTER_IMMEDIATE_OP
+#undef REGISTER_COMPARE_JUMP
+#undef REGISTER_EQUAL_JUMP
+#undef REGISTER_COMPARE_IMMEDIATE_JUMP
+#undef STACK_FORM
+#undef STORE_FRAME
+#undef LOAD_STACK
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_CODE
+#undef READ_OPERAND
 #undef READ_CONSTANT
-#undef READ_CONSTANT_LONG
-#undef READ_SHORT
+#undef READ_TARGET
+#undef READ_CACHE
 #undef READ_STRING
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef INT_NUMBER_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef DO_OP_CONSTANT
+#undef DO_OP_NIL
+#undef DO_OP_TRUE
+#undef DO_OP_FALSE
+#undef DO_OP_POP
+#undef DO_OP_POPN
+#undef DO_OP_GET_LOCAL
+#undef DO_OP_SET_LOCAL
+#undef DO_OP_GET_GLOBAL
+#undef DO_OP_SET_GLOBAL
+#undef DO_OP_GET_UPVALUE
+#undef DO_OP_SET_UPVALUE
+#undef DO_OP_GET_PROPERTY
+#undef DO_OP_EQUAL
+#undef DO_OP_GREATER
+#undef DO_OP_LESS
+#undef DO_OP_ADD
+#undef DO_OP_SUBTRACT
+#undef DO_OP_MULTIPLY
+#undef DO_OP_DIVIDE
+#undef DO_OP_NOT
+#undef DO_OP_NEGATE
+#undef DO_OP_JUMP
+#undef DO_OP_JUMP_IF_FALSE
+#undef DO_OP_LOOP
+#undef RUN_JIT
+#undef JIT_ENTRY
+#undef JIT_BACK_EDGE
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef DO_OP_JUMP_IF_NOT_EQUAL
+#undef DO_OP_JUMP_IF_EQUAL
+#undef DO_OP_JUMP_IF_NOT_LESS
+#undef DO_OP_JUMP_IF_NOT_LESS_EQUAL
+#undef DO_OP_JUMP_IF_NOT_GREATER
+#undef DO_OP_JUMP_IF_NOT_GREATER_EQUAL
+#undef IMMEDIATE_OP
+#undef COMPARE_IMMEDIATE_JUMP
+#undef DO_OP_ADD_IMM
+#undef DO_OP_SUBTRACT_IMM
+#undef DO_OP_GREATER_IMM
+#undef DO_OP_LESS_IMM
+#undef DO_OP_JUMP_IF_NOT_LESS_IMM
+#undef DO_OP_JUMP_IF_NOT_LESS_EQUAL_IMM
+#undef DO_OP_JUMP_IF_NOT_GREATER_IMM
+#undef DO_OP_JUMP_IF_NOT_GREATER_EQUAL_IMM
+#undef NUMBERS_OP
+#undef INT_NUMBERS_OP
+#undef NUMBER_IMMEDIATE_OP
+#undef NUMBERS_COMPARE_JUMP
+#undef NUMBER_COMPARE_IMMEDIATE_JUMP
+#undef DO_OP_GET_SUPER
+#undef DO_OP_SET_PROPERTY
+#undef DO_OP_CALL
+#undef DO_OP_TAIL_CALL
+#undef DO_OP_INTRINSIC
+#undef DO_OP_INVOKE
+#undef DO_OP_TAIL_INVOKE
+#undef DO_OP_SUPER_INVOKE
+#undef DO_OP_CLOSURE
+#undef DO_OP_CLOSE_UPVALUE
+#undef DO_OP_CLASS
+#undef DO_OP_INHERIT
+#undef DO_OP_METHOD
+#undef FUSED_2
+#undef FUSED_3
+#undef FUSED_4
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
 }
 
 InterpretResult interpret(const char *source) {
@@ -638,17 +1652,33 @@ InterpretResult interpret(const char *source) {
   call(closure, 0);
 
   // Execute the bytecode
-  return run();
+  if (vm.engine == ENGINE_REGISTER) return runRegisters();
+  return vm.traceExecution ? runTraced() : run();
 }
 
-void push(Value value) {
-  // An if statement here isn't ideal given that it's at the heart of the VM.
-  // We pay the price of it per instruction. But I haven't profiled it and
-  // having this check here earlier would've saved some time debugging
-  // segfaults.
-  if (vm.stackTop - vm.stack >= STACK_MAX) {
-    runtimeError("Stack overflow m8.");
+// The trampoline of programs built from emitted C. Each function runs its
+// frame until a call or return switches to another one.
+InterpretResult interpretCompiled(ObjFunction *script) {
+  push(OBJ_VAL(script));
+  ObjClosure *closure = newClosure(script);
+  pop();
+  push(OBJ_VAL(closure));
+  call(closure, 0);
+
+  for (;;) {
+    switch (vm.frames[vm.frameCount - 1].closure->function->aot()) {
+      case AOT_DONE:
+        return INTERPRET_OK;
+      case AOT_ERROR:
+        return INTERPRET_RUNTIME_ERROR;
+      default:
+        break;
+    }
   }
+}
+
+// Unchecked, call() makes sure each frame has room for everything it pushes.
+void push(Value value) {
   // The stack top points to the next empty space.
   *vm.stackTop = value;
   vm.stackTop++;
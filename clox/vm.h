@@ -6,30 +6,81 @@
 #include "value.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow on demand up to these hard limits. The
+// build can change them, see CLOX_FRAMES_MAX and CLOX_STACK_MAX in
+// CMakeLists.txt.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 65536
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1024 * 1024)
+#endif
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+// Room kept above a frame's maxStack for the values helpers such as
+// shapeTransition() push to keep objects away from the GC.
+#define STACK_RESERVE 8
 
 // An ongoing function call
 typedef struct {
   ObjClosure *closure;
-  uint8_t *ip;
+  // Points into the threaded (or register) code of the closure's chunk
+  Code *ip;
   // A pointer to the first value stack slot available to the function
   Value *slots;
 } CallFrame;
 
+// How the VM executes code, chosen before the first interpret().
+typedef enum {
+  // run() on the threaded stack bytecode
+  ENGINE_STACK,
+  // runRegisters() on the three-address form from translateRegisters()
+  ENGINE_REGISTER
+} Engine;
+
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  Engine engine;
+#ifdef JIT
+  // Compile hot functions to machine code. Only the stack engine runs it.
+  bool jit;
+  // Name the machine code for perf in /tmp/perf-<pid>.map (--perf-map)
+  bool perfMap;
+#endif
+  // Debugging output, off unless main() turns it on. Disassemble each
+  // function once compiled, print the stack and each instruction the stack
+  // engine runs, and log what the GC allocates, marks and frees.
+  bool printCode;
+  bool traceExecution;
+  bool logGC;
+  // Run the optimizer.h passes on each function once compiled (-O)
+  bool optimize;
+  // Each line is compiled on its own (the REPL), so the compiler can't know
+  // which globals later code declares again.
+  bool repl;
+  CallFrame *frames;
   // The number of ongoing function calls
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // Growing the stack moves it, see ensureStack() in vm.c.
+  Value *stack;
+  int stackCapacity;
   // The next position to push an element to
   Value *stackTop;
+  // Global variables live in slots the compiler resolves names to. [globals]
+  // maps each name to its slot and [globalNames] maps back for error
+  // messages. A slot holds UNDEFINED_VAL until its variable is defined.
   Table globals;
+  ValueArray globalValues;
+  ValueArray globalNames;
   Table strings;
   ObjString *initString;
   // open = upvalue pointing to local variable on stack
   // closed = variable has moved onto stack
   ObjUpvalue *openUpvalues;
+#ifdef DEBUG_INLINE_CACHE_STATS
+  size_t cacheHits;
+  size_t cacheMisses;
+#endif
 
   size_t bytesAllocated;
   size_t nextGC;
@@ -49,12 +100,39 @@ typedef enum {
 
 extern VM vm;
 
+// A builtin the compiler calls through OP_INTRINSIC when a call names its
+// global with [arity] arguments.
+typedef struct {
+  const char *name;
+  int arity;
+  NativeFn function;
+} Intrinsic;
+
+// The math builtins, indexed by the operand of OP_INTRINSIC.
+extern const Intrinsic intrinsics[];
+
+// How running an intrinsic in place of a call went.
+typedef enum {
+  // The error is reported.
+  INTRINSIC_ERROR,
+  // The result took the callee's place.
+  INTRINSIC_DONE,
+  // The global holds something else now, which has to be called instead.
+  INTRINSIC_REPLACED
+} IntrinsicStatus;
+
+// The index in intrinsics[] of the builtin called [name], or -1.
+int findIntrinsic(ObjString *name);
+
 void initVM();
 
 void freeVM();
 
 InterpretResult interpret(const char *source);
 
+// The slot of the global variable [name], allocating one if it's new.
+int globalSlot(ObjString *name);
+
 void push(Value value);
 
 Value pop();